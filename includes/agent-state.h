@@ -0,0 +1,47 @@
+#ifndef __AGENT_STATE_H
+#define __AGENT_STATE_H
+
+#include <stdint.h>
+
+#include "segment.h"
+
+#define AGENT_STATE_FILE     ".agent-state"
+#define AGENT_STATE_MAGIC    0x75767374  /* "uvst" */
+#define AGENT_STATE_VERSION  1
+#define AGENT_STATE_MAX_PODS 1024        // as many as RDMA sessions
+#define AGENT_STATE_NAME_LEN 64
+
+/* a pod served by the host agent, in the slot of the control plane it had */
+struct agent_state_entry {
+  uint32_t pid;                          // 0 if the slot is free, written last
+  uint32_t num_parts;                    // segments, one per container
+  uint64_t generation;                   // of the segment of container 0, when last checkpointed
+  uint8_t memfd;                         // name is of a memfd, else of a POSIX shm object
+  uint8_t reserved[7];
+  char name[AGENT_STATE_NAME_LEN];
+  uint32_t pids[SEGMENT_MAX_PARTS];      // of the containers, as verified at registration
+};
+
+/**
+ * Pod table of the host agent, kept in a small file mapped in memory so that
+ * it survives the agent: a restarted agent maps the segments of the pods
+ * still alive again and reconnects them to agent-nic, the pods keep
+ * publishing meanwhile and never register again. Entries are updated in
+ * place, a crash at any point leaves at worst a stale entry, which is
+ * validated against the segment header on restore.
+ */
+struct agent_state {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;                   // of the segments, a restart must keep it
+  uint32_t max_pods;
+  struct agent_state_entry pods[AGENT_STATE_MAX_PODS];
+};
+
+int agent_state_open(const char *path, uint32_t block_size, struct agent_state_entry *old);
+void agent_state_set(int slot, const uint32_t *pids, uint32_t num_parts, const char *name, int memfd);
+void agent_state_checkpoint(int slot, uint64_t generation);
+void agent_state_clear(int slot);
+int agent_state_reopen(const struct agent_state_entry *e);
+
+#endif
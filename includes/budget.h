@@ -0,0 +1,42 @@
+#ifndef __BUDGET_H
+#define __BUDGET_H
+
+#include <stdint.h>
+
+#define BUDGET_MAX_CLASSES 4
+
+/**
+ * Token-bucket budget on the READ traffic of agent-nic, in bytes/s and READs/s,
+ * shared by all connections. Rounds belong to a priority class, 0 the highest
+ * (the resolution tier of the round, see agent-nic.c): class c is only admitted
+ * while at least c / num_classes of the bucket is left, so that when demand
+ * exceeds the budget slow, bulky rounds give way first. An admitted round is
+ * charged in full and may leave the bucket in debt, it is repaid before
+ * anything else is admitted.
+ */
+struct budget_bucket {
+  double rate;          // per second, 0 if unlimited
+  double capacity;
+  double tokens;
+};
+
+/* per class counters, requested is what rounds would have read at their class */
+struct budget_class_stats {
+  uint64_t rounds;
+  uint64_t degraded;    // read at a lower class
+  uint64_t skipped;     // not read at all
+  uint64_t req_bytes;
+  uint64_t req_reads;
+  uint64_t granted_bytes;
+  uint64_t granted_reads;
+};
+
+void budget_init(double bytes_per_s, double reads_per_s, double burst_s, int classes);
+void budget_configure(double bytes_per_s, double reads_per_s, double burst_s, int classes);
+int budget_admit(int prio, uint32_t bytes, int reads);
+void budget_charge(uint32_t bytes, int reads);
+void budget_account(int cls, uint32_t req_bytes, int req_reads, uint32_t bytes, int reads);
+void budget_round(int cls, int degraded, int skipped);
+void budget_report(void);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __CGROUP_STATS_H
+#define __CGROUP_STATS_H
+
+#include <stdint.h>
+
+#include "segment.h"
+
+#ifndef CGROUP_ROOT
+#define CGROUP_ROOT             "/sys/fs/cgroup"   // cgroup v2 hierarchy
+#endif
+#define CGROUP_STATS_MAX_GROUPS 256
+#define CGROUP_STATS_MAX_PODS   1024   // segments sampled into
+#define CGROUP_STATS_DEFAULT_MS 100
+
+/**
+ * Resource usage of pods from their cgroup v2 files, sampled by the host
+ * agent into the host stats line of their segments, where agent-nic reads it
+ * with the header. The files of a cgroup are opened when the first segment
+ * of a process in it is attached and kept open, every sample reads them with
+ * a single pread each. A sample sweeps all the pods at once and reads each
+ * cgroup once, however many segments it feeds (e.g. containers sharing it).
+ */
+int cgroup_stats_attach(uint32_t pid, struct segment_stats *stats);
+void cgroup_stats_detach(struct segment_stats *stats);
+void cgroup_stats_sample(void);
+
+/**
+ * cgroup.events of the cgroup of process pid, opened while the process is
+ * alive so that, once it is gone, we can still tell whether anything else
+ * in its cgroup (e.g. its children) may hold its memory, see
+ * cgroup_populated. The host agent recycles the segments of a pod only when
+ * none can.
+ */
+int cgroup_events_open(uint32_t pid);
+int cgroup_populated(int events_fd);
+
+#endif
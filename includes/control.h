@@ -0,0 +1,18 @@
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+#include <stdio.h>
+
+#define CONTROL_LINE_LEN 512
+
+/**
+ * Local control socket: clients send one text command per line, e.g. with
+ * `socat - UNIX-CONNECT:<path>`, the handler writes its reply to out. Commands
+ * are served one at a time, by a thread of their own; handlers must leave the
+ * changes for the threads owning the state to apply.
+ */
+typedef void (*control_handler)(char *cmd, FILE *out);
+
+int control_start(const char *path, control_handler handler);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __COST_MODEL_H
+#define __COST_MODEL_H
+
+#include <stdint.h>
+
+/* rounds in single-shot mode before we try a header-first round to refresh estimates */
+#define COST_PROBE_ROUNDS 32
+
+/**
+ * Per-connection model of READ cost, t = wrs * rtt + bytes * ns_per_byte
+ * (WRs of a round are not pipelined, see build_params), plus the observed
+ * behaviour of the pod: how often its generation changes and how many bytes
+ * and WRs a header-first round fetches when it does.
+ * All estimates are exponentially weighted moving averages.
+ */
+struct read_cost {
+  double rtt_ns;
+  double ns_per_byte;
+  double p_change;
+  double body_bytes;
+  double body_wrs;
+  int has_rtt;
+  int has_bw;
+  int rounds_since_probe;
+};
+
+void cost_model_init(struct read_cost *cm);
+void cost_model_head_sample(struct read_cost *cm, double t_ns);
+void cost_model_bulk_sample(struct read_cost *cm, double t_ns, uint32_t bytes, int wrs);
+void cost_model_round(struct read_cost *cm, int changed, uint32_t body_bytes, int body_wrs);
+int cost_model_header_first(struct read_cost *cm, uint32_t head_bytes, uint32_t full_bytes, int full_wrs);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* lanes of crc32c_batch, enough to hide the latency of the CRC instructions */
+#define CRC32C_LANES 3
+
+/**
+ * CRC32C (Castagnoli) of the chunks of pod segments, with the CRC instructions
+ * of ARMv8 or SSE4.2 when the CPU has them, a table otherwise. crc32c_batch
+ * computes n CRCs of len bytes each, CRC32C_LANES buffers at a time
+ * interleaved: one buffer is bound by the latency of the instruction, several
+ * independent ones run at its throughput.
+ */
+uint32_t crc32c(const void *buf, size_t len);
+void crc32c_batch(const void *const *bufs, size_t len, int n, uint32_t *crcs);
+const char * crc32c_impl(void);
+
+#endif
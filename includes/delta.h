@@ -0,0 +1,53 @@
+#ifndef __DELTA_H
+#define __DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "segment.h"
+
+#define DELTA_MAX_RANGES 64
+
+/**
+ * Per-round deltas of cumulative counters: given the same array of uint64_t
+ * counters in two snapshots, delta[i] = cur[i] - prev[i], bit i of changed is
+ * set if the counter moved and bit i of reset if it went backwards (the
+ * counter restarted, e.g. the process did), in which case delta[i] = cur[i].
+ * Masks have a bit per counter in (n + 63) / 64 words. Returns the number of
+ * counters that changed.
+ * The kernel is picked for the CPU on first use: NEON on the ARM cores of the
+ * SmartNIC, AVX2 on x86 hosts that have it, else scalar.
+ */
+typedef size_t (*delta_fn)(const uint64_t *prev, const uint64_t *cur, size_t n,
+                           uint64_t *delta, uint64_t *changed, uint64_t *reset);
+
+struct delta_kernel {
+  const char *name;
+  delta_fn fn;
+};
+
+/* a counter slot of a segment, its counters at off in the snapshots */
+struct delta_range {
+  uint32_t off;
+  uint32_t count;
+  uint32_t first;                // index of its first counter in the delta arrays
+  uint32_t mask_off;             // of its first word in the masks, each range starts a word
+  int tier;
+};
+
+/* the counter slots of a segment layout, in the order of the directory */
+struct delta_map {
+  uint32_t layout_hash;
+  int num_ranges;
+  uint32_t num_counters;
+  uint32_t mask_words;
+  struct delta_range ranges[DELTA_MAX_RANGES];
+};
+
+size_t delta_counters(const uint64_t *prev, const uint64_t *cur, size_t n,
+                      uint64_t *delta, uint64_t *changed, uint64_t *reset);
+const char * delta_kernel_name(void);
+int delta_kernels(const struct delta_kernel **kernels);
+void delta_map_build(const struct segment_layout *layout, const void *base, struct delta_map *map);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __LATENCY_HIST_H
+#define __LATENCY_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define LAT_HIST_SUB_BITS 4                              // 16 buckets per power of two, < 7% error
+#define LAT_HIST_SUB      (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_BUCKETS  (LAT_HIST_SUB * 42)            // up to 2^44 ns, about 4.8 hours
+
+/**
+ * Log-linear histogram of durations in ns: exact below LAT_HIST_SUB, then
+ * LAT_HIST_SUB buckets per power of two. Recording is a few relaxed atomic
+ * adds, several threads may record into the same histogram and another one
+ * read it meanwhile, e.g. the control socket.
+ */
+struct latency_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[LAT_HIST_BUCKETS];
+};
+
+void lat_hist_record(struct latency_hist *h, uint64_t ns);
+uint64_t lat_hist_percentile(const struct latency_hist *h, double q);
+void lat_hist_print(const struct latency_hist *h, const char *name, FILE *out);
+void lat_hist_dump(const struct latency_hist *h, const char *name, FILE *out);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef __NIC_STATS_H
+#define __NIC_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NIC_STATS_MAGIC    0x75766e73   /* "uvns" */
+#define NIC_STATS_VERSION  1
+#define NIC_STATS_MAX_PODS 1024         // as many as RDMA sessions
+#define NIC_STATS_STAGES   7            // of the READ pipeline, see agent-nic.c
+
+enum nic_stats_state { NIC_POD_FREE, NIC_POD_CONNECTED, NIC_POD_CLOSED };
+
+/* written by the tick thread */
+struct nic_stats_global {
+  uint32_t seq;
+  uint32_t reserved;
+  uint64_t round;
+  uint64_t tick_ns;
+  uint64_t tick_late_ns;        // of the last tick
+  uint64_t tick_late_max_ns;    // since start
+} __attribute__((aligned(64)));
+
+/* a connection, written by its poller, but state by the rdma_cm thread */
+struct nic_stats_pod {
+  uint32_t seq;
+  uint32_t state;
+  uint32_t pid;                 // of container 0, from the last copy
+  uint32_t num_parts;
+  uint64_t rounds;
+  uint64_t skipped;             // over budget
+  uint64_t errors;              // failed completions
+  uint64_t bytes;               // READ
+  uint64_t reads;               // WRs posted, including control line WRITEs
+  uint64_t generation;
+  uint64_t read_ns;             // CLOCK_REALTIME of the last read
+  uint64_t read_interval_ns;    // since the read before, for rates
+  uint32_t level;               // tier of the last round
+  uint32_t stalled;
+  uint32_t cq_hwm;               // most completions polled from the CQ at once
+  uint32_t cq_size;
+  uint64_t stage_ns[NIC_STATS_STAGES];   // of the last round
+} __attribute__((aligned(64)));
+
+/**
+ * Live state of agent-nic in a named shared memory object, for viewers such
+ * as uview-top to map read-only. Each section has a single writer, which
+ * brackets its updates by seq like the host stats of segments: odd while
+ * writing, readers copy a section and retry if seq moved. Writers use plain
+ * relaxed stores on the hot path, no syscalls nor locks, and never wait for
+ * readers.
+ */
+struct nic_stats {
+  uint32_t magic;               // written last
+  uint32_t version;
+  uint32_t max_pods;
+  uint32_t num_stages;
+  uint64_t start_ns;            // CLOCK_REALTIME agent-nic started
+  uint32_t connections;         // open, updated atomically
+  uint32_t reserved;
+  struct nic_stats_global global;
+  struct nic_stats_pod pods[NIC_STATS_MAX_PODS];
+};
+
+static inline void nic_stats_write_begin(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void nic_stats_write_end(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+#define NIC_STATS_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#define NIC_STATS_ADD(field, v) __atomic_store_n(&(field), (field) + (v), __ATOMIC_RELAXED)
+
+struct nic_stats * nic_stats_create(const char *name, uint64_t tick_ns);
+const struct nic_stats * nic_stats_attach(const char *name);
+int nic_stats_read(const uint32_t *seq, void *dst, const void *src, size_t len);
+
+#endif
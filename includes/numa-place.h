@@ -0,0 +1,35 @@
+#ifndef __NUMA_PLACE_H
+#define __NUMA_PLACE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CORES 256
+
+/* where the host agent places the segments of a new pod */
+enum numa_policy {
+  NUMA_POLICY_NONE,   // first touch, wherever the agent or the pod runs
+  NUMA_POLICY_NIC,    // node of the RNIC port the pod will be read through
+  NUMA_POLICY_POD,    // node of the CPU container 0 last ran on
+};
+
+/**
+ * NUMA placement without libnuma: nodes of RNICs and processes from sysfs and
+ * procfs, memory policy and page location through the mbind and move_pages
+ * system calls. Nodes are -1 when unknown, e.g. on single-node hosts whose
+ * devices report no node, and every call is then a no-op.
+ */
+int numa_parse_policy(const char *name);
+int numa_device_node(const char *ibdev);
+int numa_cpu_node(int cpu);
+int numa_pid_node(uint32_t pid);
+int numa_bind(void *addr, size_t len, int node);
+int numa_count_pages(void *addr, size_t len, uint64_t *pages);
+
+/* CQ pollers are pinned round-robin on a configured list of cores, e.g. "2,4-7" */
+int numa_set_cores(const char *list);
+int numa_pin_thread(pthread_t thread);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __PROJECTION_H
+#define __PROJECTION_H
+
+#include "segment.h"
+
+#define PROJECTION_MAX_RULES   64
+#define PROJECTION_MAX_METRICS 32
+
+/**
+ * Projection of the metrics of a pod (by pid) or of all the pods of a
+ * service (by service name) onto the subset of slots agent-nic READs.
+ * Rules are loaded from a file with one rule per line:
+ *
+ *   <pid|service|*> <metric>[,<metric>...]
+ *
+ * A pid rule wins over a service rule, which wins over the wildcard.
+ * Pods without a matching rule are read in full.
+ *
+ * Projections are compiled per resolution tier: the plan for tier t only
+ * covers the selected slots of tier <= t.
+ */
+struct projection_rule {
+  char key[SEGMENT_SERVICE_LEN];
+  int num_metrics;
+  char metrics[PROJECTION_MAX_METRICS][SEGMENT_NAME_LEN];
+};
+
+int projection_load(const char *path);
+void projection_clear(void);
+unsigned projection_version(void);
+int projection_compile(const struct segment_layout *layout, const void *base, int max_tier,
+                       struct read_plan *plan);
+
+#endif
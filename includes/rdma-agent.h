@@ -5,11 +5,33 @@
 
 #define TIMEOUT_IN_MS 500 /* ms */
 
+#define POD_REGION_NAME_LEN 64
+
+/**
+ * Memory of a pod, passed as context of its rdma_cm_id: num_parts segments of
+ * block_size bytes. The region owns its MR, registered by the first session
+ * and kept by the next ones through the same device, and so by the pods it is
+ * recycled for, see segment-pool.h.
+ */
+struct pod_region {
+  void *base;
+  size_t size;
+  uint32_t num_parts;
+  uint32_t pids[SEGMENT_MAX_PARTS]; // of the containers, as the kernel told us at registration
+  int fd;                           // kept open to recycle a memfd, -1 once closed
+  int memfd;                        // else a POSIX shm object, unlinked once the pod opened it
+  char name[POD_REGION_NAME_LEN];
+  int node;                         // NUMA node the segments were placed on, -1 if unknown
+  int events[SEGMENT_MAX_PARTS];    // cgroup.events of each container, -1 if unknown, see region_orphaned
+  struct ibv_mr *mr;
+};
+
 int on_addr_resolved(struct rdma_cm_id *id);
 int on_connection(struct rdma_cm_id *id);
 int on_disconnect(struct rdma_cm_id *id);
 int on_event(struct rdma_cm_event *event);
 int on_route_resolved(struct rdma_cm_id *id);
+void abort_session(struct rdma_cm_id *id);
 void usage(const char *argv0);
 
 #endif
@@ -2,6 +2,7 @@
 #define __RDMA_COMMON_H
 
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,11 +10,24 @@
 #include <rdma/rdma_cma.h>
 #include <sys/time.h>
 
+#include "segment.h"
+#include "cost-model.h"
+#include "round-ring.h"
+
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
 #define RDMA_DEFAULT_BUFFER_SIZE 1024
 #define RDMA_MAX_CONNECTIONS 1024
+#define RDMA_MAX_DEVICES 16
+
+/* MSG_MR and MSG_DONE, each in flight at most once per connection */
+#define RDMA_CONTROL_MSGS 2
+/* grow a CQ when outstanding completions exceed 3/4 of its entries */
+#define CQ_HIGH_WATERMARK(cqe) ((cqe) * 3 / 4)
+/* shrink it back when they stayed under 1/4 for CQ_SHRINK_POSTS posts */
+#define CQ_LOW_WATERMARK(cqe) ((cqe) / 4)
+#define CQ_SHRINK_POSTS 4096
 
 
 struct message {
@@ -25,6 +39,8 @@ struct message {
   union {
     struct ibv_mr mr;
   } data;
+
+  uint32_t num_parts;   // MSG_MR: segments of block_size bytes back to back in mr
 };
 
 struct connection {
@@ -46,6 +62,7 @@ struct connection {
 
   char **rdma_local_region;
   char *rdma_remote_region;
+  uint32_t num_parts;           // segments in the region, one per container of the pod
 
   int logical_id; // incremental numbering
 
@@ -61,17 +78,116 @@ struct connection {
     RS_MR_RECV,
     RS_DONE_RECV
   } recv_state;
+
+  /* agent-nic: READ round in progress on this connection */
+  enum {
+    ROUND_IDLE,
+    ROUND_FULL,   // single-shot: read the whole segment, num_mr times
+    ROUND_HEAD,   // read header (and dirty bitmap)
+    ROUND_BODY    // read used or dirty bytes (and acknowledge generation)
+  } round_phase;
+
+  int wr_outstanding;
+  int wr_phase;                 // WRs of the phase, posted in batches the CQ fits, see cq_reserve
+  int wr_posted;
+  int wr_batch;
+  int layout_valid;
+  struct segment_layout layout;
+  struct read_plan plan;
+  int level;                    // highest resolution tier due this round
+  uint64_t last_heartbeat[SEGMENT_MAX_PARTS];   // of each container, see segment_heartbeat
+  uint32_t idle_rounds[SEGMENT_MAX_PARTS];      // rounds since the heartbeat last moved
+  uint32_t stalled_parts;       // bitmask
+  int stalled;                  // all the containers are
+  int budget_class;             // tier the round asked for, before degrading to fit the budget
+
+  /* per resolution tier */
+  uint64_t last_generation[SEGMENT_MAX_TIERS];  // generation when we last read its slots
+  int proj_active[SEGMENT_MAX_TIERS];           // read only proj, not the whole segment
+  struct read_plan proj[SEGMENT_MAX_TIERS];
+  struct read_plan shot[SEGMENT_MAX_TIERS];     // header and projection, for single-shot rounds
+
+  unsigned proj_version;
+  unsigned config_version;      // of the runtime settings applied, see agent-nic control socket
+  const struct nic_config *config;   // those settings, read by the poller from the snapshot
+  struct read_plan scratch;
+
+  struct read_cost cost;
+  struct timespec phase_start;
+  uint32_t phase_bytes;
+  int phase_wrs;
+  int phase_split;              // READs of the phase were split in this many WRs
+  uint64_t round_sched_ns;      // CLOCK_MONOTONIC when the tick of the round was due
+  uint64_t round_wake_ns;       // when the tick thread woke up for it
+  uint64_t worker_wake_ns;      // when the poller was signaled the tick
+  uint64_t round_post_ns;       // when the round was posted
+  uint64_t first_cqe_ns;        // when its first and last completions were polled
+  uint64_t last_cqe_ns;
+  uint32_t round_bytes;         // READ by the round, all phases
+  int round_wrs;
+  uint64_t read_ns;             // CLOCK_REALTIME the data of the round was read, see on_completion
+  uint64_t last_read_ns;        // of the previous round
+
+  struct ibv_send_wr *wrs;
+  struct ibv_sge *sges;
+
+  uint64_t *ack_buf;            // sources of the WRITEs to the control line
+  uint64_t first_read_ns;       // when our first READ of the pod landed
+  int first_read_sent;
+  struct ibv_mr *ack_mr;
+
+  /* agent-nic: rounds land in the slots of a ring, rdma_local_region[0] points to one */
+  struct round_ring *ring;
+  struct round_slot *landing;   // slot of the round in progress
+  struct round_slot *latest;    // of the last round published, kept while newer ones land
+  int round_fresh;              // the round landed new data, to publish
+  int round_whole;              // all the ranges we read of the pod, see round_slot full_generation
+  uint64_t ack_generation;      // last generation acknowledged to the pod
+  char *meta;                   // header up to the directory, from the read that taught us the layout
+
+  /* agent-nic: CRC32C verification of the chunks read, see SEGMENT_F_CRC */
+  const struct read_plan *round_plan;   // ranges of the round, NULL if it read the whole segment
+  const void **crc_bufs;        // chunks of the round to verify, num_chunks at most
+  uint32_t *crc_chunks;
+  uint32_t *crc_vals;
+  int crc_failed;               // the last round verified failed, at crc_failed_gen
+  uint64_t crc_failed_gen;
 };
 
+/* RNIC, its protection domain is shared by all the connections through it */
+struct device {
+  struct ibv_context *verbs;
+  struct ibv_pd *pd;
+};
+
+/* per connection, pd is the one of the device the connection goes through */
 struct context {
   struct ibv_context *ctx;
   struct ibv_pd *pd;
   struct ibv_cq *cq;
   struct ibv_comp_channel *comp_channel;
+  int wr_hwm;   // most completions reserved at once, see cq_reserve
+  int cq_hwm;   // most completions found in the CQ by one drain of the poller
+  int wr_recent;    // the same over the last posts, to shrink the CQ back
+  int cq_recent;
+  int cq_posts;     // posts since wr_recent and cq_recent were reset
+  int cqe_min;      // entries the CQ was created with, it never shrinks below
+  int cqe_max;      // entries the device refused to grow the CQ to, 0 until it did
 
   pthread_t cq_poller_thread;
 };
 
+/**
+ * Work queue and completion queue sizes of a connection, from how many rounds
+ * of how many signaled WRs it keeps in flight, and how many connections share
+ * its CQ.
+ */
+struct queue_depths {
+  int send_wr;
+  int recv_wr;
+  int cqe;
+};
+
 /* measure ib_verbs latency at application layer */
 struct latency_meter
 {
@@ -90,7 +206,14 @@ void * get_local_message_region(void *context);
 void on_connect(void *context);
 void send_mr(void *context);
 void post_receives(struct connection *conn);
-char * get_peer_message_region(struct connection *conn);
+char * get_peer_message_region(struct connection *conn, int part);
 double record_time_elapsed(struct latency_meter *lm);
+struct ibv_pd * device_pd(struct ibv_context *verbs);
+void queue_depths(int pipeline, int wrs_per_round, int conns_per_cq, struct queue_depths *qd);
+int cq_reserve(struct context *ctx, int entries);
+int connection_id_get(void);
+void connection_id_put(int id);
+void flush_qp(struct connection *conn);
+void destroy_context(int id);
 
 #endif
\ No newline at end of file
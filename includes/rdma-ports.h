@@ -0,0 +1,36 @@
+#ifndef __RDMA_PORTS_H
+#define __RDMA_PORTS_H
+
+#include <net/if.h>
+#include <sys/socket.h>
+#include <rdma/rdma_cma.h>
+
+#define RDMA_MAX_PORTS 64
+
+/**
+ * A port of an RNIC of the host, with the IP addresses of its network
+ * interface: connections bound to one of them as source go through the port.
+ */
+struct rdma_port {
+  struct ibv_context *verbs;
+  uint8_t port_num;
+  char ifname[IF_NAMESIZE];
+  int active;
+  int has_addr4;
+  int has_addr6;
+  struct sockaddr_in addr4;
+  struct sockaddr_in6 addr6;
+  int load;     // pods connected through the port
+  int node;     // NUMA node of the RNIC, -1 if unknown
+};
+
+int rdma_ports_init(void);
+int rdma_ports_pick(int family, int node);
+int rdma_ports_node(void);
+int rdma_port_node(int p);
+void rdma_ports_release(int p);
+struct sockaddr * rdma_port_addr(int p, int family);
+int rdma_ports_refresh(int *down);
+const char * rdma_port_name(int p);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __READ_BATCH_H
+#define __READ_BATCH_H
+
+#include <stdint.h>
+
+/* candidate segmentations: each READ of a round is split into 1, 2, 4, 8 or 16 WRs */
+#define READ_BATCH_SPLITS      5
+#define READ_BATCH_CLASSES     32   // rounds of [2^c, 2^(c+1)) bytes
+#define READ_BATCH_MIN_BYTES   64   // never split READs below this size
+#define READ_BATCH_PROBE_ROUNDS 64  // rounds at the best split before we try another one
+
+/**
+ * Throughput learned for each split factor of rounds in a size class, shared
+ * by all connections (they go through the same NIC). Throughput is an
+ * exponentially weighted moving average of bytes/ns.
+ */
+struct read_batch_class {
+  double rate[READ_BATCH_SPLITS];
+  int samples[READ_BATCH_SPLITS];
+  int best;
+  int next_probe;
+  unsigned rounds_since_probe;
+};
+
+int read_batch_split(uint32_t bytes, int max_split);
+void read_batch_sample(uint32_t bytes, int split, double t_ns);
+void read_batch_report(void);
+
+#endif
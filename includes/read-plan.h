@@ -0,0 +1,33 @@
+#ifndef __READ_PLAN_H
+#define __READ_PLAN_H
+
+#include <stdint.h>
+
+/* upper bound on the number of READ work requests issued for one pod in a round */
+#define READ_PLAN_MAX_RANGES 64
+
+/* a contiguous byte range of the remote pod segment, landed at the same offset locally */
+struct read_range {
+  uint32_t off;
+  uint32_t len;
+};
+
+/**
+ * Set of ranges to READ from a pod segment in a round, sorted by offset.
+ * Ranges closer than gap bytes are coalesced: we read the bytes in between
+ * to save a WR.
+ */
+struct read_plan {
+  int num_ranges;
+  uint32_t bytes;
+  uint32_t gap;
+  struct read_range ranges[READ_PLAN_MAX_RANGES];
+};
+
+void read_plan_init(struct read_plan *plan, uint32_t gap);
+void read_plan_reset(struct read_plan *plan);
+void read_plan_add(struct read_plan *plan, uint32_t off, uint32_t len);
+int read_plan_covers(const struct read_plan *plan, uint32_t off, uint32_t len);
+void read_plan_intersect(const struct read_plan *a, const struct read_plan *b, struct read_plan *out);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __REGISTRATION_H
+#define __REGISTRATION_H
+
+#include <stdint.h>
+
+#include "segment.h"
+
+/* Unix socket of the host agent where pods register, see run_unix in agent.c */
+#define REGISTRATION_SOCKET "/tmp/microview.sock"
+
+#define REGISTRATION_MAX_CONTAINERS SEGMENT_MAX_PARTS
+
+/**
+ * Request of a pod, sent right after connecting. A pod with sidecars
+ * registers all its containers at once: the agent lays out one segment per
+ * container, back to back in a single memfd, and agent-nic reads them all
+ * over a single RDMA session. Container 0 is the process registering, as seen
+ * by the host agent (SO_PEERCRED). pids are ignored: the pids a pod knows are
+ * those of its own PID namespace, and the agent only trusts what the kernel
+ * tells it, see registration_credential.
+ */
+struct registration_request {
+  uint32_t num_containers;
+  uint32_t pids[REGISTRATION_MAX_CONTAINERS];
+};
+
+/**
+ * Sent by each sidecar i = 1..num_containers-1, in turn, on the connection of
+ * the request, with its SCM_CREDENTIALS: the kernel only lets a process send
+ * its own pid and translates it into the PID namespace of the agent. The
+ * registration fails if one of them is missing.
+ */
+struct registration_credential {
+  uint32_t container;
+};
+
+/**
+ * Reply of the host agent to a pod connecting to the registration socket,
+ * sent along with the fd of its segments (SCM_RIGHTS) if status is 0. The
+ * fd is a memfd, laid out and sealed against resizing: the pod maps it
+ * and publishes right away, no name lookup nor shared IPC namespace needed.
+ */
+struct registration_reply {
+  int32_t status;         // 0, or errno of the failure on the agent side
+  uint32_t pid;           // the pod as seen by the host agent (SO_PEERCRED)
+  uint32_t size;          // of the segment
+  uint32_t data_off;      // of the data area, see segment_layout
+  uint32_t layout_hash;
+  uint32_t num_parts;     // segments in the fd, the one of container i at i * size
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef __ROUND_RING_H
+#define __ROUND_RING_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "read-plan.h"
+
+#define ROUND_RING_DEFAULT   8
+#define ROUND_RING_MAX       64
+#define ROUND_QUEUE_LEN      4096   // rounds published and not consumed yet, all pods
+#define ROUND_MAX_CONSUMERS  8
+
+struct round_ring;
+
+/**
+ * A round slot: the READs of a round land in it, at the offsets they have in
+ * the pod segment, and the consumers of the round use the bytes in place. The
+ * slot is reused only once nobody references it: the poller while it lands a
+ * round or keeps it as the latest copy of the pod, the queue until the round
+ * is consumed, and any consumer that holds it longer (e.g. to diff it against
+ * the next round).
+ */
+struct round_slot {
+  char *base;
+  struct round_ring *ring;
+  int refs;
+  uint64_t last_use;           // round it last landed, to reuse the least recently used slot
+  /* set by the poller before publishing */
+  uint64_t round;              // tick of the round
+  uint64_t generation;         // of the segment (of container 0) read
+  uint64_t full_generation;    // every range of the slot is at least this recent, 0 if never whole
+  uint32_t epoch;              // of the ring when the slot was last whole
+  uint64_t read_ns;            // CLOCK_REALTIME the data was read
+  uint64_t published_ns;       // CLOCK_MONOTONIC
+  int tier;                    // highest tier read, ranges of slower ones are as of full_generation
+  uint32_t layout_hash;        // of the segment, 0 if unknown
+  int partial;                 // only the ranges of held are current, the rest is left of older rounds
+  struct read_plan held;       // if partial
+};
+
+/**
+ * Landing area of the READs of a pod: num_slots slots of slot_size bytes, in a
+ * single allocation that agent-nic registers once, so that all the slots share
+ * an MR. Every round lands in a free slot and is published as is to the
+ * consumer thread: snapshot bytes are never copied between the NIC DMA and
+ * the consumers. If the consumers fall behind and no slot is free the poller
+ * skips rounds (overruns) rather than overwrite a slot in use.
+ */
+struct round_ring {
+  int pod;
+  int num_slots;
+  size_t slot_size;
+  char *mem;
+  uint32_t epoch;              // bumped when the layout or the ranges read change, whole copies are stale
+  struct round_slot slots[ROUND_RING_MAX];
+  uint64_t published;
+  uint64_t overruns;
+  pthread_mutex_t mutex;
+  pthread_cond_t released;
+};
+
+/**
+ * Called by the consumer thread for each round published, in order per pod,
+ * then with a NULL slot once the ring closes: the consumer must release the
+ * slots of the ring it holds.
+ */
+typedef void (*round_consumer)(struct round_ring *ring, struct round_slot *slot, void *arg);
+
+int round_ring_init(struct round_ring *ring, int pod, int num_slots, size_t slot_size);
+void round_ring_free(struct round_ring *ring);
+struct round_slot * round_ring_acquire(struct round_ring *ring, uint64_t round);
+uint64_t round_ring_oldest(struct round_ring *ring, const struct round_slot *except);
+void round_slot_hold(struct round_slot *slot);
+void round_slot_release(struct round_slot *slot);
+void round_ring_publish(struct round_slot *slot);
+void round_ring_close(struct round_ring *ring);
+
+int round_consumer_add(round_consumer fn, void *arg);
+int round_consumers_start(void);
+void round_consumer_stats(uint64_t *consumed, uint64_t *max_lag_ns);
+
+#endif
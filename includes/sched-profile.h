@@ -0,0 +1,31 @@
+#ifndef __SCHED_PROFILE_H
+#define __SCHED_PROFILE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SCHED_ISOLATED_FILE "/sys/devices/system/cpu/isolated"
+
+/**
+ * Scheduling of the threads on the read path of agent-nic: the tick thread
+ * on a dedicated core, the CQ pollers on theirs (see numa_pin_thread), both
+ * under SCHED_FIFO if asked, the tick thread one priority above the pollers
+ * so it preempts them on a shared core. A FIFO poller never spins unbounded:
+ * it busy-polls its CQ for busy_poll_ns at most after its last completion,
+ * then sleeps on the completion channel, leaving the core to the others.
+ * Dedicated cores should be isolated (isolcpus=, nohz_full=), a warning says
+ * when they are not.
+ */
+struct sched_profile {
+  int tick_core;            // -1 if not pinned
+  int fifo_priority;        // of the pollers, 0 for the default (CFS) policy
+  uint64_t busy_poll_ns;    // 0 to sleep on the channel right away
+};
+
+int sched_apply(pthread_t thread, int core, int priority);
+int sched_core_isolated(int core);
+uint64_t mono_ns(void);
+uint64_t sched_wait_tick(const struct timespec *next, uint64_t spin_ns, uint64_t *lead_ns);
+
+#endif
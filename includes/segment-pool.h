@@ -0,0 +1,20 @@
+#ifndef __SEGMENT_POOL_H
+#define __SEGMENT_POOL_H
+
+#include "rdma-agent.h"
+
+#define SEGMENT_POOL_MAX     256
+#define SEGMENT_POOL_DEFAULT 16
+
+/**
+ * Regions of pods gone, zeroed and kept mapped and registered, to serve new
+ * pods without creating, mapping nor registering memory. Only memfd regions
+ * are recycled: they reach the pod as a file descriptor, whatever its name.
+ * Regions are zeroed with stores rather than by punching holes in the memfd:
+ * the pages are pinned by the MR, which must keep seeing the pages mapped.
+ */
+void segment_pool_init(int capacity);
+int segment_pool_put(const struct pod_region *region);
+int segment_pool_get(size_t size, int node, struct pod_region *region);
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef __SEGMENT_H
+#define __SEGMENT_H
+
+#include <stdint.h>
+
+#include "read-plan.h"
+
+/**
+ * Layout of the shared memory segment of a pod.
+ *
+ *   [ header | host stats | control | dirty bitmap | directory | data ....... | CRCs ]
+ *
+ * The header is written by the pod and read by agent-nic, the host stats line
+ * by the host agent (resource usage of the pod, see cgroup-stats.h) and read
+ * by agent-nic along with the header in every round. The control line is
+ * written by agent-nic (RDMA WRITE) and read by the pod. The dirty bitmap has
+ * one bit per chunk of the data area, it is set by the pod when it writes into
+ * the chunk and cleared once agent-nic has acknowledged a generation that
+ * covers the write. The directory names the metric slots the pod has
+ * allocated in the data area, so that agent-nic can READ a subset of them
+ * (see projection.h). Optionally, the pod keeps the CRC32C of every chunk of
+ * the data area at the end of the segment, updated when it publishes, so that
+ * agent-nic can verify the chunks it reads (corrupted or uninitialized
+ * memory, e.g. a pod that crashed mid-write or a recycled segment). The host
+ * agent initializes the header when it creates the segment, everybody else
+ * derives the layout from it (see segment_read_layout).
+ *
+ * The first SEGMENT_HEADER_SIZE bytes are enough for agent-nic to decide
+ * whether, and how much, to read: the generation tells if anything was
+ * published since the last round, used_len how much of the data area is in
+ * use, and layout_hash whether the layout it knows is still valid, including
+ * the directory: the pod updates it every time it allocates a slot.
+ */
+
+#define SEGMENT_MAGIC         0x75766577  /* "uvew" */
+#define SEGMENT_VERSION       2
+#define SEGMENT_HEADER_SIZE   64
+#define SEGMENT_STATS_SIZE    64
+#define SEGMENT_CONTROL_SIZE  64
+
+#define SEGMENT_MIN_CHUNK     64
+#define SEGMENT_MAX_CHUNK     4096
+#define SEGMENT_DEFAULT_CHUNK 256
+
+#define SEGMENT_DEFAULT_SLOTS 16
+#define SEGMENT_MAX_TIERS     4
+#define SEGMENT_NAME_LEN      20
+#define SEGMENT_SERVICE_LEN   24
+
+/* segments laid out back to back in the region of a pod registered with its sidecars */
+#define SEGMENT_MAX_PARTS     16
+
+/* header flags */
+#define SEGMENT_F_DIRTY       0x1   /* pod maintains the dirty bitmap */
+#define SEGMENT_F_CRC         0x2   /* pod maintains the CRC32C of each chunk, needs SEGMENT_F_DIRTY */
+
+/* slot flags */
+#define SEGMENT_SLOT_COUNTERS 0x1   /* array of cumulative uint64_t counters, agent-nic computes their deltas */
+
+struct segment_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t flags;
+  uint32_t size;                 // total size of the segment in bytes
+  uint32_t chunk_size;           // dirty tracking granularity
+  uint64_t generation;           // bumped by the pod at every publish
+  uint32_t used_len;             // bytes of the data area written so far
+  uint32_t layout_hash;          // changes whenever the layout changes
+  uint16_t max_slots;            // capacity of the directory, 0 if none
+  uint16_t reserved0;
+  uint32_t pid;                  // pod owning the segment, set by the host agent
+  uint64_t heartbeat;            // bumped by the pod while it makes progress, see segment_heartbeat
+  uint8_t reserved[SEGMENT_HEADER_SIZE - 48];
+};
+
+/* valid bits of segment_stats, one per cgroup file the host agent could read */
+#define SEGMENT_STATS_CPU       0x01   /* cpu.stat */
+#define SEGMENT_STATS_MEMORY    0x02   /* memory.current */
+#define SEGMENT_STATS_IO        0x04   /* io.stat */
+#define SEGMENT_STATS_CPU_PSI   0x08   /* cpu.pressure */
+#define SEGMENT_STATS_MEM_PSI   0x10   /* memory.pressure */
+#define SEGMENT_STATS_IO_PSI    0x20   /* io.pressure */
+
+/**
+ * Resource usage of the pod from its cgroup, sampled by the host agent.
+ * seq is odd while the host agent updates the line. seq_end, last in the
+ * line, moves before the update starts and again after it ends: a READ gets
+ * seq first and seq_end last, a copy with an odd seq or a different seq_end
+ * is torn and the next READ tries again. Pressures are the "some" avg10 of
+ * the PSI files, in hundredths of a percent.
+ */
+struct segment_stats {
+  uint32_t seq;
+  uint32_t valid;                // SEGMENT_STATS_* read in the last sample
+  uint64_t sampled_ns;           // CLOCK_REALTIME of the host agent at the sample
+  uint64_t cpu_usage_us;
+  uint64_t cpu_throttled_us;
+  uint64_t memory_current;       // bytes
+  uint64_t io_bytes;             // read and written, all devices
+  uint32_t cpu_pressure;
+  uint32_t memory_pressure;
+  uint32_t io_pressure;
+  uint32_t seq_end;
+};
+_Static_assert(sizeof(struct segment_stats) == SEGMENT_STATS_SIZE, "stats line");
+
+struct segment_control {
+  uint64_t ack_generation;       // last generation whose dirty chunks agent-nic has read
+  uint64_t first_read_ns;        // CLOCK_REALTIME of the NIC when its first READ landed, 0 until then
+  uint8_t reserved[SEGMENT_CONTROL_SIZE - 16];
+};
+
+/**
+ * A named metric in the data area. Its resolution tier tells agent-nic how
+ * often to read it: tier 0 every round, higher tiers at the (longer) sampling
+ * intervals configured for them, see agent-nic -T.
+ */
+struct segment_slot {
+  char name[SEGMENT_NAME_LEN];
+  uint32_t off;                  // from the start of the data area
+  uint32_t len;
+  uint8_t tier;
+  uint8_t flags;                 // SEGMENT_SLOT_*
+  uint8_t reserved[2];
+};
+
+struct segment_dir {
+  char service[SEGMENT_SERVICE_LEN];
+  uint32_t num_slots;
+  uint32_t next_off;             // first data byte not allocated to a slot
+  struct segment_slot slots[];
+};
+
+/* offsets derived from the header, in bytes from the start of the segment */
+struct segment_layout {
+  uint32_t size;
+  uint32_t chunk_size;
+  uint16_t flags;
+  uint32_t num_chunks;
+  uint32_t stats_off;
+  uint32_t control_off;
+  uint32_t bitmap_off;
+  uint32_t bitmap_len;
+  uint32_t dir_off;
+  uint32_t dir_len;
+  uint16_t max_slots;
+  uint32_t data_off;
+  uint32_t data_len;
+  uint32_t crc_off;              // one uint32_t per chunk, 0 if no CRCs
+  uint32_t crc_len;
+  uint32_t hash;
+};
+
+/* pod-side handle to write metrics into the segment */
+struct segment {
+  char *base;
+  struct segment_header *hdr;
+  struct segment_control *ctl;
+  uint64_t *bitmap;
+  struct segment_dir *dir;
+  char *data;
+  struct segment_layout layout;
+  uint64_t *chunk_gen;           // generation of the last write of each chunk (private to the pod)
+  uint32_t *crc;                 // CRC table, NULL if none
+  uint32_t used_len;
+};
+
+int segment_compute_layout(uint32_t size, uint32_t chunk_size, uint16_t flags, uint16_t max_slots,
+                           struct segment_layout *layout);
+int segment_read_layout(const void *base, struct segment_layout *layout);
+const struct segment_dir * segment_get_dir(const struct segment_layout *layout, const void *base);
+
+/* host agent */
+int segment_init(void *base, uint32_t size, uint32_t chunk_size, uint16_t flags, uint16_t max_slots, uint32_t pid);
+struct segment_stats * segment_get_stats(void *base);
+
+/* pod */
+int segment_attach(struct segment *seg, void *base);
+void segment_set_service(struct segment *seg, const char *service);
+int segment_add_slot(struct segment *seg, const char *name, uint32_t len, uint8_t tier);
+int segment_add_counters(struct segment *seg, const char *name, uint32_t count, uint8_t tier);
+int segment_write(struct segment *seg, uint32_t off, const void *src, uint32_t len);
+int segment_write_slot(struct segment *seg, int slot, const void *src, uint32_t len);
+void segment_publish(struct segment *seg);
+void segment_heartbeat(struct segment *seg);
+uint64_t segment_first_read(const struct segment *seg);
+
+/* agent-nic */
+void segment_dirty_plan(const struct segment_layout *layout, const void *base, struct read_plan *plan);
+void segment_used_plan(const struct segment_layout *layout, const void *base, struct read_plan *plan);
+uint32_t segment_chunk_len(const struct segment_layout *layout, uint32_t chunk);
+uint32_t segment_covered_chunks(const struct segment_layout *layout, uint32_t off, uint32_t len, uint32_t *first);
+void segment_crc_plan(const struct segment_layout *layout, struct read_plan *plan);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __SHARD_RING_H
+#define __SHARD_RING_H
+
+#include <stdint.h>
+
+#define SHARD_MAX_INSTANCES 64
+#define SHARD_VNODES        128   // points per instance on the ring
+#define SHARD_ADDR_LEN      64
+#define SHARD_PORT_LEN      16
+
+/* an agent-nic instance, i.e., RDMA endpoint on the SmartNIC */
+struct shard_instance {
+  char addr[SHARD_ADDR_LEN];
+  char port[SHARD_PORT_LEN];
+};
+
+struct shard_point {
+  uint64_t hash;
+  int instance;
+};
+
+/**
+ * Consistent hashing of pods onto agent-nic instances: each instance owns
+ * SHARD_VNODES points of a 64-bit ring and a pod belongs to the first point
+ * after the hash of its pid. Adding or removing an instance only moves the
+ * pods of the arcs it gains or loses, about 1/n of them.
+ */
+struct shard_ring {
+  int num_instances;
+  struct shard_instance instances[SHARD_MAX_INSTANCES];
+  int num_points;
+  struct shard_point points[SHARD_MAX_INSTANCES * SHARD_VNODES];
+};
+
+void shard_ring_init(struct shard_ring *ring);
+int shard_ring_add(struct shard_ring *ring, const char *addr, const char *port);
+int shard_ring_load(struct shard_ring *ring, const char *path);
+const struct shard_instance * shard_ring_lookup(const struct shard_ring *ring, uint32_t pid);
+int shard_instance_equal(const struct shard_instance *a, const struct shard_instance *b);
+
+#endif
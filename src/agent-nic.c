@@ -1,5 +1,19 @@
 #include "rdma-common.h"
+#include "projection.h"
+#include "budget.h"
+#include "read-batch.h"
+#include "control.h"
+#include "numa-place.h"
+#include "sched-profile.h"
+#include "latency-hist.h"
+#include "nic-stats.h"
+#include "round-ring.h"
+#include "delta.h"
+#include "crc32c.h"
+#include <limits.h>
 #include <signal.h>
+#include <stddef.h>
+#include <ctype.h>
 
 static int on_connect_request(struct rdma_cm_id *id);
 static int on_connection(struct rdma_cm_id *id);
@@ -7,20 +21,188 @@ static int on_disconnect(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
 static void usage(const char *argv0);
 static void * tick(void *);
-static int on_completion(struct ibv_wc *, int, struct latency_meter*, int*);
+static uint64_t parse_duration(const char *str);
+static int parse_tiers(char *list, uint64_t tick, int *n, uint32_t *mult);
+static double parse_rate(const char *str);
+static double budget_burst(void);
+static int on_completion(struct ibv_wc *, int, struct latency_meter*);
+static int post_round(struct connection *conn);
+static int post_body(struct connection *conn);
+static void end_round(struct connection *conn, int i, struct latency_meter *lm);
+static void post_phase(struct connection *conn, int n);
+static void post_batch(struct connection *conn);
 static void * poll_cq(void *);
-static void build_context(struct ibv_context *verbs);
-static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
+static int busy_poll(struct ibv_cq *cq, int i, struct latency_meter *lm, uint64_t *caught);
+static int max_round_wrs(void);
+static int max_read_wrs(void);
+static void build_context(struct ibv_context *verbs, int id);
+static void build_qp_attr(struct ibv_qp_init_attr *qp_attr, int id);
 static void register_memory(struct connection *conn);
+static void resize_local_regions(struct connection *conn);
 static void destroy_connection(void *context);
 static void INThandler(int sig);
-
-static uint16_t sampling_interval;
+static void HUPhandler(int sig);
+static void USR1handler(int sig);
+static void control_command(char *cmd, FILE *out);
+static void install_config(void);
+static void apply_config(struct connection *conn);
+static const struct nic_config * publish_config(void);
+static void update_projection(struct connection *conn);
+static void finish_landing(struct connection *conn);
+static void round_deltas(struct round_ring *ring, struct round_slot *slot, void *arg);
+static void verify_chunks(struct connection *conn);
+
+static uint64_t tick_ns;        // sampling interval of tier 0
 static int num_active_connections = 0;
 
+/**
+ * Resolution tiers: slots of tier t are read every tier_mult[t] ticks, each
+ * a multiple of the previous one. Rounds of the last tier read all slots.
+ */
+static int num_tiers = 1;
+static uint32_t tier_mult[SEGMENT_MAX_TIERS] = {1};
+static uint64_t round_number = 0;   // ticks so far, written by the tick thread only
+
+/**
+ * When the recent ticks were due and when the tick thread actually woke up
+ * for them (CLOCK_MONOTONIC ns), by round number modulo TICK_TIMING_ROUNDS,
+ * written before the round number is published. To wake up on time the tick
+ * thread sleeps until slightly before the deadline, then spins: the lead
+ * follows how late sleeps end, at most tick_spin_ns.
+ */
+#define TICK_TIMING_ROUNDS   64
+#define TICK_SPIN_DEFAULT_NS 50000
+struct tick_timing {
+  uint64_t sched_ns;
+  uint64_t wake_ns;
+};
+static struct tick_timing tick_timing[TICK_TIMING_ROUNDS];
+
+/**
+ * Stages of the READ pipeline, each the time from the previous timestamp of
+ * the round (the first from when the tick was due): the tick thread waking
+ * up, the poller being signaled, planning and posting the round, the wire and
+ * DMA up to the first completion, the rest of the completions (including the
+ * body of header-first rounds), decoding the copy and exporting the sample.
+ * Each pod has histograms of its own, the global ones have all the rounds.
+ */
+enum read_stage { STAGE_TICK, STAGE_WAKEUP, STAGE_POST, STAGE_FIRST_CQE, STAGE_LAST_CQE, STAGE_DECODE, STAGE_EXPORT, NUM_STAGES };
+static const char *stage_names[NUM_STAGES] = { "tick", "wakeup", "post", "first-cqe", "last-cqe", "decode", "export" };
+static struct latency_hist global_stages[NUM_STAGES];
+static struct latency_hist *pod_stages[RDMA_MAX_CONNECTIONS];
+
+/* live state for viewers, see nic-stats.h; NULL if disabled */
+static char *stats_name = NULL;   // default per port, see main
+static struct nic_stats *stats = NULL;
+_Static_assert(NUM_STAGES == NIC_STATS_STAGES, "stages of the stats page");
+static uint64_t tick_spin_ns = TICK_SPIN_DEFAULT_NS;   // 0 to sleep until the deadline
+
+/* slots of the ring each pod lands its rounds in, and rounds skipped because none was free */
+static int ring_slots = ROUND_RING_DEFAULT;
+static uint64_t ring_overruns = 0;
+
+/**
+ * Deltas of the counter slots of a pod (see SEGMENT_SLOT_COUNTERS), computed
+ * by the consumer thread in place in the round slots: the counters of tier t
+ * of a round against the previous round that read tier t, which it holds.
+ * The poller maps the counters when it learns a layout, the consumer takes
+ * the map with the first round of that layout.
+ */
+struct pod_deltas {
+  pthread_mutex_t mutex;
+  struct delta_map map;            // of the last layout learned, under mutex
+  /* consumer thread only */
+  struct delta_map used;
+  struct round_slot *prev[SEGMENT_MAX_TIERS];
+  uint64_t *delta;                 // of the last round, by counter, and its masks
+  uint64_t *changed;
+  uint64_t *reset;
+  uint64_t interval_ns[SEGMENT_MAX_TIERS];   // between the reads the last deltas of each tier are over
+  uint64_t rounds;
+  uint64_t changes;
+  uint64_t resets;
+};
+static struct pod_deltas *pod_deltas[RDMA_MAX_CONNECTIONS];
+static void reset_deltas(struct pod_deltas *pd);
+
+/* CRC32C verification of the chunks read, all pods */
+static struct {
+  uint64_t rounds;
+  uint64_t chunks;
+  uint64_t ns;
+  uint64_t mismatches;          // rounds read again
+  uint64_t corrupted;           // rounds failing again at the same generation
+} crc_totals;
+
+/* how rounds are read: whole segment, header first, or chosen by the cost model */
+static enum {
+  READ_MODE_FULL,
+  READ_MODE_HEADER,
+  READ_MODE_AUTO
+} read_mode = READ_MODE_AUTO;
+
+/* metric projection rules, reloaded on SIGHUP */
+static char *projection_file = NULL;
+static volatile sig_atomic_t reload_projection = 0;
+static volatile sig_atomic_t report_batching = 0;   // SIGUSR1
+static volatile sig_atomic_t exit_requested = 0;    // SIGINT
+static uint32_t read_gap = 0;  // coalesce ranges closer than this many bytes
+
+/**
+ * Rounds in flight per connection: a round is posted once the previous one
+ * completed, see on_completion. Each round posts at most max_round_wrs().
+ */
+#define NIC_PIPELINE_DEPTH 1
+
+/**
+ * A pod whose heartbeat does not move for stall_rounds rounds (hung or dead)
+ * is marked stalled and only read every STALL_DEMOTE_ROUNDS ticks, until it
+ * beats again.
+ */
+#define STALL_DEMOTE_ROUNDS 16
+#define STALL_DEFAULT_NS    5000000000ULL
+static uint64_t stall_ns = STALL_DEFAULT_NS;   // 0 to disable
+static uint32_t stall_rounds;
+
+/* READ budget, 0 for unlimited */
+static double budget_bytes = 0;
+static double budget_reads = 0;
+
+/* cores and scheduling policy of the tick thread and the pollers */
+static struct sched_profile profile = { .tick_core = -1 };
+
+/**
+ * Settings that can be changed at runtime on the control socket. Commands
+ * edit a pending copy, the tick thread installs it between two ticks and
+ * each connection applies it before its next round (see apply_config), so
+ * connections, layouts and the history of the cost model are kept.
+ * The globals above belong to the tick thread (and main, before it starts):
+ * everyone else reads the installed settings from an immutable snapshot,
+ * active_config, published under config_version.
+ */
+struct nic_config {
+  uint64_t tick_ns;
+  int num_tiers;
+  uint32_t tier_mult[SEGMENT_MAX_TIERS];
+  int read_mode;
+  uint32_t read_gap;
+  double budget_bytes;
+  double budget_reads;
+  uint64_t stall_ns;
+  uint32_t stall_rounds;        // of stall_ns at tick_ns, in snapshots
+  enum { PROJECTION_KEEP, PROJECTION_LOAD, PROJECTION_CLEAR } projection;
+  char projection_file[PATH_MAX];   // in snapshots, the rules in effect ("" for none)
+};
+static char *control_path = NULL;   // default per port, see main
+static struct nic_config pending_config;
+static int config_pending = 0;
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned config_version = 0;
+/* snapshots are never freed: connections may still read an older one, and they only change on command */
+static const struct nic_config *active_config;
+
 extern struct context *s_ctx[RDMA_MAX_CONNECTIONS];
 extern int block_size;
-extern int num_connections;
 extern int num_mr;
 
 // to compute latency from first to last packet
@@ -36,7 +218,11 @@ pthread_cond_t cond_poll_agent[RDMA_MAX_CONNECTIONS];
 
 /**
  * Main function
- * usage: ./agent-nic <port> <sampling interval [sec]> <block size> <num blocks>
+ * usage: ./agent-nic [-m full|header|auto] [-p projection file] [-G gap] [-T tier intervals]
+ *                    [-B bytes/s] [-R reads/s] [-S stall timeout] [-C control socket]
+ *                    [-k poller cores] [-t tick core] [-F FIFO priority] [-W busy-poll] [-J tick spin]
+ *                    [-s stats name] [-r round slots]
+ *                    <port> <sampling interval [sec]> <block size> <num blocks>
  */
 int main(int argc, char **argv)
 {
@@ -45,15 +231,85 @@ int main(int argc, char **argv)
   struct rdma_cm_id *listener = NULL;
   struct rdma_event_channel *ec = NULL;
   uint16_t port = 0;
-
-  if (argc == 1 && strcmp(argv[1], "-h") == 0) {
+  char *tiers = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:p:G:T:B:R:S:C:k:t:F:W:J:s:r:h")) != -1) {
+    switch (opt) {
+    case 'm':
+      if (strcmp(optarg, "full") == 0)
+        read_mode = READ_MODE_FULL;
+      else if (strcmp(optarg, "header") == 0)
+        read_mode = READ_MODE_HEADER;
+      else if (strcmp(optarg, "auto") == 0)
+        read_mode = READ_MODE_AUTO;
+      else
+        usage(argv[0]);
+      break;
+    case 'p':
+      projection_file = optarg;
+      break;
+    case 'G':
+      read_gap = (uint32_t)atoi(optarg);
+      break;
+    case 'T':
+      tiers = optarg;
+      break;
+    case 'B':
+      budget_bytes = parse_rate(optarg);
+      break;
+    case 'R':
+      budget_reads = parse_rate(optarg);
+      break;
+    case 'S':
+      stall_ns = strcmp(optarg, "0") == 0 ? 0 : parse_duration(optarg);
+      if (stall_ns == 0 && strcmp(optarg, "0") != 0)
+        usage(argv[0]);
+      break;
+    case 'C':
+      control_path = optarg;
+      break;
+    case 'k':
+      if (numa_set_cores(optarg))
+        usage(argv[0]);
+      break;
+    case 't':
+      profile.tick_core = atoi(optarg);
+      break;
+    case 'F':
+      profile.fifo_priority = atoi(optarg);
+      if (profile.fifo_priority < 0 || profile.fifo_priority >= sched_get_priority_max(SCHED_FIFO))
+        usage(argv[0]);
+      break;
+    case 'W':
+      profile.busy_poll_ns = parse_duration(optarg);
+      break;
+    case 's':
+      stats_name = optarg;
+      break;
+    case 'r':
+      ring_slots = atoi(optarg);
+      if (ring_slots < 2 || ring_slots > ROUND_RING_MAX)
+        usage(argv[0]);
+      break;
+    case 'J':
+      tick_spin_ns = strcmp(optarg, "0") == 0 ? 0 : parse_duration(optarg);
+      if (tick_spin_ns == 0 && strcmp(optarg, "0") != 0)
+        usage(argv[0]);
+      break;
+    default:
       usage(argv[0]);
-      exit(0);
+    }
   }
-  if (argc != 5)
+  if (argc - optind != 4)
   {
     usage(argv[0]);
   }
+  argv += optind - 1;   // positional arguments as argv[1..4]
+
+  if (projection_file && projection_load(projection_file))
+    exit(EXIT_FAILURE);
+
   memset(&addr, 0, sizeof(addr));
   addr.sin6_family = AF_INET6;
   
@@ -72,13 +328,44 @@ int main(int argc, char **argv)
   for (int i = 0; i < RDMA_MAX_CONNECTIONS; i++) {
     TEST_NZ(pthread_mutex_init(&(lock[i]), NULL));  
   }
-  sampling_interval = (uint16_t)atoi(argv[2]);
+  tick_ns = parse_duration(argv[2]);
+  if (tick_ns == 0 || parse_tiers(tiers, tick_ns, &num_tiers, tier_mult) || budget_bytes < 0 || budget_reads < 0)
+    usage(argv[0]);
+  if (ring_slots < num_tiers + 2) {
+    fprintf(stderr, "%d tiers need at least %d round slots\n", num_tiers, num_tiers + 2);
+    usage(argv[0]);
+  }
+  stall_rounds = stall_ns ? (uint32_t)((stall_ns + tick_ns - 1) / tick_ns) : 0;
+  budget_init(budget_bytes, budget_reads, budget_burst(), num_tiers);
+  publish_config();
+
+  char default_control[64];
+  if (control_path == NULL) {
+    snprintf(default_control, sizeof(default_control), "/tmp/agent-nic-%u.ctl", port);
+    control_path = default_control;
+  }
+  if (control_path[0])
+    control_start(control_path, control_command);
+
+  char default_stats[64];
+  if (stats_name == NULL) {
+    snprintf(default_stats, sizeof(default_stats), "/agent-nic-%u.stats", port);
+    stats_name = default_stats;
+  }
+  if (stats_name[0] && (stats = nic_stats_create(stats_name, tick_ns)) != NULL)
+    printf("Live stats in shared memory %s, see uview-top\n", stats_name);
+  TEST_NZ(round_consumer_add(round_deltas, NULL));
+  TEST_NZ(round_consumers_start());
+  printf("Counter deltas with the %s kernel\n", delta_kernel_name());
   pthread_t tick_thread;
   TEST_NZ(pthread_create(&tick_thread, NULL, tick, NULL));
+  sched_apply(tick_thread, profile.tick_core, profile.fifo_priority ? profile.fifo_priority + 1 : 0);
 
   printf("listening on port %d.\n", port);
 
   signal(SIGINT, INThandler); // handle CTRL+C
+  signal(SIGHUP, HUPhandler); // reload projection rules
+  signal(SIGUSR1, USR1handler); // print READ batching plans
 
   while (rdma_get_cm_event(ec, &event) == 0) {
     struct rdma_cm_event event_copy;
@@ -99,27 +386,223 @@ int main(int argc, char **argv)
 
 
 
+/* write the stage histograms to path, a summary line each, then their buckets */
+static void dump_stages(const struct latency_hist *h, const char *path)
+{
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL) {
+    perror("Error writing latency stages");
+    return;
+  }
+  for (int st = 0; st < NUM_STAGES; st++)
+    lat_hist_print(&h[st], stage_names[st], f);
+  for (int st = 0; st < NUM_STAGES; st++)
+    lat_hist_dump(&h[st], stage_names[st], f);
+  fclose(f);
+}
+
+
 /**
- * Handle CTRL+C signal
+ * Handle CTRL+C signal: the tick thread writes the stage histograms and exits
  */
 void INThandler(int sig)
 {
-  printf("CTRL+C detected, exiting...\n");
-  fflush(stdout);
-  exit(0);
+  exit_requested = 1;
+}
+
+
+/**
+ * Handle SIGHUP: projection rules are reloaded by the tick thread, so that
+ * connections see them at a round boundary
+ */
+void HUPhandler(int sig)
+{
+  reload_projection = 1;
+}
+
+
+/**
+ * Handle SIGUSR1: the tick thread prints the READ batching plan learned for
+ * each size class
+ */
+void USR1handler(int sig)
+{
+  report_batching = 1;
+}
+
+
+/**
+ * Parse a duration such as 100us, 10ms or 1.5 (seconds if no unit).
+ * Returns nanoseconds, 0 if invalid.
+ */
+uint64_t parse_duration(const char *str)
+{
+  char *end;
+  double v = strtod(str, &end);
+
+  while (isspace((unsigned char)*end))
+    end++;
+  if (v <= 0 || end == str)
+    return 0;
+
+  if (strcmp(end, "ns") == 0)
+    return (uint64_t)v;
+  else if (strcmp(end, "us") == 0)
+    return (uint64_t)(v * 1e3);
+  else if (strcmp(end, "ms") == 0)
+    return (uint64_t)(v * 1e6);
+  else if (strcmp(end, "s") == 0 || *end == '\0')
+    return (uint64_t)(v * 1e9);
+  return 0;
 }
 
+/* parse a rate such as 500M or 10k (per second), -1 if invalid */
+double parse_rate(const char *str)
+{
+  char *end;
+  double v = strtod(str, &end);
+
+  if (end == str || v < 0)
+    return -1;
+  switch (*end) {
+  case 'k': case 'K': v *= 1e3; end++; break;
+  case 'm': case 'M': v *= 1e6; end++; break;
+  case 'g': case 'G': v *= 1e9; end++; break;
+  }
+  return *end == '\0' ? v : -1;
+}
 
 /**
- * Periodic thread to synchronize container reads at every sampling_interval
+ * Parse the intervals of tiers 1.. (comma separated) into *n tiers of
+ * multipliers mult, tier 0 is the sampling interval tick. Each interval must
+ * be a multiple of the previous one.
+ */
+int parse_tiers(char *list, uint64_t tick, int *n, uint32_t *mult)
+{
+  uint64_t prev = tick;
+  char *save = NULL;
+  int num = 1;
+
+  mult[0] = 1;
+  if (list == NULL) {
+    *n = num;
+    return 0;
+  }
+
+  for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    uint64_t ns = parse_duration(tok);
+
+    if (num == SEGMENT_MAX_TIERS) {
+      fprintf(stderr, "at most %d tiers\n", SEGMENT_MAX_TIERS);
+      return -1;
+    }
+    if (ns == 0 || ns % prev != 0) {
+      fprintf(stderr, "tier interval %s is not a multiple of the previous one\n", tok);
+      return -1;
+    }
+    mult[num] = (uint32_t)(ns / tick);
+    num++;
+    prev = ns;
+  }
+  *n = num;
+  return 0;
+}
+
+/* tokens accumulate over at most a tick, or 1 ms if ticks are shorter */
+static double budget_burst(void)
+{
+  return tick_ns > 1000000 ? tick_ns * 1.0e-9 : 1.0e-3;
+}
+
+/* highest tier due at round r with settings c: all tiers up to it are due as well */
+static int tier_level(const struct nic_config *c, uint64_t r)
+{
+  int level = 0;
+
+  while (level + 1 < c->num_tiers && r % c->tier_mult[level + 1] == 0)
+    level++;
+  return level;
+}
+
+/**
+ * Periodic thread to synchronize container reads at every tick_ns. We sleep
+ * until absolute deadlines so that the time spent signaling does not make
+ * ticks drift, and record when each tick was due and when it actually ran.
  */
 void* tick(void *arg) {
-  printf("Start reading process, read metrics every %d [sec]\n", sampling_interval);
+  struct timespec next;
+  uint64_t lead_ns = 0, late_sum = 0, late_max = 0, late_ticks = 0;
+
+  printf("Start reading process, read metrics every %lu [ns], %d tiers\n", tick_ns, num_tiers);
+  for (int t = 1; t < num_tiers; t++)
+    printf("  tier %d every %lu [ns]\n", t, tick_ns * tier_mult[t]);
+
+  uint64_t report_rounds = tick_ns < 1000000000 ? 1000000000 / tick_ns : 1;  // about every second
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
   
   /* synchronize container reads */
   while (1) {
     
-    sleep(sampling_interval);
+    next.tv_nsec += tick_ns % 1000000000;
+    next.tv_sec += tick_ns / 1000000000 + next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    uint64_t wake_ns = sched_wait_tick(&next, tick_spin_ns, &lead_ns);
+    uint64_t sched_ns = (uint64_t)next.tv_sec * 1000000000ULL + next.tv_nsec;
+    uint64_t late = wake_ns - sched_ns;
+    late_sum += late;
+    late_max = late > late_max ? late : late_max;
+    late_ticks++;
+    if (stats) {
+      nic_stats_write_begin(&stats->global.seq);
+      NIC_STATS_SET(stats->global.round, round_number + 1);
+      NIC_STATS_SET(stats->global.tick_ns, tick_ns);
+      NIC_STATS_SET(stats->global.tick_late_ns, late);
+      if (late > stats->global.tick_late_max_ns)
+        NIC_STATS_SET(stats->global.tick_late_max_ns, late);
+      nic_stats_write_end(&stats->global.seq);
+    }
+
+    if (exit_requested) {
+      printf("CTRL+C detected, exiting...\n");
+      for (int st = 0; st < NUM_STAGES; st++)
+        lat_hist_print(&global_stages[st], stage_names[st], stdout);
+      dump_stages(global_stages, "latency_stages.txt");
+      fflush(stdout);
+      exit(0);
+    }
+
+    if (reload_projection) {
+      reload_projection = 0;
+      if (projection_file)
+        projection_load(projection_file);
+    }
+
+    /* settings changed on the control socket take effect from this round */
+    pthread_mutex_lock(&config_mutex);
+    if (config_pending) {
+      install_config();
+      config_pending = 0;
+      report_rounds = tick_ns < 1000000000 ? 1000000000 / tick_ns : 1;
+    }
+    pthread_mutex_unlock(&config_mutex);
+
+    if (report_batching) {
+      report_batching = 0;
+      read_batch_report();
+    }
+
+    struct tick_timing *tt = &tick_timing[(round_number + 1) % TICK_TIMING_ROUNDS];
+    tt->sched_ns = sched_ns;
+    tt->wake_ns = wake_ns;
+    uint64_t r = __atomic_add_fetch(&round_number, 1, __ATOMIC_RELEASE);
+    if (r % report_rounds == 0) {
+      budget_report();
+      printf("tick lateness: mean %.1f us, max %.1f us, spin lead %.1f us\n",
+            late_sum / 1e3 / late_ticks, late_max / 1e3, (lead_ns < tick_spin_ns ? lead_ns : tick_spin_ns) / 1e3);
+      late_sum = late_max = late_ticks = 0;
+    }
 
     pthread_mutex_lock(&lock_global_lm);
     global_lm.num_finished = 0; // restart counter
@@ -140,12 +623,255 @@ void* tick(void *arg) {
 }
 
 
+/* current settings, as a base for a pending change */
+static void current_config(struct nic_config *c)
+{
+  *c = *__atomic_load_n(&active_config, __ATOMIC_ACQUIRE);
+  c->projection = PROJECTION_KEEP;
+}
+
+/**
+ * Tick thread (or main, before it starts): snapshot the settings in the
+ * globals for the pollers and the control socket. The snapshot is complete
+ * before it is published, and published before config_version moves, so a
+ * connection that sees the new version sees the whole of the new settings.
+ */
+static const struct nic_config * publish_config(void)
+{
+  struct nic_config *c = calloc(1, sizeof(*c));
+
+  TEST_Z(c);
+  c->tick_ns = tick_ns;
+  c->num_tiers = num_tiers;
+  memcpy(c->tier_mult, tier_mult, sizeof(tier_mult));
+  c->read_mode = read_mode;
+  c->read_gap = read_gap;
+  c->budget_bytes = budget_bytes;
+  c->budget_reads = budget_reads;
+  c->stall_ns = stall_ns;
+  c->stall_rounds = stall_rounds;
+  c->projection = PROJECTION_KEEP;
+  if (projection_file)
+    strncpy(c->projection_file, projection_file, PATH_MAX - 1);
+
+  __atomic_store_n(&active_config, c, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&config_version, 1, __ATOMIC_RELEASE);
+  return c;
+}
+
+static void print_config(const struct nic_config *c, FILE *out)
+{
+  static const char *modes[] = { "full", "header", "auto" };
+
+  fprintf(out, "interval %lu ns\n", c->tick_ns);
+  for (int t = 1; t < c->num_tiers; t++)
+    fprintf(out, "tier %d every %lu ns\n", t, c->tick_ns * c->tier_mult[t]);
+  fprintf(out, "mode %s\ngap %u\nbudget %.0f B/s %.0f READ/s\nstall %lu ns\n",
+          modes[c->read_mode], c->read_gap, c->budget_bytes, c->budget_reads, c->stall_ns);
+  fprintf(out, "projection %s\n", c->projection_file[0] ? c->projection_file : "none");
+}
+
+/* apply command verb with arguments arg, arg2 to c, returns -1 if invalid */
+static int edit_config(struct nic_config *c, const char *verb, char *arg, char *arg2)
+{
+  if (arg == NULL)
+    return -1;
+
+  if (strcmp(verb, "interval") == 0) {
+    uint64_t ns = parse_duration(arg);
+    if (ns == 0)
+      return -1;
+    c->tick_ns = ns;  // slower tiers keep their multiple of the interval
+  } else if (strcmp(verb, "tiers") == 0) {
+    struct nic_config t = *c;
+    /* the delta consumer holds a slot per tier, the poller the latest and the landing one */
+    if (parse_tiers(strcmp(arg, "none") == 0 ? NULL : arg, t.tick_ns, &t.num_tiers, t.tier_mult) ||
+        t.num_tiers + 2 > ring_slots)
+      return -1;
+    c->num_tiers = t.num_tiers;
+    memcpy(c->tier_mult, t.tier_mult, sizeof(c->tier_mult));
+  } else if (strcmp(verb, "mode") == 0) {
+    if (strcmp(arg, "full") == 0)
+      c->read_mode = READ_MODE_FULL;
+    else if (strcmp(arg, "header") == 0)
+      c->read_mode = READ_MODE_HEADER;
+    else if (strcmp(arg, "auto") == 0)
+      c->read_mode = READ_MODE_AUTO;
+    else
+      return -1;
+  } else if (strcmp(verb, "gap") == 0) {
+    c->read_gap = (uint32_t)atoi(arg);
+  } else if (strcmp(verb, "budget") == 0) {
+    double bytes = parse_rate(arg), reads = arg2 ? parse_rate(arg2) : c->budget_reads;
+    if (bytes < 0 || reads < 0)
+      return -1;
+    c->budget_bytes = bytes;
+    c->budget_reads = reads;
+  } else if (strcmp(verb, "stall") == 0) {
+    uint64_t ns = strcmp(arg, "0") == 0 ? 0 : parse_duration(arg);
+    if (ns == 0 && strcmp(arg, "0") != 0)
+      return -1;
+    c->stall_ns = ns;
+  } else if (strcmp(verb, "projection") == 0) {
+    if (strcmp(arg, "none") == 0) {
+      c->projection = PROJECTION_CLEAR;
+    } else {
+      c->projection = PROJECTION_LOAD;
+      strncpy(c->projection_file, arg, PATH_MAX - 1);
+    }
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Command from the control socket. Changes are checked and queued, the tick
+ * thread installs them at the next tick (see install_config); several changes
+ * before a tick take effect together.
+ */
+void control_command(char *cmd, FILE *out)
+{
+  char *save = NULL;
+  char *verb = strtok_r(cmd, " \t", &save);
+  char *arg = strtok_r(NULL, " \t", &save);
+  char *arg2 = strtok_r(NULL, " \t", &save);
+  struct nic_config c;
+
+  if (verb == NULL)
+    return;
+  if (strcmp(verb, "status") == 0) {
+    current_config(&c);
+    print_config(&c, out);
+    fprintf(out, "%d connections, round %lu\n", num_active_connections,
+            __atomic_load_n(&round_number, __ATOMIC_ACQUIRE));
+    uint64_t consumed, lag;
+    round_consumer_stats(&consumed, &lag);
+    fprintf(out, "%d round slots per pod, %lu rounds consumed (max wait %.1f us), %lu skipped for lack of a slot\n",
+            ring_slots, consumed, lag / 1e3, __atomic_load_n(&ring_overruns, __ATOMIC_RELAXED));
+    uint64_t crc_rounds = __atomic_load_n(&crc_totals.rounds, __ATOMIC_RELAXED);
+    if (crc_rounds) {
+      double us = __atomic_load_n(&crc_totals.ns, __ATOMIC_RELAXED) / 1e3 / crc_rounds;
+      fprintf(out, "crc32c (%s): %lu chunks in %lu rounds, %.2f us per round (%.3f%% of the interval), "
+              "%lu mismatches, %lu corrupted\n", crc32c_impl(),
+              __atomic_load_n(&crc_totals.chunks, __ATOMIC_RELAXED), crc_rounds, us, us * 1e3 * 100 / c.tick_ns,
+              __atomic_load_n(&crc_totals.mismatches, __ATOMIC_RELAXED),
+              __atomic_load_n(&crc_totals.corrupted, __ATOMIC_RELAXED));
+    }
+    return;
+  }
+  if (strcmp(verb, "latency") == 0) {
+    int pod = arg ? atoi(arg) : -1;
+    const struct latency_hist *h = global_stages;
+    if (arg && (pod < 0 || pod >= RDMA_MAX_CONNECTIONS || (h = pod_stages[pod]) == NULL)) {
+      fprintf(out, "error: no pod-%s\n", arg);
+      return;
+    }
+    for (int st = 0; st < NUM_STAGES; st++)
+      lat_hist_print(&h[st], stage_names[st], out);
+    return;
+  }
+  if (strcmp(verb, "deltas") == 0) {
+    for (int i = 0; i < RDMA_MAX_CONNECTIONS; i++) {
+      struct pod_deltas *pd = pod_deltas[i];
+      if (pd == NULL || (arg && i != atoi(arg)))
+        continue;
+      fprintf(out, "pod-%d: %u counters, %lu rounds, %lu changes, %lu resets", i,
+              __atomic_load_n(&pd->used.num_counters, __ATOMIC_RELAXED),
+              __atomic_load_n(&pd->rounds, __ATOMIC_RELAXED),
+              __atomic_load_n(&pd->changes, __ATOMIC_RELAXED),
+              __atomic_load_n(&pd->resets, __ATOMIC_RELAXED));
+      for (int t = 0; t < SEGMENT_MAX_TIERS; t++) {
+        uint64_t ns = __atomic_load_n(&pd->interval_ns[t], __ATOMIC_RELAXED);
+        if (ns)
+          fprintf(out, ", tier %d over %.3f ms", t, ns / 1e6);
+      }
+      fprintf(out, "\n");
+    }
+    return;
+  }
+  if (strcmp(verb, "help") == 0) {
+    fprintf(out, "status | interval <duration> | tiers <interval,...>|none | mode full|header|auto |\n"
+                 "gap <bytes> | budget <bytes/s> [<reads/s>] | stall <duration>|0 | projection <file>|none |\n"
+                 "latency [<pod>] | deltas [<pod>]\n");
+    return;
+  }
+
+  pthread_mutex_lock(&config_mutex);
+  if (config_pending)
+    c = pending_config;
+  else
+    current_config(&c);
+
+  if (edit_config(&c, verb, arg, arg2) == 0) {
+    pending_config = c;
+    config_pending = 1;
+    fprintf(out, "ok, from the next tick\n");
+  } else {
+    fprintf(out, "error: invalid command, see help\n");
+  }
+  pthread_mutex_unlock(&config_mutex);
+}
+
+/* tick thread, with config_mutex held: install the pending settings */
+void install_config(void)
+{
+  static char loaded[PATH_MAX];
+  struct nic_config *c = &pending_config;
+
+  tick_ns = c->tick_ns;
+  memcpy(tier_mult, c->tier_mult, sizeof(tier_mult));
+  num_tiers = c->num_tiers;
+  read_mode = c->read_mode;
+  read_gap = c->read_gap;
+  stall_ns = c->stall_ns;
+  stall_rounds = stall_ns ? (uint32_t)((stall_ns + tick_ns - 1) / tick_ns) : 0;
+  budget_bytes = c->budget_bytes;
+  budget_reads = c->budget_reads;
+  budget_configure(budget_bytes, budget_reads, budget_burst(), num_tiers);
+
+  if (c->projection == PROJECTION_LOAD && projection_load(c->projection_file) == 0) {
+    strcpy(loaded, c->projection_file);
+    projection_file = loaded;
+  } else if (c->projection == PROJECTION_CLEAR) {
+    projection_clear();
+    projection_file = NULL;
+  }
+
+  printf("New settings installed:\n");
+  print_config(publish_config(), stdout);
+}
+
+/**
+ * Before the next round of the connection, after new settings were installed:
+ * switch to their snapshot and recompile its plans with the new gap and
+ * tiers. Everything else is read from the snapshot at every round.
+ */
+void apply_config(struct connection *conn)
+{
+  conn->config_version = __atomic_load_n(&config_version, __ATOMIC_ACQUIRE);
+  conn->config = __atomic_load_n(&active_config, __ATOMIC_ACQUIRE);
+
+  uint32_t gap = conn->config->read_gap;
+  conn->plan.gap = conn->scratch.gap = gap;
+  for (int t = 0; t < SEGMENT_MAX_TIERS; t++)
+    conn->proj[t].gap = conn->shot[t].gap = gap;
+  if (conn->layout_valid)
+    update_projection(conn);
+}
+
+
 int on_connect_request(struct rdma_cm_id *id)
 {
   struct rdma_conn_param cm_params;
 
   printf("\nreceived connection request.\n");
-  build_connection(id);
+  if (build_connection(id) == NULL) {
+    fprintf(stderr, "Connection limit reached, rejecting\n");
+    rdma_reject(id, NULL, 0);
+    rdma_destroy_id(id);
+    return 0;
+  }
   build_params(&cm_params);
   
   TEST_NZ(rdma_accept(id, &cm_params));
@@ -186,7 +912,35 @@ int on_event(struct rdma_cm_event *event)
 
 void usage(const char *argv0)
 {
-  fprintf(stderr, "usage: %s <port> <sampling interval [sec]> <block size> <num blocks>\n", argv0);
+  fprintf(stderr, "usage: %s [-m full|header|auto] [-p file] [-G gap] [-T interval,...] [-B bytes/s] [-R reads/s] [-S timeout] [-C socket] [-k cores] [-t core] [-F priority] [-W duration] [-J duration] [-s name] [-r slots] <port> <sampling interval [sec]> <block size> <num blocks>\n", argv0);
+  fprintf(stderr, "  -m  read the whole segment every round, the header first and then only the\n"
+                  "      used/dirty bytes if its generation changed, or choose by cost (default auto)\n");
+  fprintf(stderr, "  -p  projection rules '<pid|service|*> <metric>,...' per line, reloaded on SIGHUP\n");
+  fprintf(stderr, "  -G  coalesce ranges less than this many bytes apart into one READ (default 0)\n");
+  fprintf(stderr, "  -T  read slots of tier 1, 2, ... at these intervals, each a multiple of the\n"
+                  "      previous one, e.g. -T 10ms,1s; tier 0 slots at every sampling interval\n"
+                  "      (intervals take a ns, us, ms or s suffix, seconds by default)\n");
+  fprintf(stderr, "  -B  READ at most this many bytes per second (k, M, G suffixes, default unlimited)\n");
+  fprintf(stderr, "  -R  post at most this many READs per second (default unlimited); over budget,\n"
+                  "      rounds fall back to faster tiers, slow tiers give way first\n");
+  fprintf(stderr, "  -S  mark pods stalled if their heartbeat does not move for this long and\n"
+                  "      read them every %d ticks only, 0 to disable (default 5s)\n", STALL_DEMOTE_ROUNDS);
+  fprintf(stderr, "  -C  control socket to change the settings above and the sampling interval at\n"
+                  "      runtime, e.g. 'interval 10ms' (send 'help'), empty to disable\n"
+                  "      (default /tmp/agent-nic-<port>.ctl)\n");
+  fprintf(stderr, "  -k  pin the CQ pollers on these cores, round-robin, e.g. 2,4-7; best on the\n"
+                  "      NUMA node of the RNIC, printed for each connection\n");
+  fprintf(stderr, "  -t  pin the tick thread on this core, best an isolated one (isolcpus=)\n");
+  fprintf(stderr, "  -F  run the pollers under SCHED_FIFO at this priority, the tick thread one\n"
+                  "      above, 0 for the default policy (default 0, needs CAP_SYS_NICE)\n");
+  fprintf(stderr, "  -W  busy-poll the CQ this long after a completion before sleeping, e.g. 50us\n"
+                  "      (default 0), bounds the spinning of FIFO pollers\n");
+  fprintf(stderr, "  -J  wake up before each tick and spin until it is due, at most this long, the\n"
+                  "      lead adapts to how late sleeps end; 0 to sleep until the tick (default 50us)\n");
+  fprintf(stderr, "  -s  keep live stats in the shared memory object of this name, for uview-top,\n"
+                  "      empty to disable (default /agent-nic-<port>.stats)\n");
+  fprintf(stderr, "  -r  land the rounds of each pod in a ring of this many slots, used in place\n"
+                  "      by the consumers; rounds are skipped while all are in use (default %d)\n", ROUND_RING_DEFAULT);
   exit(1);
 }
 
@@ -195,21 +949,31 @@ struct connection* build_connection(struct rdma_cm_id *id)
 {
   /* builds QP and context of this connection */
   
-  if (num_connections >= RDMA_MAX_CONNECTIONS)
-    die("Connection limit reached\n");
+  int conn_id = connection_id_get();
+  if (conn_id == -1)
+    return NULL;
 
   struct connection *conn;
   struct ibv_qp_init_attr qp_attr;
 
-  build_context(id->verbs);
-  build_qp_attr(&qp_attr);
+  build_context(id->verbs, conn_id);
+  build_qp_attr(&qp_attr, conn_id);
 
-  TEST_NZ(rdma_create_qp(id, s_ctx[num_connections]->pd, &qp_attr));
+  TEST_NZ(rdma_create_qp(id, s_ctx[conn_id]->pd, &qp_attr));
 
   id->context = conn = (struct connection *)malloc(sizeof(struct connection));
 
   conn->id = id;
-  conn->logical_id = num_connections;
+  conn->logical_id = conn_id;
+  if (stats) {
+    /* the entry may be left by an earlier connection with the same id; its poller writes it from now on */
+    struct nic_stats_pod *ps = &stats->pods[conn_id];
+    nic_stats_write_begin(&ps->seq);
+    memset((char *)ps + offsetof(struct nic_stats_pod, state), 0, sizeof(*ps) - offsetof(struct nic_stats_pod, state));
+    NIC_STATS_SET(ps->state, NIC_POD_CONNECTED);
+    nic_stats_write_end(&ps->seq);
+    __atomic_add_fetch(&stats->connections, 1, __ATOMIC_RELAXED);
+  }
   conn->qp = id->qp;
 
   conn->send_state = SS_INIT;
@@ -217,12 +981,46 @@ struct connection* build_connection(struct rdma_cm_id *id)
 
   conn->connected = 0;
 
+  conn->round_phase = ROUND_IDLE;
+  conn->wr_outstanding = 0;
+  conn->wr_phase = 0;
+  conn->wr_posted = 0;
+  conn->layout_valid = 0;
+  conn->config_version = __atomic_load_n(&config_version, __ATOMIC_ACQUIRE);
+  conn->config = __atomic_load_n(&active_config, __ATOMIC_ACQUIRE);
+  conn->level = conn->config->num_tiers - 1;
+  conn->first_read_ns = 0;
+  conn->last_read_ns = 0;
+  conn->first_read_sent = 0;
+  conn->num_parts = 1;
+  conn->landing = NULL;
+  conn->latest = NULL;
+  conn->round_fresh = 0;
+  conn->ack_generation = 0;
+  conn->meta = NULL;
+  conn->crc_bufs = NULL;
+  conn->crc_chunks = NULL;
+  conn->crc_vals = NULL;
+  conn->crc_failed = 0;
+  conn->crc_failed_gen = 0;
+  memset(conn->last_heartbeat, 0, sizeof(conn->last_heartbeat));
+  memset(conn->idle_rounds, 0, sizeof(conn->idle_rounds));
+  conn->stalled_parts = 0;
+  conn->stalled = 0;
+  read_plan_init(&conn->plan, conn->config->read_gap);
+  read_plan_init(&conn->scratch, conn->config->read_gap);
+  for (int t = 0; t < SEGMENT_MAX_TIERS; t++) {
+    conn->proj_active[t] = 0;
+    conn->last_generation[t] = 0;
+    read_plan_init(&conn->proj[t], conn->config->read_gap);
+    read_plan_init(&conn->shot[t], conn->config->read_gap);
+  }
+
   register_memory(conn);
   post_receives(conn);
 
   // in the agent-nic there is no concurrency, all events are processed
   // one by one including connection creation / destroy 
-  num_connections++;
   num_active_connections++;
   
   /* initialize latency meter if first active connection */
@@ -236,33 +1034,70 @@ struct connection* build_connection(struct rdma_cm_id *id)
 }
 
 
-void build_context(struct ibv_context *verbs)
+void build_context(struct ibv_context *verbs, int id)
 {
-  if (s_ctx[num_connections]) {
-    if (s_ctx[num_connections]->ctx != verbs)
-      die("context already in use!");
-
-    // TODO understand the logic here
-    printf("[WARNING]: context already in use\n");
-    return;
+  /* connections may arrive on any device and port we listen on, each has its
+     own CQ and poller, the PD is shared per device. The tables by id are kept
+     when the connection goes, for the control socket, and reset on reuse */
+  s_ctx[id] = (struct context *)malloc(sizeof(struct context));
+  if (pod_stages[id] == NULL) {
+    TEST_Z(pod_stages[id] = calloc(NUM_STAGES, sizeof(struct latency_hist)));
+    TEST_Z(pod_deltas[id] = calloc(1, sizeof(struct pod_deltas)));
+    pthread_mutex_init(&pod_deltas[id]->mutex, NULL);
+  } else {
+    memset(pod_stages[id], 0, NUM_STAGES * sizeof(struct latency_hist));
+    reset_deltas(pod_deltas[id]);
   }
+  pthread_mutex_lock(&lock[id]);
+  terminate[id] = 0;
+  read_remote[id] = 0;
+  pthread_mutex_unlock(&lock[id]);
+
+  s_ctx[id]->ctx = verbs;  // verbs are associated with rdma_cm_id
+  s_ctx[id]->wr_hwm = 0;
+  s_ctx[id]->cq_hwm = 0;
+  s_ctx[id]->wr_recent = 0;
+  s_ctx[id]->cq_recent = 0;
+  s_ctx[id]->cq_posts = 0;
+  s_ctx[id]->cqe_max = 0;
+
+  s_ctx[id]->pd = device_pd(verbs);
+  TEST_Z(s_ctx[id]->comp_channel = ibv_create_comp_channel(s_ctx[id]->ctx));
+  /* size the CQ for full-segment rounds, it grows if rounds post more WRs, see post_phase */
+  struct queue_depths qd;
+  queue_depths(NIC_PIPELINE_DEPTH, num_mr, 1, &qd);
+  TEST_Z(s_ctx[id]->cq = ibv_create_cq(s_ctx[id]->ctx, qd.cqe, NULL, s_ctx[id]->comp_channel, 0));
+  s_ctx[id]->cqe_min = s_ctx[id]->cq->cqe;
+  TEST_NZ(ibv_req_notify_cq(s_ctx[id]->cq, 0));
 
-  s_ctx[num_connections] = (struct context *)malloc(sizeof(struct context));
+  int *i = malloc(sizeof(int)); // thread identifier
+  *i = id;
+  TEST_NZ(pthread_create(&s_ctx[id]->cq_poller_thread, NULL, poll_cq, (void*)i));
+  int core = numa_pin_thread(s_ctx[id]->cq_poller_thread);
+  sched_apply(s_ctx[id]->cq_poller_thread, -1, profile.fifo_priority);
+  printf("Connection %d on RNIC %s (NUMA node %d), poller on core %d (node %d%s)\n", id,
+         ibv_get_device_name(verbs->device), numa_device_node(ibv_get_device_name(verbs->device)),
+         core, core == -1 ? -1 : numa_cpu_node(core),
+         core == -1 || sched_core_isolated(core) ? "" : ", not isolated");
 
-  s_ctx[num_connections]->ctx = verbs;  // verbs are associated with rdma_cm_id
+}
 
-  /* for new connection requests can we use same pd, cq and qp, and completion channel without creating a new one ?*/
-  TEST_Z(s_ctx[num_connections]->pd = ibv_alloc_pd(s_ctx[num_connections]->ctx));
-  TEST_Z(s_ctx[num_connections]->comp_channel = ibv_create_comp_channel(s_ctx[num_connections]->ctx));
-  TEST_Z(s_ctx[num_connections]->cq = ibv_create_cq(s_ctx[num_connections]->ctx, 10 * num_mr, NULL, s_ctx[num_connections]->comp_channel, 0)); /* cqe=10 is arbitrary */
-  TEST_NZ(ibv_req_notify_cq(s_ctx[num_connections]->cq, 0));
-
-  int *i = malloc(sizeof(int)); // thread identifier
-  *i = num_connections;
-  TEST_NZ(pthread_create(&s_ctx[num_connections]->cq_poller_thread, NULL, poll_cq, (void*)i));
 
+/**
+ * WRs of the largest round: a full read, or the dirty ranges, plus the WRITEs
+ * to the control lines, the first-read timestamp of each segment and the
+ * generation ack
+ */
+int max_round_wrs(void)
+{
+  return max_read_wrs() + SEGMENT_MAX_PARTS + 1;
 }
 
+/* READs of the largest round, split pieces included */
+int max_read_wrs(void)
+{
+  return num_mr > READ_PLAN_MAX_RANGES ? num_mr : READ_PLAN_MAX_RANGES;
+}
 
 void * poll_cq(void *ctx)
 {
@@ -274,12 +1109,12 @@ void * poll_cq(void *ctx)
 
   printf("Polling on connection %d\n", i);
   
+  uint64_t caught = 0;   // completions found busy-polling, without sleeping on the channel
   struct latency_meter lm;
   lm.size = 100;  // initial size
   lm.samples = (double*)malloc(sizeof(double)*lm.size);
   
   int ret = 0;
-  int num_read_completed = num_mr;
 
   while (!ret) {
 
@@ -289,15 +1124,25 @@ void * poll_cq(void *ctx)
     TEST_NZ(ibv_req_notify_cq(cq, 0)); // request for notifcation for next event
     
     // next, we empty the CQ by processing all CQ events (non-blocking call)
+    int drained = 0;
     while (ibv_poll_cq(cq, 1, &wc)) 
     {
-      ret = on_completion(&wc, i, &lm, &num_read_completed);
+      ret = on_completion(&wc, i, &lm);
+      drained++;
     }
-
+    /* at least as many completions were queued when the drain started */
+    if (drained > s_ctx[i]->cq_hwm)
+      s_ctx[i]->cq_hwm = drained;
+    if (drained > s_ctx[i]->cq_recent)
+      s_ctx[i]->cq_recent = drained;
+
+    if (!ret && profile.busy_poll_ns)
+      ret = busy_poll(cq, i, &lm, &caught);
   }
 
   /* when we exit the loop means pod has to terminate, record stats and die*/
-  printf("Termination of poll_cq thread %d\n", i);
+  printf("Termination of poll_cq thread %d, CQ high-water mark %d of %d entries (%d reserved), %lu completions busy-polled\n",
+        i, s_ctx[i]->cq_hwm, s_ctx[i]->cq->cqe, s_ctx[i]->wr_hwm, caught);
   char filename[100];
   sprintf(filename, "latency_samples_%d.txt", i);
   FILE *f = fopen(filename, "w");
@@ -307,6 +1152,8 @@ void * poll_cq(void *ctx)
   }
   fclose(f);
   free(lm.samples);
+  sprintf(filename, "latency_stages_%d.txt", i);
+  dump_stages(pod_stages[i], filename);
 
   /* is last active thread write global latency, otherwise just decrease and quit */
   pthread_mutex_lock(&lock_global_lm);
@@ -321,6 +1168,7 @@ void * poll_cq(void *ctx)
     }
     fclose(f);
     free(global_lm.samples);
+    dump_stages(global_stages, "latency_stages.txt");
   }
   num_active_connections--;
   pthread_mutex_unlock(&lock_global_lm);
@@ -328,28 +1176,63 @@ void * poll_cq(void *ctx)
 }
 
 
-void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
+void build_qp_attr(struct ibv_qp_init_attr *qp_attr, int id)
 {
   memset(qp_attr, 0, sizeof(*qp_attr));
 
-  qp_attr->send_cq = s_ctx[num_connections]->cq;
-  qp_attr->recv_cq = s_ctx[num_connections]->cq;
+  qp_attr->send_cq = s_ctx[id]->cq;
+  qp_attr->recv_cq = s_ctx[id]->cq;
   qp_attr->qp_type = IBV_QPT_RC;
 
-  qp_attr->cap.max_send_wr = 10 * num_mr;
-  qp_attr->cap.max_recv_wr = 10 * num_mr;
+  /* the send queue cannot be resized, it must fit the largest rounds */
+  struct queue_depths qd;
+  queue_depths(NIC_PIPELINE_DEPTH, max_round_wrs(), 1, &qd);
+  qp_attr->cap.max_send_wr = qd.send_wr;
+  qp_attr->cap.max_recv_wr = qd.recv_wr;
   qp_attr->cap.max_send_sge = 1;
   qp_attr->cap.max_recv_sge = 1;
 }
 
 
-int on_completion(struct ibv_wc *wc, int i, struct latency_meter* lm, int* num_read_completed)
+/**
+ * Spin on the CQ for the completions of the round just posted, for at most
+ * busy_poll_ns after the last one, instead of sleeping on the channel: the
+ * READ of a segment often completes within a few microseconds, less than a
+ * wakeup takes. The CQ stays armed, a completion found here leaves an event
+ * behind, then the poller finds the CQ empty. Returns like on_completion.
+ */
+static int busy_poll(struct ibv_cq *cq, int i, struct latency_meter *lm, uint64_t *caught)
+{
+  struct ibv_wc wc;
+  int ret = 0;
+  uint64_t last = mono_ns(), now;
+
+  do {
+    now = mono_ns();
+    if (ibv_poll_cq(cq, 1, &wc)) {
+      ret = on_completion(&wc, i, lm);
+      (*caught)++;
+      last = now = mono_ns();   // on_completion may have taken a while, e.g. waiting for the tick
+    }
+  } while (!ret && now - last < profile.busy_poll_ns);
+  return ret;
+}
+
+int on_completion(struct ibv_wc *wc, int i, struct latency_meter* lm)
 {
 
   struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
 
+  if (wc->status == IBV_WC_WR_FLUSH_ERR)
+    return 1;   // torn down, see destroy_connection
   if (wc->status != IBV_WC_SUCCESS) {
     fprintf(stderr, "on_completion: status is not IBV_WC_SUCCESS: %d\n", wc->status);
+    if (stats) {
+      struct nic_stats_pod *ps = &stats->pods[i];
+      nic_stats_write_begin(&ps->seq);
+      NIC_STATS_ADD(ps->errors, 1);
+      nic_stats_write_end(&ps->seq);
+    }
     return 1;
   }
 
@@ -362,90 +1245,891 @@ int on_completion(struct ibv_wc *wc, int i, struct latency_meter* lm, int* num_r
     {
       printf("Received rkey");
       memcpy(&conn->peer_mr, &conn->recv_msg->data.mr, sizeof(conn->peer_mr));
+      if (conn->recv_msg->num_parts > 1 && conn->recv_msg->num_parts <= SEGMENT_MAX_PARTS) {
+        conn->num_parts = conn->recv_msg->num_parts;
+        resize_local_regions(conn);
+      }
       /* only rearm for other control messages from agent on host, e.g., MSG_DONE to disconnect */
       // post_receives(conn);
     }
   }
   else
-  /* 2. else completion is a READ completion: read from remote memory region */
+  /* 2. else completion is a READ (or generation ack) of the current round */
   {
     conn->send_state = SS_RDMA_SENT;
-    // READ WR are processed in order, we wait for all of them to complete before computing latency
-    if (++(*num_read_completed) == num_mr) 
-    {
-        double t_ns = record_time_elapsed(lm);
-        printf("READ remote buffer pod-%d: %s, latency: %f [ns]\n", 
-              i, get_peer_message_region(conn), t_ns);
-
-        /* following timer computes latency when all connections have finished */
-        pthread_mutex_lock(&lock_global_lm);
-        global_lm.num_finished++;
-        if (global_lm.num_finished == num_active_connections) {
-          double t_ns = record_time_elapsed(&global_lm);
-          printf("global latency: %f [ns]\n", t_ns);
-        }
-        pthread_mutex_unlock(&lock_global_lm);
+    if (conn->first_cqe_ns == 0)
+      conn->first_cqe_ns = mono_ns();
+    // WRs are processed in order, we wait for all of them to complete before moving on
+    if (--conn->wr_outstanding > 0) {
+      if (conn->wr_outstanding == conn->wr_phase - conn->wr_posted)
+        post_batch(conn);   // the batch posted completed, the CQ fits the next one
+      return 0;
+    }
+    conn->last_cqe_ns = mono_ns();   // of the round, unless a body follows the header
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double t_ns = (double)(now.tv_sec - conn->phase_start.tv_sec) * 1.0e9 +
+                  (double)(now.tv_nsec - conn->phase_start.tv_nsec);
+    /* the RNIC read the data between post and completion, we take the middle */
+    conn->read_ns = (uint64_t)conn->phase_start.tv_sec * 1000000000ULL + conn->phase_start.tv_nsec + (uint64_t)(t_ns / 2);
+
+    if (conn->round_phase == ROUND_HEAD) {
+      /* header landed: fetch the body, if anything changed */
+      cost_model_head_sample(&conn->cost, t_ns);
+      if (post_body(conn))
+        return 0;
+    } else {
+      cost_model_bulk_sample(&conn->cost, t_ns, conn->phase_bytes, conn->phase_wrs);
+      read_batch_sample(conn->phase_bytes, conn->phase_split, t_ns);
     }
 
-    
+    end_round(conn, i, lm);
   }
 
   // if all outstanding READ requests have completed, then we can send a new batch of READ
-  if (conn->recv_state == RS_MR_RECV && *num_read_completed == num_mr)
+  if (conn->recv_state == RS_MR_RECV && conn->wr_outstanding == 0)
   {
-    
-    struct ibv_send_wr *wr, *prev_wr, *head_wr, *bad_wr = NULL;
-    struct ibv_sge *sge;
+    while (1) {
+      /* wait to be signaled before sending read request */
+      pthread_mutex_lock(&lock[i]);
+      while (read_remote[i] == 0) {
+        pthread_cond_wait(&cond_poll_agent[i], &lock[i]);
+      }
+      read_remote[i] = 0;
+      uint8_t exit = terminate[i]; 
+      pthread_mutex_unlock(&lock[i]);
 
-    for (int k=0; k < num_mr; k++) {
-      
-      wr = malloc(sizeof(struct ibv_send_wr));
-      sge = malloc(sizeof(struct ibv_sge));
+      if (exit) {
+        // if connection was tear down, then when we resume we have to quit
+        return 1;
+      }
       
-      memset(wr, 0, sizeof(*wr));
-
-      wr->wr_id = (uintptr_t)conn; // something that we specify and use as ID
-      wr->opcode = IBV_WR_RDMA_READ;
-      wr->sg_list = sge;
-      wr->num_sge = 1;
-      wr->send_flags = IBV_SEND_SIGNALED;
-      wr->wr.rdma.remote_addr = (uintptr_t)conn->peer_mr.addr;
-      wr->wr.rdma.rkey = conn->peer_mr.rkey;
-
-      sge->addr = (uintptr_t)conn->rdma_local_region[k];
-      sge->length = block_size;
-      sge->lkey = conn->rdma_local_mr[k]->lkey;
-
-      if (k==0) {
-        head_wr = wr;
-      } else {
-        prev_wr->next = wr;
+      // send new READ, of the slots of all tiers due this tick (unless stalled or over budget)
+      uint64_t r = __atomic_load_n(&round_number, __ATOMIC_ACQUIRE);
+      if (conn->stalled && r % STALL_DEMOTE_ROUNDS != 0)
+        continue;
+      if (conn->config_version != __atomic_load_n(&config_version, __ATOMIC_ACQUIRE))
+        apply_config(conn);
+      conn->level = tier_level(conn->config, r);
+      conn->round_sched_ns = tick_timing[r % TICK_TIMING_ROUNDS].sched_ns;
+      conn->round_wake_ns = tick_timing[r % TICK_TIMING_ROUNDS].wake_ns;
+      conn->worker_wake_ns = mono_ns();
+      conn->round_bytes = 0;
+      conn->round_wrs = 0;
+      clock_gettime(CLOCK_REALTIME, &(lm->start)); // start clock
+      if (post_round(conn))
+        break;
+    }
+  } 
+  return 0;
+}
+
+/* fill WR k to READ len bytes at remote offset off, landing at local address dst */
+static void set_read_wr(struct connection *conn, int k, uint32_t off, char *dst, uint32_t len, uint32_t lkey)
+{
+  struct ibv_send_wr *wr = &conn->wrs[k];
+
+  memset(wr, 0, sizeof(*wr));
+  wr->wr_id = (uintptr_t)conn; // something that we specify and use as ID
+  wr->opcode = IBV_WR_RDMA_READ;
+  wr->sg_list = &conn->sges[k];
+  wr->num_sge = 1;
+  wr->send_flags = IBV_SEND_SIGNALED;
+  wr->wr.rdma.remote_addr = (uintptr_t)conn->peer_mr.addr + off;
+  wr->wr.rdma.rkey = conn->peer_mr.rkey;
+
+  conn->sges[k].addr = (uintptr_t)dst;
+  conn->sges[k].length = len;
+  conn->sges[k].lkey = lkey;
+}
+
+/**
+ * Split factor for a round of bytes in n READs, as learned by read-batch
+ * among the factors for which the round posts at most max_wrs WRs and pieces
+ * are not too small.
+ */
+static int round_split(uint32_t bytes, int n, int max_wrs)
+{
+  int max_split = 1 << (READ_BATCH_SPLITS - 1);
+
+  while (max_split > 1 && (n * max_split > max_wrs || bytes / (n * max_split) < READ_BATCH_MIN_BYTES))
+    max_split /= 2;
+  return read_batch_split(bytes, max_split);
+}
+
+/* fill WRs from k on to READ len bytes at off into dst, in split pieces; returns the next WR */
+static int add_read(struct connection *conn, int k, uint32_t off, char *dst, uint32_t len, uint32_t lkey, int split)
+{
+  uint32_t piece = (len + split - 1) / split;
+
+  for (uint32_t done = 0; done < len; done += piece) {
+    uint32_t l = len - done < piece ? len - done : piece;
+    set_read_wr(conn, k++, off + done, dst + done, l, lkey);
+  }
+  return k;
+}
+
+/**
+ * Fill WR k to WRITE the 8 bytes at src into the control line of the segment
+ * of container part at offset off, fenced behind the READs before it: the pod
+ * must not see an ack before the data it acknowledges was read.
+ */
+static void set_control_wr(struct connection *conn, int k, int part, uint32_t off, uint64_t *src)
+{
+  struct ibv_send_wr *wr = &conn->wrs[k];
+
+  memset(wr, 0, sizeof(*wr));
+  wr->wr_id = (uintptr_t)conn;
+  wr->opcode = IBV_WR_RDMA_WRITE;
+  wr->sg_list = &conn->sges[k];
+  wr->num_sge = 1;
+  wr->send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
+  wr->wr.rdma.remote_addr = (uintptr_t)conn->peer_mr.addr + (uint64_t)part * block_size +
+                            conn->layout.control_off + off;
+  wr->wr.rdma.rkey = conn->peer_mr.rkey;
+
+  conn->sges[k].addr = (uintptr_t)src;
+  conn->sges[k].length = sizeof(uint64_t);
+  conn->sges[k].lkey = conn->ack_mr->lkey;
+}
+
+/* post the next WRs of the phase, as many as the CQ has room for */
+static void post_batch(struct connection *conn)
+{
+  struct ibv_send_wr *bad_wr = NULL;
+  int first = conn->wr_posted;
+  int n = conn->wr_phase - first < conn->wr_batch ? conn->wr_phase - first : conn->wr_batch;
+
+  conn->wrs[first + n - 1].next = NULL;
+  conn->wr_posted += n;
+  TEST_NZ(ibv_post_send(conn->qp, &conn->wrs[first], &bad_wr));
+}
+
+/**
+ * Chain and post the first n WRs of the connection, starting the phase clock.
+ * If the CQ could not grow to fit them all they go in batches, each posted
+ * once the one before completed.
+ */
+void post_phase(struct connection *conn, int n)
+{
+  for (int k = 0; k < n; k++)
+    conn->wrs[k].next = (k + 1 < n) ? &conn->wrs[k + 1] : NULL;
+
+  conn->wr_outstanding = n;
+  conn->wr_phase = n;
+  conn->wr_posted = 0;
+  conn->round_bytes += conn->phase_bytes;
+  conn->round_wrs += n;
+  int room = cq_reserve(s_ctx[conn->logical_id], n + RDMA_CONTROL_MSGS) - RDMA_CONTROL_MSGS;
+  conn->wr_batch = room > 0 ? room : 1;
+  clock_gettime(CLOCK_REALTIME, &conn->phase_start);
+  post_batch(conn);
+}
+
+/**
+ * Fill WR k to acknowledge generation gen to the pod, which then clears the
+ * chunks written up to it from its dirty bitmap
+ */
+static void set_ack_wr(struct connection *conn, int k, uint64_t gen)
+{
+  conn->ack_generation = gen;
+  conn->ack_buf[0] = gen;
+  set_control_wr(conn, k, 0, offsetof(struct segment_control, ack_generation), &conn->ack_buf[0]);
+}
+
+/**
+ * Header-first rounds read the header and the host stats, plus the dirty
+ * bitmap if the pod tracks chunks
+ */
+static uint32_t head_bytes(struct connection *conn)
+{
+  return (conn->layout.flags & SEGMENT_F_DIRTY) ? conn->layout.data_off : conn->layout.control_off;
+}
+
+/**
+ * Compile the projection of this pod for every resolution tier from the
+ * directory kept when we learned the layout, when the layout or the rules
+ * changed. A projected single-shot round reads the header,
+ * the host stats and the selected slots.
+ */
+static void update_projection(struct connection *conn)
+{
+  conn->proj_version = projection_version();
+  conn->ring->epoch++;   // copies in the ring may miss ranges of the new projections
+
+  int num_tiers = conn->config->num_tiers;
+
+  for (int t = 0; t < num_tiers; t++) {
+    int top = (t == num_tiers - 1) ? SEGMENT_MAX_TIERS - 1 : t;   // last tier reads all the slots
+
+    conn->proj_active[t] = projection_compile(&conn->layout, conn->meta, top, &conn->proj[t]);
+    if (!conn->proj_active[t])
+      continue;
+
+    read_plan_reset(&conn->shot[t]);
+    read_plan_add(&conn->shot[t], 0, conn->layout.control_off);
+    for (int k = 0; k < conn->proj[t].num_ranges; k++)
+      read_plan_add(&conn->shot[t], conn->proj[t].ranges[k].off, conn->proj[t].ranges[k].len);
+    if (conn->layout.flags & SEGMENT_F_CRC)
+      segment_crc_plan(&conn->layout, &conn->shot[t]);
+    printf("pod-%d projection tier %d: %d ranges, %u bytes\n",
+          conn->logical_id, t, conn->proj[t].num_ranges, conn->proj[t].bytes);
+  }
+}
+
+/**
+ * Prepare the READs of a round at the tier of conn->level. Until we have seen
+ * a valid segment header we read the whole segment num_mr times (single-shot),
+ * and so we always do for pods registered with their sidecars: their segments
+ * are read together, in full.
+ * Afterwards, depending on read_mode and the cost model, we either keep
+ * reading single-shot or read the header first, see post_body. If a
+ * projection applies to the pod, or some of its slots are not due at this
+ * round's tier, single-shot rounds only read the header and the selected slots.
+ */
+static void prepare_round(struct connection *conn)
+{
+  int header_first = 0;
+  int t = conn->level;
+  uint32_t region_size = block_size * conn->num_parts;
+  uint32_t full_bytes = num_mr * region_size;
+  int full_wrs = num_mr;
+
+  if (conn->layout_valid && conn->proj_active[t]) {
+    full_bytes = conn->shot[t].bytes;
+    full_wrs = conn->shot[t].num_ranges;
+  }
+
+  if (conn->layout_valid) {
+    if (conn->config->read_mode == READ_MODE_HEADER)
+      header_first = 1;
+    else if (conn->config->read_mode == READ_MODE_AUTO)
+      header_first = cost_model_header_first(&conn->cost, head_bytes(conn), full_bytes, full_wrs);
+  }
+
+  if (header_first) {
+    conn->round_phase = ROUND_HEAD;
+    conn->round_whole = 0;
+    conn->round_plan = NULL;
+    set_read_wr(conn, 0, 0, conn->rdma_local_region[0], head_bytes(conn), conn->rdma_local_mr[0]->lkey);
+    conn->phase_bytes = head_bytes(conn);
+    conn->phase_wrs = 1;
+    conn->phase_split = 1;
+  } else if (conn->layout_valid && conn->proj_active[t]) {
+    int k = 0;
+    conn->round_phase = ROUND_FULL;
+    conn->round_whole = t == conn->config->num_tiers - 1;
+    conn->round_plan = &conn->shot[t];
+    conn->phase_split = round_split(full_bytes, full_wrs, max_read_wrs());
+    for (int j = 0; j < conn->shot[t].num_ranges; j++) {
+      struct read_range *r = &conn->shot[t].ranges[j];
+      k = add_read(conn, k, r->off, conn->rdma_local_region[0] + r->off, r->len, conn->rdma_local_mr[0]->lkey, conn->phase_split);
+    }
+    conn->phase_bytes = full_bytes;
+    conn->phase_wrs = k;
+  } else {
+    int k = 0;
+    conn->round_phase = ROUND_FULL;
+    conn->round_whole = 1;
+    conn->round_plan = NULL;
+    conn->phase_split = round_split(full_bytes, full_wrs, max_read_wrs());
+    for (int j = 0; j < num_mr; j++)
+      k = add_read(conn, k, 0, conn->rdma_local_region[j], region_size, conn->rdma_local_mr[j]->lkey, conn->phase_split);
+    conn->phase_bytes = full_bytes;
+    conn->phase_wrs = k;
+  }
+}
+
+/**
+ * Post the READs of a new round, within the READ budget. If the budget left
+ * does not admit the round at its tier, we degrade it to lower (faster, and
+ * higher priority) tiers, reading fewer slots. If not even tier 0 is
+ * admitted, or the layout is unknown so that there is nothing to degrade to,
+ * the round is skipped.
+ * Returns the number of WRs posted, 0 if skipped.
+ */
+int post_round(struct connection *conn)
+{
+  uint32_t req_bytes = 0;
+  int req_wrs = 0;
+
+  conn->budget_class = conn->level;
+  conn->round_fresh = 0;
+  conn->landing = round_ring_acquire(conn->ring, __atomic_load_n(&round_number, __ATOMIC_ACQUIRE));
+  if (conn->landing == NULL) {
+    printf("pod-%d round skipped, all %d slots in use\n", conn->logical_id, conn->ring->num_slots);
+    __atomic_add_fetch(&ring_overruns, 1, __ATOMIC_RELAXED);
+    if (stats) {
+      struct nic_stats_pod *ps = &stats->pods[conn->logical_id];
+      nic_stats_write_begin(&ps->seq);
+      NIC_STATS_ADD(ps->skipped, 1);
+      nic_stats_write_end(&ps->seq);
+    }
+    return 0;
+  }
+  conn->rdma_local_region[0] = conn->landing->base;
+
+  if (conn->layout_valid && conn->proj_version != projection_version())
+    update_projection(conn);
+
+  while (1) {
+    prepare_round(conn);
+    if (conn->level == conn->budget_class) {
+      req_bytes = conn->phase_bytes;
+      req_wrs = conn->phase_wrs;
+    }
+
+    if (budget_admit(conn->level, conn->phase_bytes, conn->phase_wrs))
+      break;
+
+    if (!conn->layout_valid || conn->level == 0) {
+      conn->round_phase = ROUND_IDLE;
+      finish_landing(conn);
+      budget_account(conn->budget_class, req_bytes, req_wrs, 0, 0);
+      budget_round(conn->budget_class, 0, 1);
+      if (stats) {
+        struct nic_stats_pod *ps = &stats->pods[conn->logical_id];
+        nic_stats_write_begin(&ps->seq);
+        NIC_STATS_ADD(ps->skipped, 1);
+        nic_stats_write_end(&ps->seq);
       }
-      prev_wr = wr;
+      return 0;
     }
-    
-    /* wait to be signaled before sending read request */
-    pthread_mutex_lock(&lock[i]);
-    while (read_remote[i] == 0) {
-      pthread_cond_wait(&cond_poll_agent[i], &lock[i]);
+    conn->level--;
+  }
+
+  budget_account(conn->budget_class, req_bytes, req_wrs, conn->phase_bytes, conn->phase_wrs);
+  budget_round(conn->budget_class, conn->level < conn->budget_class, 0);
+
+  /* tell the containers of the pod when their first READ landed, once, after the READs */
+  int n = conn->phase_wrs;
+  if (conn->first_read_ns && !conn->first_read_sent) {
+    conn->ack_buf[1] = conn->first_read_ns;
+    for (uint32_t p = 0; p < conn->num_parts; p++)
+      set_control_wr(conn, n++, p, offsetof(struct segment_control, first_read_ns), &conn->ack_buf[1]);
+    conn->first_read_sent = 1;
+  }
+
+  /*
+   * Single-shot rounds of all tiers acknowledge too, else the pod never clears
+   * its bitmap: we do not know yet the generation this round reads, but the
+   * oldest whole copy in the other slots is one we read, see post_body
+   */
+  if (conn->round_phase == ROUND_FULL && conn->round_whole && conn->layout_valid &&
+      (conn->layout.flags & SEGMENT_F_DIRTY)) {
+    uint64_t oldest = round_ring_oldest(conn->ring, conn->landing);
+    if (oldest != UINT64_MAX && oldest > conn->ack_generation)
+      set_ack_wr(conn, n++, oldest);
+  }
+
+  printf("sending %d reads\n", conn->phase_wrs);
+  post_phase(conn, n);
+  conn->round_post_ns = mono_ns();
+  conn->first_cqe_ns = 0;
+  return n;
+}
+
+/**
+ * Whether the dirty chunks bring the slot the round lands in up to date: it
+ * held a whole copy of this layout, not older than the generation we last
+ * acknowledged (the chunks written since are still dirty).
+ */
+static int landing_current(struct connection *conn)
+{
+  const struct round_slot *slot = conn->landing;
+
+  return slot->epoch == conn->ring->epoch && slot->full_generation != 0 &&
+         slot->full_generation >= conn->ack_generation;
+}
+
+/**
+ * Plan the body of a header-first round from the header (and bitmap) in the
+ * slot it lands in: the used bytes, or the dirty chunks, restricted to the
+ * projection of this round's tier. Slots the dirty chunks cannot bring up to
+ * date get the used bytes.
+ */
+static void plan_body(struct connection *conn)
+{
+  int t = conn->level;
+  struct read_plan *base = conn->proj_active[t] ? &conn->scratch : &conn->plan;
+
+  if ((conn->layout.flags & SEGMENT_F_DIRTY) && landing_current(conn))
+    segment_dirty_plan(&conn->layout, conn->rdma_local_region[0], base);
+  else
+    segment_used_plan(&conn->layout, conn->rdma_local_region[0], base);
+
+  if (conn->proj_active[t])
+    read_plan_intersect(base, &conn->proj[t], &conn->plan);
+  if (conn->layout.flags & SEGMENT_F_CRC)
+    segment_crc_plan(&conn->layout, &conn->plan);
+}
+
+/* having read the slots of tier t at generation gen, so did we for lower tiers */
+static void set_last_generation(struct connection *conn, int t, uint64_t gen)
+{
+  for (int k = 0; k <= t; k++)
+    conn->last_generation[k] = gen;
+}
+
+/**
+ * Second phase of a header-first round. Nothing is read if the generation did
+ * not change since we last read the slots of this round's tier, and a full
+ * read is scheduled for next round if the layout changed. Otherwise READ
+ * exactly the used bytes, or the dirty chunks, landing at the same offsets in
+ * the slot of the round. With dirty tracking, in rounds that read all tiers,
+ * we then write back a generation we read so that the pod can clear the chunks
+ * (in lower tier rounds slower slots may still be dirty): the oldest of the
+ * whole copies in the ring, since the dirty chunks must bring any of them up
+ * to date when it is reused. The write is fenced behind the READs.
+ * Returns the number of WRs posted, 0 if there is nothing to read.
+ */
+int post_body(struct connection *conn)
+{
+  struct segment_header *hdr = (struct segment_header *)conn->rdma_local_region[0];
+  int t = conn->level;
+  int n;
+
+  if (hdr->magic != SEGMENT_MAGIC || hdr->layout_hash != conn->layout.hash) {
+    printf("pod-%d segment layout changed\n", conn->logical_id);
+    conn->layout_valid = 0;
+    return 0;
+  }
+
+  if (hdr->generation == conn->last_generation[t]) {
+    cost_model_round(&conn->cost, 0, 0, 0);
+    return 0;
+  }
+
+  plan_body(conn);
+  cost_model_round(&conn->cost, 1, conn->plan.bytes, conn->plan.num_ranges);
+  set_last_generation(conn, t, hdr->generation);
+  conn->round_fresh = 1;
+  conn->round_whole = t == conn->config->num_tiers - 1;
+  conn->round_plan = &conn->plan;
+  if (conn->plan.num_ranges == 0)
+    return 0;
+
+  conn->round_phase = ROUND_BODY;
+  conn->phase_split = round_split(conn->plan.bytes, conn->plan.num_ranges, max_read_wrs());
+  n = 0;
+  for (int j = 0; j < conn->plan.num_ranges; j++) {
+    struct read_range *r = &conn->plan.ranges[j];
+    n = add_read(conn, n, r->off, conn->rdma_local_region[0] + r->off, r->len, conn->rdma_local_mr[0]->lkey, conn->phase_split);
+  }
+  conn->phase_bytes = conn->plan.bytes;
+  conn->phase_wrs = n;
+
+  /* the round was admitted on its header, the body is charged as it comes */
+  budget_charge(conn->plan.bytes, n);
+  budget_account(conn->budget_class, conn->plan.bytes, n, conn->plan.bytes, n);
+
+  if ((conn->layout.flags & SEGMENT_F_DIRTY) && t == conn->config->num_tiers - 1) {
+    uint64_t oldest = round_ring_oldest(conn->ring, conn->landing);
+    set_ack_wr(conn, n++, oldest < hdr->generation ? oldest : hdr->generation);
+  }
+
+  post_phase(conn, n);
+  return n;
+}
+
+/**
+ * Track the heartbeat of each container of the pod, read with the header in
+ * every round. Containers that stop beating, whether hung or dead, are
+ * reported without waiting for the host agent to notice, and the pod is
+ * demoted once none of them beats.
+ */
+static void check_heartbeat(struct connection *conn)
+{
+  uint32_t stall_rounds = conn->config->stall_rounds;
+
+  if (stall_rounds == 0)
+    return;
+
+  for (uint32_t p = 0; p < conn->num_parts; p++) {
+    struct segment_header *hdr = (struct segment_header *)(conn->rdma_local_region[0] + (size_t)p * block_size);
+    uint32_t bit = 1u << p;
+
+    if (hdr->magic != SEGMENT_MAGIC)
+      continue;
+
+    if (hdr->heartbeat != conn->last_heartbeat[p]) {
+      conn->last_heartbeat[p] = hdr->heartbeat;
+      conn->idle_rounds[p] = 0;
+      if (conn->stalled_parts & bit) {
+        conn->stalled_parts &= ~bit;
+        printf("pod-%d/%u (pid %u) heartbeat resumed\n", conn->logical_id, p, hdr->pid);
+      }
+    } else if (++conn->idle_rounds[p] == stall_rounds) {
+      conn->stalled_parts |= bit;
+      printf("pod-%d/%u (pid %u) stalled: no heartbeat for %u rounds\n",
+            conn->logical_id, p, hdr->pid, conn->idle_rounds[p]);
+    }
+  }
+
+  int stalled = conn->stalled_parts == (uint32_t)((1ull << conn->num_parts) - 1);
+  if (stalled && !conn->stalled)
+    printf("pod-%d stalled, reading every %d ticks\n", conn->logical_id, STALL_DEMOTE_ROUNDS);
+  conn->stalled = stalled;
+}
+
+/**
+ * Print the resource usage of container part sampled by the host agent, if
+ * the copy we read is whole: seq even and the same at both ends of the line
+ * (see segment_stats), else the next round reads it again.
+ */
+static void print_stats(struct connection *conn, uint32_t part)
+{
+  const char *base = conn->rdma_local_region[0] + (size_t)part * block_size;
+  struct segment_stats st;
+
+  memcpy(&st, base + SEGMENT_HEADER_SIZE, sizeof(st));
+  if (conn->first_read_ns == 0 || st.valid == 0)
+    return;
+  if ((st.seq & 1) || st.seq_end != st.seq) {
+    printf("  host stats torn, read again next round\n");
+    return;
+  }
+  printf("  cpu %lu us (throttled %lu), memory %lu B, io %lu B, pressure cpu %.2f%% memory %.2f%% io %.2f%%\n",
+        st.cpu_usage_us, st.cpu_throttled_us, st.memory_current, st.io_bytes,
+        st.cpu_pressure / 100.0, st.memory_pressure / 100.0, st.io_pressure / 100.0);
+}
+
+/* publish the round that just ended, with the durations d of its stages, for viewers */
+static void publish_round(struct connection *conn, const uint64_t *d)
+{
+  const struct segment_header *hdr = (const struct segment_header *)conn->rdma_local_region[0];
+  struct nic_stats_pod *ps = &stats->pods[conn->logical_id];
+
+  nic_stats_write_begin(&ps->seq);
+  NIC_STATS_ADD(ps->rounds, 1);
+  NIC_STATS_ADD(ps->bytes, conn->round_bytes);
+  NIC_STATS_ADD(ps->reads, conn->round_wrs);
+  NIC_STATS_SET(ps->pid, hdr->pid);
+  NIC_STATS_SET(ps->num_parts, conn->num_parts);
+  NIC_STATS_SET(ps->generation, hdr->generation);
+  NIC_STATS_SET(ps->read_ns, conn->read_ns);
+  NIC_STATS_SET(ps->read_interval_ns, conn->last_read_ns ? conn->read_ns - conn->last_read_ns : 0);
+  NIC_STATS_SET(ps->level, (uint32_t)conn->level);
+  NIC_STATS_SET(ps->stalled, (uint32_t)conn->stalled);
+  NIC_STATS_SET(ps->cq_hwm, (uint32_t)s_ctx[conn->logical_id]->cq_hwm);
+  NIC_STATS_SET(ps->cq_size, (uint32_t)s_ctx[conn->logical_id]->cq->cqe);
+  for (int st = 0; st < NUM_STAGES; st++)
+    NIC_STATS_SET(ps->stage_ns[st], d[st]);
+  nic_stats_write_end(&ps->seq);
+}
+
+/* durations of the stages of the round that just ended, into the histograms of the pod and the global ones */
+static void record_stages(struct connection *conn, uint64_t decoded_ns, uint64_t exported_ns)
+{
+  uint64_t t[NUM_STAGES + 1] = {
+    conn->round_sched_ns, conn->round_wake_ns, conn->worker_wake_ns, conn->round_post_ns,
+    conn->first_cqe_ns, conn->last_cqe_ns, decoded_ns, exported_ns
+  };
+  struct latency_hist *pod = pod_stages[conn->logical_id];
+  uint64_t d[NUM_STAGES];
+
+  for (int st = 0; st < NUM_STAGES; st++) {
+    d[st] = t[st + 1] > t[st] ? t[st + 1] - t[st] : 0;   // a poller late on its tick may see the next one
+    lat_hist_record(&global_stages[st], d[st]);
+    lat_hist_record(&pod[st], d[st]);
+  }
+  if (stats)
+    publish_round(conn, d);
+}
+
+/* the chunks of the data area the round read whole, batched in conn->crc_bufs; returns how many */
+static int round_chunks(struct connection *conn)
+{
+  const struct segment_layout *l = &conn->layout;
+  const char *data = conn->rdma_local_region[0] + l->data_off;
+  int n = 0;
+
+  for (int k = 0; k < (conn->round_plan ? conn->round_plan->num_ranges : 1); k++) {
+    uint32_t first = 0, num = l->num_chunks;
+
+    if (conn->round_plan)
+      num = segment_covered_chunks(l, conn->round_plan->ranges[k].off, conn->round_plan->ranges[k].len, &first);
+    for (uint32_t c = first; c < first + num && n < (int)l->num_chunks; c++) {
+      conn->crc_bufs[n] = data + (size_t)c * l->chunk_size;
+      conn->crc_chunks[n++] = c;
     }
-    read_remote[i] = 0;
-    uint8_t exit = terminate[i]; 
-    pthread_mutex_unlock(&lock[i]);
+  }
+  return n;
+}
 
-    if (exit) {
-      // if connection was tear down, then when we resume we have to quit
-      return 1;
+/**
+ * Verify the chunks the round read whole against the CRCs read along, in a
+ * batch. A mismatch may be a pod writing the chunk while we read it: the round
+ * is not published nor used as the base of later rounds, and read again at
+ * the next tick. If it fails again at the same generation (the pod did not
+ * publish in between) the chunk is reported corrupted.
+ */
+static void verify_chunks(struct connection *conn)
+{
+  const struct segment_layout *l = &conn->layout;
+  const char *base = conn->rdma_local_region[0];
+  const uint32_t *crc = (const uint32_t *)(base + l->crc_off);
+  uint64_t generation = ((const struct segment_header *)base)->generation;
+  uint64_t start = mono_ns();
+  int n = round_chunks(conn), bad = 0, first_bad = -1;
+
+  /* all the chunks are chunk_size long but maybe the last one of the data area */
+  int full = n > 0 && conn->crc_chunks[n - 1] == l->num_chunks - 1 ? n - 1 : n;
+  crc32c_batch(conn->crc_bufs, l->chunk_size, full, conn->crc_vals);
+  if (full < n)
+    conn->crc_vals[full] = crc32c(conn->crc_bufs[full], segment_chunk_len(l, conn->crc_chunks[full]));
+
+  for (int k = 0; k < n; k++) {
+    if (conn->crc_vals[k] != crc[conn->crc_chunks[k]]) {
+      if (bad++ == 0)
+        first_bad = conn->crc_chunks[k];
     }
-    
-    // send new READ
-    clock_gettime(CLOCK_REALTIME, &(lm->start)); // start clock
-    printf("sending %d reads\n", num_mr);
-    TEST_NZ(ibv_post_send(conn->qp, head_wr, &bad_wr));
-    *num_read_completed = 0;
-    
-  } 
-  return 0;
+  }
+
+  __atomic_add_fetch(&crc_totals.rounds, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&crc_totals.chunks, n, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&crc_totals.ns, mono_ns() - start, __ATOMIC_RELAXED);
+  if (bad == 0) {
+    conn->crc_failed = 0;
+    return;
+  }
+
+  int corrupted = conn->crc_failed && conn->crc_failed_gen == generation;
+  __atomic_add_fetch(corrupted ? &crc_totals.corrupted : &crc_totals.mismatches, 1, __ATOMIC_RELAXED);
+  printf("pod-%d %d of %d chunks fail CRC32C at generation %lu, first chunk %d: %s\n",
+        conn->logical_id, bad, n, generation, first_bad,
+        corrupted ? "corrupted, the pod did not publish since" : "reading again");
+  conn->crc_failed = 1;
+  conn->crc_failed_gen = generation;
+  conn->round_fresh = 0;
+  set_last_generation(conn, conn->config->num_tiers - 1, 0);
+}
+
+/* map the counter slots of the layout just learned, for the consumer thread */
+static void map_counters(struct connection *conn)
+{
+  struct pod_deltas *pd = pod_deltas[conn->logical_id];
+  struct delta_map map;
+
+  delta_map_build(&conn->layout, conn->meta, &map);
+  pthread_mutex_lock(&pd->mutex);
+  pd->map = map;
+  pthread_mutex_unlock(&pd->mutex);
+  if (map.num_counters)
+    printf("pod-%d: %u counters in %d slots\n", conn->logical_id, map.num_counters, map.num_ranges);
+}
+
+/* drop the previous rounds held for the deltas of pod */
+static void release_deltas(struct pod_deltas *pd)
+{
+  for (int t = 0; t < SEGMENT_MAX_TIERS; t++) {
+    if (pd->prev[t])
+      round_slot_release(pd->prev[t]);
+    pd->prev[t] = NULL;
+  }
+}
+
+/* forget the pod of a connection gone, for the next one with its id; its ring is freed, see destroy_connection */
+static void reset_deltas(struct pod_deltas *pd)
+{
+  pthread_mutex_lock(&pd->mutex);
+  memset(&pd->map, 0, sizeof(pd->map));
+  pthread_mutex_unlock(&pd->mutex);
+  memset(&pd->used, 0, sizeof(pd->used));
+  __atomic_store_n(&pd->rounds, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&pd->changes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&pd->resets, 0, __ATOMIC_RELAXED);
+  for (int t = 0; t < SEGMENT_MAX_TIERS; t++)
+    __atomic_store_n(&pd->interval_ns[t], 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Round consumer: deltas of the counters read by the round in slot, against
+ * the previous rounds that read them, then hold the slot for the next rounds
+ * of the tiers it read. A NULL slot closes the ring of the pod.
+ */
+void round_deltas(struct round_ring *ring, struct round_slot *slot, void *arg)
+{
+  struct pod_deltas *pd = pod_deltas[ring->pod];
+  size_t changes = 0, resets = 0;
+
+  if (slot == NULL) {
+    release_deltas(pd);
+    return;
+  }
+
+  if (slot->layout_hash != pd->used.layout_hash) {
+    release_deltas(pd);
+    pthread_mutex_lock(&pd->mutex);
+    if (pd->map.layout_hash == slot->layout_hash)
+      pd->used = pd->map;
+    pthread_mutex_unlock(&pd->mutex);
+    if (pd->used.layout_hash != slot->layout_hash)
+      return;   // the poller learned yet another layout since
+    uint64_t *delta = realloc(pd->delta, (pd->used.num_counters + 1) * sizeof(uint64_t));
+    if (delta)
+      pd->delta = delta;
+    uint64_t *changed = realloc(pd->changed, (pd->used.mask_words + 1) * sizeof(uint64_t));
+    if (changed)
+      pd->changed = changed;
+    uint64_t *reset = realloc(pd->reset, (pd->used.mask_words + 1) * sizeof(uint64_t));
+    if (reset)
+      pd->reset = reset;
+    if (!delta || !changed || !reset) {
+      fprintf(stderr, "pod %d: no memory for the deltas of %u counters\n", ring->pod, pd->used.num_counters);
+      memset(&pd->used, 0, sizeof(pd->used));   // tried again with the next round
+      return;
+    }
+  }
+
+  for (int k = 0; k < pd->used.num_ranges; k++) {
+    const struct delta_range *r = &pd->used.ranges[k];
+    const struct round_slot *prev = pd->prev[r->tier];
+    uint32_t len = r->count * sizeof(uint64_t);
+
+    if (r->tier > slot->tier || prev == NULL)
+      continue;
+    /* a projection may leave counters out, their bytes in the slots are stale */
+    if ((slot->partial && !read_plan_covers(&slot->held, r->off, len)) ||
+        (prev->partial && !read_plan_covers(&prev->held, r->off, len)))
+      continue;
+    changes += delta_counters((const uint64_t *)(prev->base + r->off), (const uint64_t *)(slot->base + r->off),
+                              r->count, pd->delta + r->first, pd->changed + r->mask_off, pd->reset + r->mask_off);
+    /* rates divide by when the two copies were actually read, not by the nominal interval */
+    __atomic_store_n(&pd->interval_ns[r->tier], slot->read_ns - prev->read_ns, __ATOMIC_RELAXED);
+    for (uint32_t w = 0; w < (r->count + 63) / 64; w++)
+      resets += __builtin_popcountll(pd->reset[r->mask_off + w]);
+  }
+
+  for (int t = 0; t <= slot->tier; t++) {
+    round_slot_hold(slot);
+    if (pd->prev[t])
+      round_slot_release(pd->prev[t]);
+    pd->prev[t] = slot;
+  }
+  __atomic_add_fetch(&pd->rounds, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pd->changes, changes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pd->resets, resets, __ATOMIC_RELAXED);
+}
+
+/**
+ * The round landed in its slot: publish it to the consumers if it brought new
+ * data, and keep it as the latest copy of the pod in place of the previous
+ * one, else give the slot back. Between rounds rdma_local_region[0] points to
+ * the latest copy.
+ */
+void finish_landing(struct connection *conn)
+{
+  struct round_slot *slot = conn->landing;
+  const struct segment_header *hdr = (const struct segment_header *)slot->base;
+
+  conn->landing = NULL;
+  if (conn->round_fresh) {
+    slot->round = slot->last_use;
+    slot->generation = hdr->generation;
+    slot->read_ns = conn->read_ns;
+    slot->tier = conn->round_whole || conn->level == conn->config->num_tiers - 1 ? SEGMENT_MAX_TIERS - 1 : conn->level;
+    slot->layout_hash = conn->layout_valid ? conn->layout.hash : 0;
+    /* the projection of the tier bounds what the slot holds, whichever plan the round read
+       (a dirty one leaves the chunks that did not change as they were) */
+    slot->partial = conn->layout_valid && conn->proj_active[conn->level];
+    if (slot->partial)
+      slot->held = conn->proj[conn->level];
+    if (conn->round_whole) {
+      slot->full_generation = hdr->generation;
+      slot->epoch = conn->ring->epoch;
+    }
+    round_ring_publish(slot);
+    if (conn->latest)
+      round_slot_release(conn->latest);
+    conn->latest = slot;
+  } else {
+    round_slot_release(slot);
+  }
+  if (conn->latest)
+    conn->rdma_local_region[0] = conn->latest->base;
+}
+
+/**
+ * All WRs of the round completed. After a single-shot read, check the layout
+ * did not change (header-first rounds do in post_body), learn it from a whole
+ * read if we do not know it yet and tell the cost model what a header-first
+ * round would have read. Then record latency of this connection and, if last,
+ * of the whole round, and hand the round to the consumers.
+ */
+void end_round(struct connection *conn, int i, struct latency_meter *lm)
+{
+  if (conn->round_phase == ROUND_FULL) {
+    struct segment_header *hdr = (struct segment_header *)conn->rdma_local_region[0];
+
+    if (conn->layout_valid && (hdr->magic != SEGMENT_MAGIC || hdr->layout_hash != conn->layout.hash)) {
+      printf("pod-%d segment layout changed\n", conn->logical_id);
+      conn->layout_valid = 0;
+    }
+
+    /* a projected round read the header but not the directory */
+    if (!conn->layout_valid && conn->round_plan == NULL &&
+        segment_read_layout(conn->rdma_local_region[0], &conn->layout) == 0 &&
+        conn->layout.size == (uint32_t)block_size) {
+      if (conn->first_read_ns == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        conn->first_read_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+      }
+      /* the segments of a multi-container pod are always read in full */
+      if (conn->num_parts == 1) {
+        conn->layout_valid = 1;
+        conn->meta = realloc(conn->meta, conn->layout.data_off);
+        memcpy(conn->meta, conn->rdma_local_region[0], conn->layout.data_off);
+        map_counters(conn);
+        conn->crc_bufs = realloc(conn->crc_bufs, (conn->layout.num_chunks + 1) * sizeof(void *));
+        conn->crc_chunks = realloc(conn->crc_chunks, (conn->layout.num_chunks + 1) * sizeof(uint32_t));
+        conn->crc_vals = realloc(conn->crc_vals, (conn->layout.num_chunks + 1) * sizeof(uint32_t));
+        set_last_generation(conn, conn->config->num_tiers - 1, hdr->generation - 1);
+        cost_model_init(&conn->cost);
+        printf("pod-%d segment layout: data at %u, %u chunks of %u bytes%s\n",
+              i, conn->layout.data_off, conn->layout.num_chunks, conn->layout.chunk_size,
+              (conn->layout.flags & SEGMENT_F_CRC) ? " with CRC32C" : "");
+        update_projection(conn);
+      }
+    }
+
+    conn->round_fresh = 1;
+    if (conn->layout_valid) {
+      int changed = hdr->generation != conn->last_generation[conn->level];
+      plan_body(conn);
+      cost_model_round(&conn->cost, changed, conn->plan.bytes, conn->plan.num_ranges);
+      set_last_generation(conn, conn->level, hdr->generation);
+    }
+  }
+  if (conn->round_fresh && conn->layout_valid && (conn->layout.flags & SEGMENT_F_CRC))
+    verify_chunks(conn);
+  conn->round_phase = ROUND_IDLE;
+  check_heartbeat(conn);
+  uint64_t decoded_ns = mono_ns();
+  finish_landing(conn);
+  /* lateness and read times go to the histograms and the stats page, not to stdout */
+  record_stages(conn, decoded_ns, mono_ns());
+  conn->last_read_ns = conn->read_ns;
+
+  double t_ns = record_time_elapsed(lm);
+  printf("READ remote buffer pod-%d: %s, latency: %f [ns]\n", 
+        i, get_peer_message_region(conn, 0), t_ns);
+  print_stats(conn, 0);
+  for (uint32_t p = 1; p < conn->num_parts; p++) {
+    printf("  container %u: %s\n", p, get_peer_message_region(conn, p));
+    print_stats(conn, p);
+  }
+
+  /* following timer computes latency when all connections have finished */
+  pthread_mutex_lock(&lock_global_lm);
+  global_lm.num_finished++;
+  if (global_lm.num_finished == num_active_connections) {
+    double t_ns = record_time_elapsed(&global_lm);
+    printf("global latency: %f [ns]\n", t_ns);
+  }
+  pthread_mutex_unlock(&lock_global_lm);
 }
 
 double record_time_elapsed(struct latency_meter *lm)
@@ -465,6 +2149,18 @@ double record_time_elapsed(struct latency_meter *lm)
 }
 
 
+/* allocate the round slots of conn, of size bytes each, and register them as a single MR */
+static void register_ring(struct connection *conn, struct ibv_pd *pd, size_t size)
+{
+  TEST_NZ(round_ring_init(conn->ring, conn->logical_id, ring_slots, size));
+  TEST_Z(conn->rdma_local_mr[0] = ibv_reg_mr(
+    pd,
+    conn->ring->mem,
+    (size_t)conn->ring->num_slots * conn->ring->slot_size,
+    IBV_ACCESS_LOCAL_WRITE));
+  conn->rdma_local_region[0] = conn->ring->slots[0].base;
+}
+
 void register_memory(struct connection *conn)
 {
   /* NIC side only allocates buffers for send/recv operations and rdma_local_mr
@@ -476,26 +2172,41 @@ void register_memory(struct connection *conn)
   
   conn->rdma_local_region = malloc(num_mr * sizeof(char*));
   conn->rdma_local_mr = malloc(num_mr * sizeof(struct ibv_mr*));
+
+  /* WRs of a round, reused */
+  int max_wrs = max_round_wrs();
+  conn->wrs = malloc(max_wrs * sizeof(struct ibv_send_wr));
+  conn->sges = malloc(max_wrs * sizeof(struct ibv_sge));
+  conn->ack_buf = calloc(2, sizeof(uint64_t));   // generation ack, first-read timestamp
   
   TEST_Z(conn->send_mr = ibv_reg_mr(
-    s_ctx[num_connections]->pd, 
+    s_ctx[conn->logical_id]->pd, 
     conn->send_msg, 
     sizeof(struct message), 
     0));
 
   TEST_Z(conn->recv_mr = ibv_reg_mr(
-    s_ctx[num_connections]->pd, 
+    s_ctx[conn->logical_id]->pd, 
     conn->recv_msg, 
     sizeof(struct message), 
     IBV_ACCESS_LOCAL_WRITE));
 
-  for (int i = 0; i < num_mr; i++) {
+  TEST_Z(conn->ack_mr = ibv_reg_mr(
+    s_ctx[conn->logical_id]->pd, 
+    conn->ack_buf, 
+    2 * sizeof(uint64_t), 
+    0));
+
+  /* rounds land in the ring, the other blocks only serve single-shot reads */
+  conn->ring = malloc(sizeof(struct round_ring));
+  register_ring(conn, s_ctx[conn->logical_id]->pd, block_size);
+
+  for (int i = 1; i < num_mr; i++) {
     
     conn->rdma_local_region[i] = malloc(block_size);
-    conn->rdma_local_mr[i] = malloc(sizeof(struct ibv_mr));
 
     TEST_Z(conn->rdma_local_mr[i] = ibv_reg_mr(
-      s_ctx[num_connections]->pd, 
+      s_ctx[conn->logical_id]->pd, 
       conn->rdma_local_region[i], 
       block_size,
       IBV_ACCESS_LOCAL_WRITE));
@@ -504,31 +2215,87 @@ void register_memory(struct connection *conn)
 }
 
 
+/**
+ * The pod registered its sidecars along with it: the local copies must hold
+ * the segments of all its containers. Called before the first round.
+ */
+void resize_local_regions(struct connection *conn)
+{
+  size_t size = (size_t)block_size * conn->num_parts;
+
+  printf(", %u containers", conn->num_parts);
+  ibv_dereg_mr(conn->rdma_local_mr[0]);
+  round_ring_free(conn->ring);
+  register_ring(conn, s_ctx[conn->logical_id]->pd, size);
+
+  for (int i = 1; i < num_mr; i++) {
+    ibv_dereg_mr(conn->rdma_local_mr[i]);
+    free(conn->rdma_local_region[i]);
+
+    conn->rdma_local_region[i] = malloc(size);
+
+    TEST_Z(conn->rdma_local_mr[i] = ibv_reg_mr(
+      s_ctx[conn->logical_id]->pd, 
+      conn->rdma_local_region[i], 
+      size,
+      IBV_ACCESS_LOCAL_WRITE));
+  }
+}
+
+
 void destroy_connection(void *context)
 {
   struct connection *conn = (struct connection *)context;
 
-  /* terminate CQ polling thread, which could be waiting for signal */
+  /* terminate CQ polling thread: waiting for a tick it sees terminate, with a
+     round in flight the completions flushed from the QP end it */
   int i = conn->logical_id;
   pthread_mutex_lock(&lock[i]);
   terminate[i] = 1;
+  read_remote[i] = 1;
+  pthread_cond_signal(&cond_poll_agent[i]);
   pthread_mutex_unlock(&lock[i]);
+  flush_qp(conn);
+  pthread_join(s_ctx[i]->cq_poller_thread, NULL);
+  if (stats) {
+    NIC_STATS_SET(stats->pods[i].state, NIC_POD_CLOSED);
+    __atomic_sub_fetch(&stats->connections, 1, __ATOMIC_RELAXED);
+  }
 
   rdma_destroy_qp(conn->id);
 
   ibv_dereg_mr(conn->send_mr);
   ibv_dereg_mr(conn->recv_mr);
+  ibv_dereg_mr(conn->ack_mr);
   
-  for (int i=0; i<num_mr; i++) {
-    ibv_dereg_mr(conn->rdma_local_mr[i]);
-    free(conn->rdma_local_region[i]);
+  /* the consumers may still use the slots of the last rounds */
+  if (conn->landing)
+    round_slot_release(conn->landing);
+  if (conn->latest)
+    round_slot_release(conn->latest);
+  ibv_dereg_mr(conn->rdma_local_mr[0]);
+  round_ring_close(conn->ring);
+  round_ring_free(conn->ring);
+  free(conn->ring);
+  free(conn->meta);
+  free(conn->crc_bufs);
+  free(conn->crc_chunks);
+  free(conn->crc_vals);
+
+  for (int j=1; j<num_mr; j++) {
+    ibv_dereg_mr(conn->rdma_local_mr[j]);
+    free(conn->rdma_local_region[j]);
   }
   
   free(conn->send_msg);
   free(conn->recv_msg);
   free(conn->rdma_local_region);
   free(conn->rdma_local_mr);
+  free(conn->wrs);
+  free(conn->sges);
+  free(conn->ack_buf);
   
+  destroy_context(i);
   rdma_destroy_id(conn->id);
 
   free(conn);
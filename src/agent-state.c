@@ -0,0 +1,167 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "agent-state.h"
+
+static struct agent_state *state = NULL;   // NULL if the agent runs without state file
+
+/**
+ * Map the state file at path, creating it if needed. The pods of a previous
+ * run with the same block size are copied to old (AGENT_STATE_MAX_PODS
+ * entries), then the table is emptied: the caller serves them again, in new
+ * slots. Returns the number of pods in old, -1 if the file cannot be used.
+ */
+int agent_state_open(const char *path, uint32_t block_size, struct agent_state_entry *old)
+{
+  struct stat st;
+  int n = 0;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror("Error opening agent state file");
+    return -1;
+  }
+  if (st.st_size != sizeof(struct agent_state) &&
+      (ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(struct agent_state)) == -1)) {
+    perror("Error sizing agent state file");
+    close(fd);
+    return -1;
+  }
+
+  state = mmap(NULL, sizeof(struct agent_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (state == MAP_FAILED) {
+    perror("Error mapping agent state file");
+    state = NULL;
+    return -1;
+  }
+
+  if (state->magic == AGENT_STATE_MAGIC && state->version == AGENT_STATE_VERSION &&
+      state->max_pods == AGENT_STATE_MAX_PODS) {
+    if (state->block_size == block_size) {
+      for (int i = 0; i < AGENT_STATE_MAX_PODS; i++) {
+        if (state->pods[i].pid != 0)
+          old[n++] = state->pods[i];
+      }
+    } else {
+      fprintf(stderr, "Block size changed from %u, not restoring pods from %s\n", state->block_size, path);
+    }
+  }
+
+  memset(state, 0, sizeof(struct agent_state));
+  state->version = AGENT_STATE_VERSION;
+  state->block_size = block_size;
+  state->max_pods = AGENT_STATE_MAX_PODS;
+  __atomic_store_n(&state->magic, AGENT_STATE_MAGIC, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* record the pod served in slot, its containers pids, with the name of its segments */
+void agent_state_set(int slot, const uint32_t *pids, uint32_t num_parts, const char *name, int memfd)
+{
+  if (state == NULL || slot >= AGENT_STATE_MAX_PODS || num_parts > SEGMENT_MAX_PARTS)
+    return;
+
+  struct agent_state_entry *e = &state->pods[slot];
+  e->num_parts = num_parts;
+  memcpy(e->pids, pids, num_parts * sizeof(uint32_t));
+  e->generation = 0;
+  e->memfd = (uint8_t)memfd;
+  strncpy(e->name, name, AGENT_STATE_NAME_LEN - 1);
+  e->name[AGENT_STATE_NAME_LEN - 1] = '\0';
+  __atomic_store_n(&e->pid, pids[0], __ATOMIC_RELEASE);
+}
+
+void agent_state_checkpoint(int slot, uint64_t generation)
+{
+  if (state != NULL && slot < AGENT_STATE_MAX_PODS)
+    state->pods[slot].generation = generation;
+}
+
+void agent_state_clear(int slot)
+{
+  if (state != NULL && slot < AGENT_STATE_MAX_PODS)
+    __atomic_store_n(&state->pods[slot].pid, 0, __ATOMIC_RELEASE);
+}
+
+/* open the memfd or shm object linked as link by process pid, through one of its fds */
+static int reopen_fd(uint32_t pid, const char *link)
+{
+  char path[64], target[AGENT_STATE_NAME_LEN + 32];
+  struct dirent *d;
+  int fd = -1;
+
+  snprintf(path, sizeof(path), "/proc/%u/fd", pid);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+
+  while (fd == -1 && (d = readdir(dir)) != NULL) {
+    char fd_path[sizeof(path) + sizeof(d->d_name)];
+    ssize_t len;
+
+    snprintf(fd_path, sizeof(fd_path), "/proc/%u/fd/%s", pid, d->d_name);
+    len = readlink(fd_path, target, sizeof(target) - 1);
+    if (len <= 0)
+      continue;
+    target[len] = '\0';
+    if (strncmp(target, link, strlen(link)) == 0)
+      fd = open(fd_path, O_RDWR | O_CLOEXEC);
+  }
+  closedir(dir);
+  return fd;
+}
+
+/* open the memfd or shm object linked as link mapped by process pid, through its map_files (needs CAP_SYS_ADMIN) */
+static int reopen_mapping(uint32_t pid, const char *link)
+{
+  char path[64], line[512];
+  int fd = -1;
+
+  snprintf(path, sizeof(path), "/proc/%u/maps", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+
+  while (fd == -1 && fgets(line, sizeof(line), f)) {
+    char *file = strchr(line, '/');
+    char range[64], map_file[128];
+
+    if (file == NULL || strncmp(file, link, strlen(link)) != 0 || sscanf(line, "%63s", range) != 1)
+      continue;
+    snprintf(map_file, sizeof(map_file), "/proc/%u/map_files/%s", pid, range);
+    fd = open(map_file, O_RDWR | O_CLOEXEC);
+  }
+  fclose(f);
+  return fd;
+}
+
+/**
+ * Open the segments of a pod of a previous run again. A POSIX shm object is
+ * unlinked once the pod opened it and a memfd has no name to open, both only
+ * live as long as the pod has them open or mapped, we find them in the /proc
+ * entries of the pod.
+ * Returns the fd, -1 if the segments are gone.
+ */
+int agent_state_reopen(const struct agent_state_entry *e)
+{
+  char link[AGENT_STATE_NAME_LEN + 16];
+  int fd;
+
+  if (!e->memfd) {
+    if ((fd = shm_open(e->name, O_RDWR, 0666)) != -1)
+      return fd;   // the pod never acknowledged it
+    snprintf(link, sizeof(link), "/dev/shm/%s ", e->name);
+  } else {
+    snprintf(link, sizeof(link), "/memfd:%s ", e->name);
+  }
+  fd = reopen_fd(e->pid, link);
+  if (fd == -1)
+    fd = reopen_mapping(e->pid, link);
+  return fd;
+}
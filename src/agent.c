@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -15,93 +16,406 @@
 #include <sys/shm.h>
 #include <sys/mman.h>
 #include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "rdma-common.h"
 #include "rdma-agent.h"
+#include "shard-ring.h"
+#include "rdma-ports.h"
+#include "registration.h"
+#include "cgroup-stats.h"
+#include "agent-state.h"
+#include "control.h"
+#include "segment-pool.h"
+#include "numa-place.h"
 
 #define Q_NAME    "shm"
 #define MAX_SIZE  1024
 #define MAX_LEN   256
 #define M_EXIT    "done"
+#define SHARD_MAP ".shard-map"
 
 static char peer_ip[MAX_LEN];
 static char peer_port[MAX_LEN];
 
+/**
+ * Layout of the segments of new pods. The control socket changes the settings
+ * together, checked against each other, so registrations take a copy of all of
+ * them at once under settings_mutex.
+ */
+struct segment_settings {
+    uint32_t chunk_size;   // dirty tracking granularity, 0 to disable
+    uint16_t max_slots;    // metric slots in the segment directory
+    int chunk_crc;         // pods keep the CRC32C of their chunks
+};
+static struct segment_settings settings = { SEGMENT_DEFAULT_CHUNK, SEGMENT_DEFAULT_SLOTS, 0 };
+static pthread_mutex_t settings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* features of the segments of new pods */
+static uint16_t segment_flags(uint32_t chunk, int crc)
+{
+    return (chunk ? SEGMENT_F_DIRTY : 0) | (crc ? SEGMENT_F_CRC : 0);
+}
+
+/* agent-nic instances pods are sharded on, reloaded on SIGHUP */
+static char *shards_file = NULL;
+static volatile sig_atomic_t reload_shards = 0;
+static struct shard_ring ring, next_ring;   // ring under cp_mutex
+
+static char *unix_path = REGISTRATION_SOCKET;   // registration with memfd passing
+
+static struct rdma_event_channel *cm_channel;   // of all RDMA sessions, see cm_event_loop
+
+static uint32_t cgroup_ms = CGROUP_STATS_DEFAULT_MS;   // resource usage sampling interval, 0 to disable
+static char *state_path = AGENT_STATE_FILE;           // pod table surviving restarts, empty to disable
+static char *control_path = "/tmp/microview-agent.ctl";   // runtime settings, see control_command
+static int pool_capacity = SEGMENT_POOL_DEFAULT;          // regions of pods gone kept for new ones
+static int numa_policy = NUMA_POLICY_NIC;                 // NUMA node of the segments of new pods
+
 extern int block_size;
 extern int num_mr;
 
 void * poll_pids(void* args);
 void  INThandler(int sig);
+void  HUPhandler(int sig);
 
 /* used by host agent */
 pthread_mutex_t cp_mutex;
 struct control_plane {
     int pod_pids[RDMA_MAX_CONNECTIONS];
     struct rdma_cm_id* conn[RDMA_MAX_CONNECTIONS];
-    int num_pods;
+    struct shard_instance shard[RDMA_MAX_CONNECTIONS];  // agent-nic instance reading the pod
+    int moving[RDMA_MAX_CONNECTIONS];                   // disconnected to move to another instance or port
+    int port[RDMA_MAX_CONNECTIONS];                     // local RNIC port, -1 if routed by rdma_cm
+    int failures[RDMA_MAX_CONNECTIONS];                 // sessions failed in a row, retried by poll_pids
+    int established[RDMA_MAX_CONNECTIONS];              // conn past the handshake, it can be disconnected
+    struct pod_region region[RDMA_MAX_CONNECTIONS];     // segments of the containers of the pod
+    int num_pods;                                       // slots ever used, free ones are reused, see alloc_slot
 };
 struct control_plane cp;
 
 
 /**
- * Kick-off RDMA session with a new pod.
+ * Write which agent-nic instance reads each active pod to SHARD_MAP, one
+ * "<pid> <address> <port>" per line, so that the metrics exported by the
+ * instances can be merged into a single view. Call with cp_mutex held.
+ */
+static void write_shard_map(void)
+{
+    FILE *fp = fopen(SHARD_MAP ".tmp", "w");
+    if (fp == NULL) {
+        perror("Error writing shard map");
+        return;
+    }
+    for (int i = 0; i < cp.num_pods; i++) {
+        if (cp.pod_pids[i] != -1 && !cp.moving[i])
+            fprintf(fp, "%d %s %s\n", cp.pod_pids[i], cp.shard[i].addr, cp.shard[i].port);
+    }
+    fclose(fp);
+    rename(SHARD_MAP ".tmp", SHARD_MAP);
+}
+
+/**
+ * Slot for a new pod: one whose pod is gone, with its session closed and its
+ * region released, else a new one. Returns -1 if all RDMA_MAX_CONNECTIONS
+ * are taken. Call with cp_mutex held.
+ */
+static int alloc_slot(void)
+{
+    for (int i = 0; i < cp.num_pods; i++) {
+        if (cp.pod_pids[i] == -1 && cp.conn[i] == NULL && cp.region[i].base == NULL)
+            return i;
+    }
+    if (cp.num_pods == RDMA_MAX_CONNECTIONS)
+        return -1;
+    return cp.num_pods++;
+}
+
+/* close the connection of the pod in slot i, cm_event_loop reopens it. Call with cp_mutex held */
+static void move_pod(int i)
+{
+    cp.moving[i] = 1;
+    rdma_disconnect(cp.conn[i]);
+}
+
+/**
+ * True if the cgroups of all the containers of the pod in region are empty:
+ * no process left that could have inherited the memfd and write the
+ * segments. Pids are not checked, they may already belong to someone else.
+ * If we cannot tell for any of them, the region is not orphaned.
+ */
+static int region_orphaned(const struct pod_region *region)
+{
+    for (uint32_t p = 0; p < region->num_parts; p++) {
+        if (region->events[p] == -1 || cgroup_populated(region->events[p]) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* open the cgroup.events of each container of the pod in region, if its memfd may be recycled */
+static void watch_region(struct pod_region *region)
+{
+    for (uint32_t p = 0; p < SEGMENT_MAX_PARTS; p++)
+        region->events[p] = -1;
+    if (!region->memfd || region->fd == -1)
+        return;
+    for (uint32_t p = 0; p < region->num_parts; p++)
+        region->events[p] = cgroup_events_open(region->pids[p]);
+}
+
+/**
+ * The pod of region is gone and its RDMA session closed: recycle the region
+ * for a new pod once nothing in the cgroups of its containers is left (see
+ * region_orphaned), otherwise unmap it, deregister its memory and close the
+ * memfd for good, whoever still holds it.
+ */
+static void release_region(struct pod_region *region)
+{
+    if (region->base == NULL)
+        return;
+
+    int orphaned = region_orphaned(region);
+    for (uint32_t p = 0; p < region->num_parts; p++) {
+        if (region->events[p] != -1)
+            close(region->events[p]);
+        region->events[p] = -1;
+    }
+    if (!orphaned || segment_pool_put(region) == -1) {
+        if (region->mr)
+            ibv_dereg_mr(region->mr);
+        munmap(region->base, region->size);
+        if (region->fd != -1)
+            close(region->fd);
+    }
+    region->base = NULL;
+    region->mr = NULL;
+    region->fd = -1;
+}
+
+/**
+ * The RDMA session of the pod in slot i failed before it was established and
+ * its id is gone (see on_event), or it could not be started: poll_pids tries
+ * again, unless the pod is gone meanwhile. Call with cp_mutex held.
+ */
+static void session_failed(int slot)
+{
+    rdma_ports_release(cp.port[slot]);
+    cp.conn[slot] = NULL;
+    cp.port[slot] = -1;
+    cp.established[slot] = 0;
+    if (cp.pod_pids[slot] == -1) {
+        release_region(&cp.region[slot]);
+        return;
+    }
+    cp.failures[slot]++;
+    printf("RDMA session of pid %d failed (%d in a row), retrying\n", cp.pod_pids[slot], cp.failures[slot]);
+}
+
+/**
+ * Start an RDMA session with the pod in slot i, towards the agent-nic instance
+ * owning it on the ring, through the least loaded local RNIC port. Only
+ * address resolution is started here, cm_event_loop carries on the
+ * handshake, so the caller never waits for it.
  * 
- * Note that a pointer to the allocated shared memory is passed as context to the connection.
+ * Note that a pointer to the shared memory is passed as context to the connection.
  * When the RDMA library will call the on_route_resolved function, the connection will be built
  * and the shared memory pointer will be used to register the memory region.
  * 
  * See on_route_resolved and on_connection functions in rdma-agent.c
  */
-int start_rdma_session(int shm_fd, int podID) {
+static void connect_pod(int slot, int podID) {
     struct addrinfo *addr;
-    struct rdma_cm_event *event = NULL;
     struct rdma_cm_id *conn= NULL;
-    struct rdma_event_channel *ec = NULL;
+    struct shard_instance shard;
 
     //set_mode(M_READ);
     //set_role(R_CLIENT);
 
-    /* memory map the shared memory object, and pass it as context to the connection */
-    void *shm_ptr = mmap(0, block_size, PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    
-    TEST_NZ(getaddrinfo(peer_ip, peer_port, NULL, &addr));
+    pthread_mutex_lock(&cp_mutex);
+    int gone = cp.pod_pids[slot] != podID;
+    struct pod_region *region = &cp.region[slot];
+    shard = *shard_ring_lookup(&ring, podID);
+    pthread_mutex_unlock(&cp_mutex);
+    if (gone)
+        return;   // gone meanwhile, its region released and maybe its slot reused
+    printf("pid %d read by agent-nic %s:%s\n", podID, shard.addr, shard.port);
 
-    TEST_Z(ec = rdma_create_event_channel());
-    TEST_NZ(rdma_create_id(ec, &conn, shm_ptr, RDMA_PS_TCP));   // we pass here the pointer to shared memory
-    TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+    if (getaddrinfo(shard.addr, shard.port, NULL, &addr)) {
+        fprintf(stderr, "Cannot resolve agent-nic %s:%s\n", shard.addr, shard.port);
+        pthread_mutex_lock(&cp_mutex);
+        session_failed(slot);
+        pthread_mutex_unlock(&cp_mutex);
+        return;
+    }
+    int port = rdma_ports_pick(addr->ai_family, region->node);
+    printf("pid %d connects through port %s\n", podID, rdma_port_name(port));
+    if (region->node != -1 && rdma_port_node(port) != region->node)
+        printf("pid %d read across NUMA nodes, segments on node %d\n", podID, region->node);
 
+    /* attach connection to the pod in control plane (watcher thread will track running pods) */
+    pthread_mutex_lock(&cp_mutex);
+    cp.shard[slot] = shard;
+    cp.port[slot] = port;
+    cp.moving[slot] = 0;
+    cp.established[slot] = 0;
+    if (rdma_create_id(cm_channel, &conn, region, RDMA_PS_TCP)) {   // we pass here the pointer to shared memory
+        perror("rdma_create_id");
+        session_failed(slot);
+        pthread_mutex_unlock(&cp_mutex);
+        freeaddrinfo(addr);
+        return;
+    }
+    cp.conn[slot] = conn;
+    write_shard_map();
+
+    /* under the mutex, so that no event of the session is handled before */
+    if (rdma_resolve_addr(conn, rdma_port_addr(port, addr->ai_family), addr->ai_addr, TIMEOUT_IN_MS)) {
+        perror("rdma_resolve_addr");
+        rdma_destroy_id(conn);
+        session_failed(slot);
+    }
+    pthread_mutex_unlock(&cp_mutex);
     freeaddrinfo(addr);
+}
 
-    /* register new pod in control plane (watcher thread will track running pods) */
+/**
+ * The RDMA connection of the pod in slot i was closed: reconnect it if it was
+ * moved to another agent-nic instance or port (see rebalance and failover),
+ * otherwise the pod is gone.
+ */
+static void on_pod_disconnected(int slot)
+{
     pthread_mutex_lock(&cp_mutex);
-    cp.pod_pids[cp.num_pods] = podID;
-    cp.conn[cp.num_pods] = conn;
-    cp.num_pods++;
+    int podID = cp.pod_pids[slot];
+    int moved = cp.moving[slot] && podID != -1;
+    rdma_ports_release(cp.port[slot]);
+    cp.conn[slot] = NULL;
+    cp.port[slot] = -1;
+    cp.established[slot] = 0;
+    if (podID == -1)
+        release_region(&cp.region[slot]);   // the session was the last user of its MR
     pthread_mutex_unlock(&cp_mutex);
 
-    while (rdma_get_cm_event(ec, &event) == 0)
+    if (moved) {
+        printf("Moving pid %d to another agent-nic instance or port\n", podID);
+        connect_pod(slot, podID);
+    } else {
+        printf("RDMA connection of slot %d terminated\n", slot);
+    }
+}
+
+/**
+ * Single event loop for the rdma_cm events of the sessions with all pods. A
+ * session that fails only affects its pod, see session_failed. Events are
+ * handled under cp_mutex: poll_pids tears down the sessions of pods gone
+ * before they were established, the events left of those are dropped.
+ */
+void * cm_event_loop(void *arg) {
+    struct rdma_cm_event *event = NULL;
+
+    while (rdma_get_cm_event(cm_channel, &event) == 0)
     {
         struct rdma_cm_event event_copy;
+        int slot = -1;
 
         memcpy(&event_copy, event, sizeof(*event));
         rdma_ack_cm_event(event);
 
-        if (on_event(&event_copy)) 
-        {
-            break;
+        pthread_mutex_lock(&cp_mutex);
+        for (int i = 0; i < cp.num_pods && slot == -1; i++) {
+            if (cp.conn[i] == event_copy.id)
+                slot = i;
+        }
+        if (slot == -1) {
+            pthread_mutex_unlock(&cp_mutex);
+            continue;   // aborted by poll_pids, the id is gone
+        }
+        if (event_copy.event == RDMA_CM_EVENT_ESTABLISHED) {
+            cp.failures[slot] = 0;
+            cp.established[slot] = 1;
+        }
+
+        /* on disconnection or failure the connection is destroyed */
+        int r = on_event(&event_copy);
+        pthread_mutex_unlock(&cp_mutex);
+
+        if (r == -1) {
+            pthread_mutex_lock(&cp_mutex);
+            session_failed(slot);
+            pthread_mutex_unlock(&cp_mutex);
+        } else if (event_copy.event == RDMA_CM_EVENT_DISCONNECTED) {
+            on_pod_disconnected(slot);
         }
     }
 
-    rdma_destroy_event_channel(ec);
+    return NULL;
+}
 
-    return 0;
+/**
+ * Reload the agent-nic instances and move the pods whose owner changed:
+ * their connection is closed and cm_event_loop reconnects them to the new
+ * owner. Consistent hashing keeps the others where they are.
+ */
+static void rebalance(void)
+{
+    int moved = 0;
+
+    if (shard_ring_load(&next_ring, shards_file)) {
+        fprintf(stderr, "Keeping current agent-nic instances\n");
+        return;
+    }
+
+    pthread_mutex_lock(&cp_mutex);
+    memcpy(&ring, &next_ring, sizeof(ring));
+    for (int i = 0; i < cp.num_pods; i++) {
+        if (cp.pod_pids[i] == -1 || !cp.established[i] || cp.moving[i])
+            continue;   // sessions in the handshake keep their owner until the next rebalance
+        if (!shard_instance_equal(shard_ring_lookup(&ring, cp.pod_pids[i]), &cp.shard[i])) {
+            move_pod(i);
+            moved++;
+        }
+    }
+    write_shard_map();
+    pthread_mutex_unlock(&cp_mutex);
+
+    printf("Rebalanced on %d agent-nic instances, %d pods moved\n", ring.num_instances, moved);
+}
+
+/* move the pods connected through RNIC ports that went down to the other ports */
+static void failover(void)
+{
+    int down[RDMA_MAX_PORTS];
+
+    if (rdma_ports_refresh(down) == 0)
+        return;
+
+    pthread_mutex_lock(&cp_mutex);
+    for (int i = 0; i < cp.num_pods; i++) {
+        if (cp.pod_pids[i] != -1 && cp.established[i] && !cp.moving[i] &&
+            cp.port[i] >= 0 && down[cp.port[i]]) {
+            printf("Port %s down, moving pid %d\n", rdma_port_name(cp.port[i]), cp.pod_pids[i]);
+            move_pod(i);
+        }
+    }
+    pthread_mutex_unlock(&cp_mutex);
 }
 
 // function to handle termination of RDMA connections for dead pods
 void * poll_pids(void* args) {
+    int retry[RDMA_MAX_CONNECTIONS], retry_pid[RDMA_MAX_CONNECTIONS];
+
     while (1) {
+        int num_retries = 0;
         
         sleep(2);   // every two seconds check which pods died
+
+        if (reload_shards) {
+            reload_shards = 0;
+            rebalance();
+        }
+        failover();
         
         pthread_mutex_lock(&cp_mutex);
         for (int i=0; i < cp.num_pods; i++)
@@ -112,21 +426,201 @@ void * poll_pids(void* args) {
                     
                     printf("Pod %d is not active anymore, closing RDMA connection %d\n", cp.pod_pids[i], i);
                     
-                    rdma_disconnect(cp.conn[i]);
+                    if (cp.conn[i] != NULL && cp.established[i]) {
+                        rdma_disconnect(cp.conn[i]);   // the region goes once disconnected
+                    } else if (cp.conn[i] != NULL) {
+                        /* still in the handshake, nothing to disconnect: no event would release the region */
+                        abort_session(cp.conn[i]);
+                        rdma_ports_release(cp.port[i]);
+                        cp.conn[i] = NULL;
+                        cp.port[i] = -1;
+                    }
+                    for (uint32_t p = 0; p < cp.region[i].num_parts; p++)
+                        cgroup_stats_detach(segment_get_stats((char *)cp.region[i].base + (size_t)p * block_size));
                     
                     cp.pod_pids[i] = -1;
+                    agent_state_clear(i);
+                    write_shard_map();
+                    if (cp.conn[i] == NULL)
+                        release_region(&cp.region[i]);   // else once disconnected, see on_pod_disconnected
+                } else {
+                    agent_state_checkpoint(i, ((struct segment_header *)cp.region[i].base)->generation);
+                    if (cp.conn[i] == NULL && cp.failures[i]) {
+                        retry[num_retries] = i;
+                        retry_pid[num_retries++] = cp.pod_pids[i];
+                    }
                 }
             } 
         }
         pthread_mutex_unlock(&cp_mutex);
+
+        /* sessions that failed, at most once per period */
+        for (int k = 0; k < num_retries; k++)
+            connect_pod(retry[k], retry_pid[k]);
+    }
+}
+
+/**
+ * Sample the cgroups of all the pods every cgroup_ms, at absolute deadlines.
+ * While sampling is disabled we check again every second, it may be turned
+ * on from the control socket.
+ */
+void * sample_cgroups(void *arg) {
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        uint32_t ms = __atomic_load_n(&cgroup_ms, __ATOMIC_RELAXED);
+        uint32_t period = ms ? ms : 1000;
+
+        next.tv_nsec += (period % 1000) * 1000000L;
+        next.tv_sec += period / 1000 + next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+        if (ms)
+            cgroup_stats_sample();
+    }
+    return NULL;
+}
+
+/**
+ * Register the pod in the control plane and start reading it over RDMA. The
+ * pod already has its segment and publishes while the session is set up in
+ * the background, agent-nic tells it when its first READ landed (see
+ * segment_first_read). The segments of all its containers, in region, are read
+ * over the same session. The pod is recorded in the state file with the name
+ * and kind of its segments, a memfd or a named shm object.
+ */
+static void serve_pod(const struct pod_region *region, uint32_t podID)
+{
+    struct pod_region watched = *region;
+    watch_region(&watched);
+
+    /* register new pod in control plane, its connection is attached by connect_pod */
+    pthread_mutex_lock(&cp_mutex);
+    int slot = alloc_slot();
+    if (slot == -1) {
+        pthread_mutex_unlock(&cp_mutex);
+        fprintf(stderr, "Pod limit reached, pid %u not read\n", podID);
+        release_region(&watched);
+        return;
+    }
+    cp.pod_pids[slot] = podID;
+    cp.conn[slot] = NULL;
+    cp.moving[slot] = 0;
+    cp.port[slot] = -1;
+    cp.failures[slot] = 0;
+    cp.established[slot] = 0;
+    cp.region[slot] = watched;
+    agent_state_set(slot, region->pids, region->num_parts, region->name, region->memfd);
+    pthread_mutex_unlock(&cp_mutex);
+
+    /* resource usage of each container, in its segment for agent-nic to read with the header;
+       the pids in the headers are the pod's to overwrite, the region keeps the verified ones */
+    for (uint32_t p = 0; p < region->num_parts; p++) {
+        void *base = (char *)region->base + (size_t)p * block_size;
+
+        if (cgroup_stats_attach(region->pids[p], segment_get_stats(base)))
+            printf("No cgroup stats for pid %u\n", region->pids[p]);
+    }
+
+    connect_pod(slot, podID);
+}
+
+/* NUMA node for the segments of a new pod, of which pids are the containers, -1 to leave it to first touch */
+static int segment_node(const uint32_t *pids)
+{
+    switch (numa_policy) {
+    case NUMA_POLICY_NIC:
+        return rdma_ports_node();
+    case NUMA_POLICY_POD:
+        return numa_pid_node(pids[0]);
+    default:
+        return -1;
+    }
+}
+
+/* the settings, all from the same change, for one registration */
+static void get_settings(struct segment_settings *s)
+{
+    pthread_mutex_lock(&settings_mutex);
+    *s = settings;
+    pthread_mutex_unlock(&settings_mutex);
+}
+
+/* lock the settings and copy them into s, to change one and commit_settings */
+static void begin_settings(struct segment_settings *s)
+{
+    pthread_mutex_lock(&settings_mutex);
+    *s = settings;
+}
+
+/* publish s if segments of block_size fit its layout, and unlock; returns -1 if they do not */
+static int commit_settings(const struct segment_settings *s)
+{
+    struct segment_layout layout;
+    int err = segment_compute_layout(block_size, s->chunk_size, segment_flags(s->chunk_size, s->chunk_crc),
+                                     s->max_slots, &layout);
+
+    if (!err)
+        settings = *s;
+    pthread_mutex_unlock(&settings_mutex);
+    return err;
+}
+
+/* lay out the segments of a new pod from shm_ptr on, one per container back to back, the one of container i for pids[i] */
+static void layout_segments(void *shm_ptr, const uint32_t *pids, uint32_t num_parts)
+{
+    struct segment_settings set;
+
+    get_settings(&set);
+    for (uint32_t i = 0; i < num_parts; i++) {
+        if (segment_init((char *)shm_ptr + (size_t)i * block_size, block_size, set.chunk_size,
+                         segment_flags(set.chunk_size, set.chunk_crc), set.max_slots, pids[i])) {
+            fprintf(stderr, "Block size %d too small for segment layout (chunk size %u, %u slots%s)\n",
+                    block_size, set.chunk_size, set.max_slots, set.chunk_crc ? ", CRCs" : "");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Lay out the segments of a new pod in shared memory fd, one per container
+ * back to back, the one of container i for pids[i], with their pages on NUMA
+ * node. Returns the mapping.
+ */
+static void * create_segment(int shm_fd, const uint32_t *pids, uint32_t num_parts, int node)
+{
+    size_t size = (size_t)block_size * num_parts;
+
+    /* configure the size of the shared memory object */
+    if (ftruncate(shm_fd, size) == -1) {
+        perror("Error sizing shared memory object");
+        return NULL;
+    }
+
+    /* memory map the shared memory object and lay out the segment header before the pod attaches,
+       the mapping is then passed as context to the RDMA connection */
+    void *shm_ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (shm_ptr == MAP_FAILED) {
+        perror("Error mapping shared memory object");
+        return NULL;
     }
+    /* before the layout first touches the pages */
+    numa_bind(shm_ptr, size, node);
+    layout_segments(shm_ptr, pids, num_parts);
+    return shm_ptr;
 }
 
 // Function to handle client requests
 void *handleNewPod(void *clientSocketPtr) {
     int clientSocket = *((int *)clientSocketPtr);
+    struct timeval timeout = { .tv_sec = 1 };   // for the pod to open its segment
+    struct pod_region region;
     uint32_t podID;
     int shm_fd;
+    char ack;
 
     /* Receive the podID from the client: podID is the process id in the OS */
     if (recv(clientSocket, &podID, sizeof(podID), 0) <= 0) {
@@ -147,27 +641,435 @@ void *handleNewPod(void *clientSocketPtr) {
         exit(EXIT_FAILURE);
     }
     printf("MicroView agent created memory region %s\n", shm_name);
-    /* configure the size of the shared memory object */
-    ftruncate(shm_fd, block_size);
+    int node = segment_node(&podID);
+    void *shm_ptr = create_segment(shm_fd, &podID, 1, node);
+    if (shm_ptr == NULL)
+        exit(EXIT_FAILURE);
     
     // Write the name back to the opened socket
     send(clientSocket, &shm_name, MAX_LEN, 0);
 
+    /* once the pod opened the segment its name is not needed anymore, the
+       memory lives as long as the pod or our mapping have it */
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(clientSocket, &ack, sizeof(ack), 0) != sizeof(ack))
+        fprintf(stderr, "Pod %u did not open %s\n", podID, shm_name);
+    shm_unlink(shm_name);
+    close(shm_fd);
+
     // Close the tcp socket
     close(clientSocket);
     free(clientSocketPtr);
 
-    start_rdma_session(shm_fd, podID);
+    memset(&region, 0, sizeof(region));
+    region.base = shm_ptr;
+    region.size = block_size;
+    region.num_parts = 1;
+    region.pids[0] = podID;
+    region.fd = -1;
+    region.node = node;
+    strncpy(region.name, shm_name, POD_REGION_NAME_LEN - 1);
+    serve_pod(&region, podID);
+    pthread_exit(NULL);
+}
+
+/**
+ * Receive the credential of sidecar i of the pod on sock (SO_PASSCRED set).
+ * Returns its pid as seen by the host agent, 0 if it did not prove one.
+ */
+static uint32_t recv_sidecar_pid(int sock, uint32_t i)
+{
+    struct registration_credential c;
+    struct iovec iov = { .iov_base = &c, .iov_len = sizeof(c) };
+    union {
+        char buf[CMSG_SPACE(sizeof(struct ucred))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg;
+    struct ucred cred;
 
-    // when we arrive at this point means the watcher thread has disconnected
-    // rdma session, we can unlink shared memory segment and exit the thread
-    // who served this connection. 
-    // TODO don't know why this unlink fails..
-    
-    printf("RDMA connection for pid %d terminated\n", podID);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(c) || c.container != i)
+        return 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS)
+        return 0;
+    memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+    return cred.pid > 0 ? (uint32_t)cred.pid : 0;
+}
+
+/**
+ * Register the pod connected on Unix socket sock, with all the containers of
+ * its request: create their segments as a sealed memfd, or recycle those of a
+ * pod gone, and send it back with the layout, in a single message. The pids
+ * of the containers are the ones the kernel vouches for, of the process
+ * connected and of each sidecar, see registration_credential.
+ * Returns 0 with the segments in region, the memfd kept open to recycle them,
+ * -1 on failure (the pod is told).
+ */
+static int register_unix_pod(int sock, uint32_t *podID, struct pod_region *region)
+{
+    struct registration_request req;
+    struct registration_reply reply;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    void *shm_ptr = NULL;
+    int fd = -1, recycled = 0, node, on = 1;
+
+    memset(&reply, 0, sizeof(reply));
+    memset(region, 0, sizeof(*region));
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+        setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) == -1) {
+        reply.status = errno;
+        goto out;
+    }
+    *podID = reply.pid = (uint32_t)cred.pid;
+
+    ssize_t n = recv(sock, &req, sizeof(req), MSG_WAITALL);
+    if (n != sizeof(req)) {
+        reply.status = n == -1 ? errno : EPROTO;
+        goto out;
+    }
+    if (req.num_containers == 0)
+        req.num_containers = 1;
+    if (req.num_containers > REGISTRATION_MAX_CONTAINERS) {
+        reply.status = E2BIG;
+        goto out;
+    }
+    req.pids[0] = reply.pid;
+    for (uint32_t i = 1; i < req.num_containers; i++) {
+        req.pids[i] = recv_sidecar_pid(sock, i);
+        for (uint32_t k = 0; k < i && req.pids[i]; k++) {
+            if (req.pids[k] == req.pids[i])
+                req.pids[i] = 0;
+        }
+        if (req.pids[i] == 0) {
+            fprintf(stderr, "Sidecar %u of pod %u did not prove its pid\n", i, reply.pid);
+            reply.status = EPERM;
+            goto out;
+        }
+    }
+    reply.num_parts = req.num_containers;
+    printf("\n** New pod with pid %d registered (unix), %u containers **\n", cred.pid, req.num_containers);
+
+    /* a recycled region is already zeroed, sealed and registered, it keeps the name and node it was created with */
+    node = segment_node(req.pids);
+    if (segment_pool_get((size_t)block_size * req.num_containers, node, region) == 0) {
+        shm_ptr = region->base;
+        fd = region->fd;
+        recycled = 1;
+        layout_segments(shm_ptr, req.pids, req.num_containers);
+        printf("Recycled segments %s\n", region->name);
+    } else {
+        snprintf(region->name, POD_REGION_NAME_LEN, "%s-%u", Q_NAME, reply.pid);
+        fd = memfd_create(region->name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        region->node = node;
+        if (fd == -1 || (shm_ptr = create_segment(fd, req.pids, req.num_containers, node)) == NULL) {
+            reply.status = errno;
+            goto out;
+        }
+
+        /* the pod may write its segment but not resize it under the NIC */
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+            perror("Error sealing segment");
+    }
+
+    struct segment_layout layout;
+    segment_read_layout(shm_ptr, &layout);
+    reply.size = layout.size;
+    reply.data_off = layout.data_off;
+    reply.layout_hash = layout.hash;
+
+out:;
+    struct iovec iov = { .iov_base = &reply, .iov_len = sizeof(reply) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (reply.status == 0) {
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    } else {
+        fprintf(stderr, "Error registering pod: %s\n", strerror(reply.status));
+    }
+    if (sendmsg(sock, &msg, 0) == -1)
+        perror("Error replying to pod");
+
+    if (reply.status != 0) {
+        if (recycled) {
+            segment_pool_put(region);
+        } else {
+            if (shm_ptr)
+                munmap(shm_ptr, (size_t)block_size * reply.num_parts);
+            if (fd != -1)
+                close(fd);
+        }
+        return -1;
+    }
+    region->base = shm_ptr;
+    region->size = (size_t)block_size * reply.num_parts;
+    region->num_parts = reply.num_parts;
+    memcpy(region->pids, req.pids, reply.num_parts * sizeof(uint32_t));
+    region->fd = fd;
+    region->memfd = 1;
+    return 0;
+}
+
+/* register the pod connected on the unix socket, in a thread of its own like handleNewPod */
+void *handleUnixPod(void *clientSocketPtr) {
+    int clientSocket = *((int *)clientSocketPtr);
+    struct timeval timeout = { .tv_sec = 1 };   // for the request and each sidecar credential
+    struct pod_region region;
+    uint32_t podID;
+
+    free(clientSocketPtr);
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int failed = register_unix_pod(clientSocket, &podID, &region);
+    close(clientSocket);
+    if (!failed)
+        serve_pod(&region, podID);
     pthread_exit(NULL);
 }
 
+/**
+ * Accept pods on the registration Unix socket. Each one registers in a thread
+ * of its own, so a client slow to send its request (the socket is open to
+ * all local users) holds up no other pod. Starting the RDMA session completes
+ * in the background.
+ */
+void * run_unix(void *arg) {
+    struct sockaddr_un addr;
+    pthread_t tid;
+    int serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (serverSocket == -1) {
+        perror("Error creating unix socket");
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+    unlink(unix_path);
+
+    if (bind(serverSocket, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(serverSocket, 128) == -1) {
+        perror("Error listening on unix socket, pods must register over TCP");
+        close(serverSocket);
+        return NULL;
+    }
+    chmod(unix_path, 0666);
+    printf("Server is listening on %s...\n", unix_path);
+
+    while (1) {
+        int clientSocket = accept(serverSocket, NULL, NULL);
+
+        if (clientSocket == -1) {
+            perror("Error accepting connection");
+            continue;
+        }
+
+        int *clientSockPtr = malloc(sizeof(int));
+        if (clientSockPtr == NULL) {
+            perror("Error allocating memory");
+            close(clientSocket);
+            continue;
+        }
+        *clientSockPtr = clientSocket;
+
+        if (pthread_create(&tid, NULL, handleUnixPod, (void*)clientSockPtr) != 0) {
+            perror("Error creating thread");
+            free(clientSockPtr);
+            close(clientSocket);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    return NULL;
+}
+
+/**
+ * Serve again the pods of a previous run of the agent that are still alive:
+ * map their segments, which they kept publishing into, and reconnect them to
+ * agent-nic. Sessions are set up in the background like for new pods, so
+ * pods are restored back to back.
+ */
+static void restore_pods(void)
+{
+    static struct agent_state_entry old[AGENT_STATE_MAX_PODS];
+    struct timespec start, end;
+    int restored = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n = agent_state_open(state_path, block_size, old);
+
+    for (int i = 0; i < n; i++) {
+        struct agent_state_entry *e = &old[i];
+        size_t size = (size_t)block_size * e->num_parts;
+        struct pod_region region;
+        struct stat st;
+        void *shm_ptr;
+
+        if (e->num_parts == 0 || e->num_parts > SEGMENT_MAX_PARTS || kill(e->pid, 0) == -1)
+            continue;
+        int fd = agent_state_reopen(e);
+        if (fd == -1)
+            continue;
+        if (fstat(fd, &st) == -1 || (size_t)st.st_size < size ||
+            (shm_ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            close(fd);
+            continue;
+        }
+
+        struct segment_header *hdr = (struct segment_header *)shm_ptr;
+        if (hdr->magic != SEGMENT_MAGIC || hdr->pid != e->pid || hdr->size != block_size) {
+            munmap(shm_ptr, size);
+            close(fd);
+            continue;
+        }
+        printf("Restoring pod %u, %lu publishes since the last checkpoint\n",
+               e->pid, hdr->generation - e->generation);
+
+        /* a memfd is kept open to be recycled, like for a new pod */
+        memset(&region, 0, sizeof(region));
+        region.base = shm_ptr;
+        region.size = size;
+        region.num_parts = e->num_parts;
+        memcpy(region.pids, e->pids, e->num_parts * sizeof(uint32_t));
+        region.memfd = e->memfd;
+        region.fd = e->memfd ? fd : -1;
+        region.node = -1;   // wherever the previous run placed them
+        if (!e->memfd)
+            close(fd);
+        memcpy(region.name, e->name, POD_REGION_NAME_LEN);
+        serve_pod(&region, e->pid);
+        restored++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (n > 0)
+        printf("Restored %d of %d pods from %s in %.3f ms\n", restored, n, state_path,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+/**
+ * Where the segments of the pods are and which RNIC reads them: per NUMA
+ * node, the pods read through its ports, the segment pages resident on it,
+ * and the pages those ports read from their own node (local) or another one
+ * (remote). Pages are located with move_pages, on demand only.
+ */
+static void numa_report(FILE *out)
+{
+    uint64_t resident[NUMA_MAX_NODES] = {0}, local[NUMA_MAX_NODES] = {0}, remote[NUMA_MAX_NODES] = {0};
+    int pods[NUMA_MAX_NODES] = {0}, unknown = 0;
+
+    pthread_mutex_lock(&cp_mutex);
+    for (int i = 0; i < cp.num_pods; i++) {
+        uint64_t pages[NUMA_MAX_NODES] = {0};
+
+        if (cp.pod_pids[i] == -1 || cp.region[i].base == NULL)
+            continue;
+        int found = numa_count_pages(cp.region[i].base, cp.region[i].size, pages);
+        for (int n = 0; n < NUMA_MAX_NODES; n++)
+            resident[n] += pages[n];
+
+        int node = rdma_port_node(cp.port[i]);
+        if (node == -1) {
+            unknown++;
+            continue;
+        }
+        pods[node]++;
+        local[node] += pages[node];
+        remote[node] += found - pages[node];
+    }
+    pthread_mutex_unlock(&cp_mutex);
+
+    for (int n = 0; n < NUMA_MAX_NODES; n++) {
+        if (pods[n] || resident[n])
+            fprintf(out, "node %d: %d pods, %lu pages resident, read %lu local %lu remote\n",
+                    n, pods[n], resident[n], local[n], remote[n]);
+    }
+    fprintf(out, "%d pods through ports of unknown node\n", unknown);
+}
+
+/**
+ * Command from the control socket. Segment settings apply to the pods
+ * registering from then on, pods already served keep their layout and their
+ * RDMA session.
+ */
+static void control_command(char *cmd, FILE *out)
+{
+    char *save = NULL;
+    char *verb = strtok_r(cmd, " \t", &save);
+    char *arg = strtok_r(NULL, " \t", &save);
+    struct segment_settings set;
+
+    if (verb == NULL)
+        return;
+
+    if (strcmp(verb, "status") == 0) {
+        int pods = 0;
+        get_settings(&set);
+        pthread_mutex_lock(&cp_mutex);
+        for (int i = 0; i < cp.num_pods; i++)
+            pods += cp.pod_pids[i] != -1;
+        pthread_mutex_unlock(&cp_mutex);
+        fprintf(out, "%d pods\nchunk %u\nslots %u\ncrc %s\ncgroup %u ms\npool %d\n", pods, set.chunk_size, set.max_slots,
+                set.chunk_crc ? "on" : "off", __atomic_load_n(&cgroup_ms, __ATOMIC_RELAXED), pool_capacity);
+    } else if (strcmp(verb, "chunk") == 0 && arg) {
+        begin_settings(&set);
+        set.chunk_size = (uint32_t)atoi(arg);
+        if (commit_settings(&set)) {
+            fprintf(out, "error: chunk size %u does not fit segments of %d bytes%s\n", set.chunk_size, block_size,
+                    set.chunk_crc ? " with CRCs" : "");
+            return;
+        }
+        fprintf(out, "ok, for new pods\n");
+    } else if (strcmp(verb, "crc") == 0 && arg && (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)) {
+        begin_settings(&set);
+        set.chunk_crc = strcmp(arg, "on") == 0;
+        if (commit_settings(&set)) {
+            fprintf(out, "error: CRCs need dirty tracking (chunk) and room in segments of %d bytes\n", block_size);
+            return;
+        }
+        fprintf(out, "ok, for new pods\n");
+    } else if (strcmp(verb, "slots") == 0 && arg) {
+        begin_settings(&set);
+        set.max_slots = (uint16_t)atoi(arg);
+        if (commit_settings(&set)) {
+            fprintf(out, "error: %u slots do not fit segments of %d bytes\n", set.max_slots, block_size);
+            return;
+        }
+        fprintf(out, "ok, for new pods\n");
+    } else if (strcmp(verb, "cgroup") == 0 && arg) {
+        __atomic_store_n(&cgroup_ms, (uint32_t)atoi(arg), __ATOMIC_RELAXED);
+        fprintf(out, "ok\n");
+    } else if (strcmp(verb, "numa") == 0) {
+        numa_report(out);
+    } else if (strcmp(verb, "shards") == 0 && arg && strcmp(arg, "reload") == 0 && shards_file) {
+        reload_shards = 1;
+        fprintf(out, "ok, pods move within 2 s\n");
+    } else {
+        fprintf(out, "status | chunk <bytes> | crc on|off | slots <n> | cgroup <ms> | numa | shards reload\n");
+    }
+}
+
 int run() {
     /* opens TCP server and listens for incoming conenction
        new pods will ask for shared memory region pointer on
@@ -225,10 +1127,34 @@ int run() {
     // watch active pods and terminate rdma connections for those non-active
     pthread_mutex_init(&cp_mutex, NULL);
     cp.num_pods = 0;
+
+    // all RDMA sessions progress in one event loop
+    TEST_Z(cm_channel = rdma_create_event_channel());
+    pthread_t cmtid;
+    TEST_NZ(pthread_create(&cmtid, NULL, cm_event_loop, NULL));
+    pthread_detach(cmtid);
+    // pods served before a restart, before any new one takes their slot
+    if (state_path[0])
+        restore_pods();
+
     pthread_t pptid;
     TEST_NZ(pthread_create(&pptid, NULL, poll_pids, NULL));
     pthread_detach(pptid);
 
+    pthread_t ctid;
+    TEST_NZ(pthread_create(&ctid, NULL, sample_cgroups, NULL));
+    pthread_detach(ctid);
+
+    if (control_path[0])
+        control_start(control_path, control_command);
+
+    // pods may also register on the unix socket
+    if (unix_path[0]) {
+        pthread_t utid;
+        TEST_NZ(pthread_create(&utid, NULL, run_unix, NULL));
+        pthread_detach(utid);
+    }
+
     while (1) {
         // Accept a new connection
         clientSocket = accept(serverSocket, (struct sockaddr *)&clientAddr, &clientAddrLen);
@@ -262,30 +1188,119 @@ int run() {
 
 /**
  * Run MicroView agent
- * usage: ./agent <DPU-address> <DPU-port> <block size> <num blocks>
+ * usage: ./agent [-g chunk size] [-V] [-s slots] [-n shards file] [-u socket] [-c ms] [-w state file] [-C control socket] [-P pool size] [-N nic|pod|none] [-k cores] <DPU-address> <DPU-port> <block size> <num blocks>
  * 
  */
 int main(int argc, char *argv[])
 {
-    if (argc != 5) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:Vs:n:u:c:w:C:P:N:k:h")) != -1) {
+        switch (opt) {
+        case 'g':
+            settings.chunk_size = (uint32_t)atoi(optarg);
+            break;
+        case 'V':
+            settings.chunk_crc = 1;
+            break;
+        case 's':
+            settings.max_slots = (uint16_t)atoi(optarg);
+            break;
+        case 'n':
+            shards_file = optarg;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'c':
+            cgroup_ms = (uint32_t)atoi(optarg);
+            break;
+        case 'w':
+            state_path = optarg;
+            break;
+        case 'C':
+            control_path = optarg;
+            break;
+        case 'P':
+            pool_capacity = atoi(optarg);
+            break;
+        case 'N':
+            if ((numa_policy = numa_parse_policy(optarg)) == -1)
+                usage(argv[0]);
+            break;
+        case 'k':
+            if (numa_set_cores(optarg))
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 4) {
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
     
-    sprintf(peer_ip, "%s", argv[1]);
-    sprintf(peer_port, "%s", argv[2]);
+    sprintf(peer_ip, "%s", argv[optind]);
+    sprintf(peer_port, "%s", argv[optind + 1]);
     
-    block_size = atoi(argv[3]);
-    num_mr = atoi(argv[4]);
+    block_size = atoi(argv[optind + 2]);
+    num_mr = atoi(argv[optind + 3]);
+    segment_pool_init(pool_capacity);
 
-    printf("Agent connects to peer %s on port %s, mode = %s\n", peer_ip, peer_port, "read");
+    /* pods are sharded on the agent-nic instances of the file, or all read by the peer */
+    shard_ring_init(&ring);
+    if (shards_file) {
+        if (shard_ring_load(&ring, shards_file))
+            exit(EXIT_FAILURE);
+        printf("Agent shards pods on %d agent-nic instances from %s, mode = %s\n",
+               ring.num_instances, shards_file, "read");
+    } else {
+        shard_ring_add(&ring, peer_ip, peer_port);
+        printf("Agent connects to peer %s on port %s, mode = %s\n", peer_ip, peer_port, "read");
+    }
+    
+    /* pods are spread over the ports of all RNICs, by number of pods */
+    if (rdma_ports_init() == 0)
+        printf("No RDMA ports found, connections routed by rdma_cm\n");
     
     //signal(SIGINT, INThandler); handle CTRL+C 
+    signal(SIGHUP, HUPhandler); // reload agent-nic instances
     run();
 }
 
+/* SIGHUP: the watcher thread reloads the shards file and rebalances pods */
+void HUPhandler(int sig)
+{
+    reload_shards = shards_file != NULL;
+}
+
 void usage(const char *argv0)
 {
-  fprintf(stderr, "usage: %s <DPU-address> <DPU-port> <block size> <MR per pod>\n", argv0);
+  fprintf(stderr, "usage: %s [-g chunk size] [-V] [-s slots] [-n shards file] [-u socket] [-c ms] [-w state file] [-C control socket] [-P pool size] [-N nic|pod|none] [-k cores] <DPU-address> <DPU-port> <block size> <MR per pod>\n", argv0);
+  fprintf(stderr, "  -g  dirty tracking granularity in bytes, %d-%d, 0 to disable (default %d)\n",
+          SEGMENT_MIN_CHUNK, SEGMENT_MAX_CHUNK, SEGMENT_DEFAULT_CHUNK);
+  fprintf(stderr, "  -V  pods keep the CRC32C of each chunk, verified by agent-nic after its READs\n"
+                  "      (needs dirty tracking)\n");
+  fprintf(stderr, "  -s  named metric slots per segment, 0 for no directory (default %d)\n",
+          SEGMENT_DEFAULT_SLOTS);
+  fprintf(stderr, "  -n  shard pods on the agent-nic instances listed as '<address> <port>' per\n"
+                  "      line instead of the DPU address/port, reloaded on SIGHUP; the owner of\n"
+                  "      each pod is written to %s\n", SHARD_MAP);
+  fprintf(stderr, "  -u  unix socket where pods register and get their segment as a memfd,\n"
+                  "      empty to disable (default %s)\n", REGISTRATION_SOCKET);
+  fprintf(stderr, "  -c  sample the cgroup CPU, memory and IO usage and pressure of each pod into\n"
+                  "      its segment every this many ms, 0 to disable (default %d)\n", CGROUP_STATS_DEFAULT_MS);
+  fprintf(stderr, "  -w  keep the pod table in this file, a restarted agent serves the pods in it\n"
+                  "      again without them registering, empty to disable (default %s)\n", AGENT_STATE_FILE);
+  fprintf(stderr, "  -C  control socket to change -g, -V, -s, -c and reload -n at runtime (send 'help'),\n"
+                  "      empty to disable (default /tmp/microview-agent.ctl)\n");
+  fprintf(stderr, "  -P  keep up to this many segment regions of pods gone, zeroed and registered,\n"
+                  "      for new pods registering on the unix socket, 0 to disable (default %d)\n",
+          SEGMENT_POOL_DEFAULT);
+  fprintf(stderr, "  -N  NUMA node of the segments of new pods: of the RNIC port reading them (nic),\n"
+                  "      of the CPU the pod runs on (pod), or first touch (none) (default nic)\n");
+  fprintf(stderr, "  -k  pin the CQ pollers on these cores, round-robin, e.g. 2,4-7\n");
   exit(1);
 }
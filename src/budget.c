@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "budget.h"
+
+static struct budget_bucket bytes_bucket, reads_bucket;
+static struct budget_class_stats stats[BUDGET_MAX_CLASSES], last_stats[BUDGET_MAX_CLASSES];
+static int num_classes = 1;
+static struct timespec last_refill, last_report;
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double elapsed_s(const struct timespec *from, const struct timespec *to)
+{
+  return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) * 1.0e-9;
+}
+
+static void bucket_init(struct budget_bucket *b, double rate, double burst_s)
+{
+  b->rate = rate;
+  b->capacity = rate * burst_s;
+  b->tokens = b->capacity;
+}
+
+static void bucket_refill(struct budget_bucket *b, double dt)
+{
+  b->tokens += b->rate * dt;
+  if (b->tokens > b->capacity)
+    b->tokens = b->capacity;
+}
+
+/* the bucket has enough left for class prio, always true if unlimited */
+static int bucket_allows(const struct budget_bucket *b, int prio)
+{
+  return b->rate == 0 || b->tokens >= b->capacity * prio / num_classes;
+}
+
+static void refill(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double dt = elapsed_s(&last_refill, &now);
+  last_refill = now;
+
+  bucket_refill(&bytes_bucket, dt);
+  bucket_refill(&reads_bucket, dt);
+}
+
+/**
+ * Budget of bytes_per_s and reads_per_s (0 for unlimited), accumulating up to
+ * burst_s seconds worth of tokens while idle.
+ */
+void budget_init(double bytes_per_s, double reads_per_s, double burst_s, int classes)
+{
+  pthread_mutex_lock(&budget_mutex);
+  bucket_init(&bytes_bucket, bytes_per_s, burst_s);
+  bucket_init(&reads_bucket, reads_per_s, burst_s);
+  num_classes = classes < 1 ? 1 : (classes > BUDGET_MAX_CLASSES ? BUDGET_MAX_CLASSES : classes);
+  memset(stats, 0, sizeof(stats));
+  memset(last_stats, 0, sizeof(last_stats));
+  clock_gettime(CLOCK_MONOTONIC, &last_refill);
+  last_report = last_refill;
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+static void bucket_set(struct budget_bucket *b, double rate, double burst_s)
+{
+  b->rate = rate;
+  b->capacity = rate * burst_s;
+  if (b->tokens > b->capacity)
+    b->tokens = b->capacity;
+}
+
+/**
+ * Change the budget at runtime, see budget_init. The tokens left (or the
+ * debt) carry over, capped to the new capacity, and so do the counters.
+ */
+void budget_configure(double bytes_per_s, double reads_per_s, double burst_s, int classes)
+{
+  pthread_mutex_lock(&budget_mutex);
+  refill();
+  bucket_set(&bytes_bucket, bytes_per_s, burst_s);
+  bucket_set(&reads_bucket, reads_per_s, burst_s);
+  num_classes = classes < 1 ? 1 : (classes > BUDGET_MAX_CLASSES ? BUDGET_MAX_CLASSES : classes);
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+/**
+ * Admit bytes in reads READs at priority prio and charge them.
+ * Returns 0 if the budget left is reserved to higher priorities.
+ */
+int budget_admit(int prio, uint32_t bytes, int reads)
+{
+  int ok;
+
+  pthread_mutex_lock(&budget_mutex);
+  refill();
+  ok = bucket_allows(&bytes_bucket, prio) && bucket_allows(&reads_bucket, prio);
+  if (ok) {
+    bytes_bucket.tokens -= bytes;
+    reads_bucket.tokens -= reads;
+  }
+  pthread_mutex_unlock(&budget_mutex);
+  return ok;
+}
+
+/* charge READs of an admitted round that were not known at admission, e.g., a body */
+void budget_charge(uint32_t bytes, int reads)
+{
+  pthread_mutex_lock(&budget_mutex);
+  refill();
+  bytes_bucket.tokens -= bytes;
+  reads_bucket.tokens -= reads;
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+/* rounds of class cls asked for req_bytes in req_reads READs, and read bytes in reads */
+void budget_account(int cls, uint32_t req_bytes, int req_reads, uint32_t bytes, int reads)
+{
+  pthread_mutex_lock(&budget_mutex);
+  stats[cls].req_bytes += req_bytes;
+  stats[cls].req_reads += req_reads;
+  stats[cls].granted_bytes += bytes;
+  stats[cls].granted_reads += reads;
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+void budget_round(int cls, int degraded, int skipped)
+{
+  pthread_mutex_lock(&budget_mutex);
+  stats[cls].rounds++;
+  stats[cls].degraded += degraded;
+  stats[cls].skipped += skipped;
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+/* print requested vs granted rates per class since the last report */
+void budget_report(void)
+{
+  struct timespec now;
+
+  pthread_mutex_lock(&budget_mutex);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double dt = elapsed_s(&last_report, &now);
+  last_report = now;
+
+  for (int c = 0; c < num_classes && dt > 0; c++) {
+    struct budget_class_stats *s = &stats[c], *l = &last_stats[c];
+
+    if (s->rounds == l->rounds)
+      continue;
+    printf("budget class %d: %lu rounds (%lu degraded, %lu skipped), "
+           "requested %.0f B/s %.0f READ/s, granted %.0f B/s %.0f READ/s\n",
+           c, s->rounds - l->rounds, s->degraded - l->degraded, s->skipped - l->skipped,
+           (s->req_bytes - l->req_bytes) / dt, (s->req_reads - l->req_reads) / dt,
+           (s->granted_bytes - l->granted_bytes) / dt, (s->granted_reads - l->granted_reads) / dt);
+  }
+  memcpy(last_stats, stats, sizeof(stats));
+  pthread_mutex_unlock(&budget_mutex);
+}
@@ -0,0 +1,282 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgroup-stats.h"
+
+#define CGROUP_PATH_LEN 512
+#define CGROUP_BUF_LEN  4096
+
+/* files sampled, file f sets bit 1 << f of segment_stats valid */
+static const char *files[] = {
+  "cpu.stat", "memory.current", "io.stat", "cpu.pressure", "memory.pressure", "io.pressure"
+};
+#define NUM_FILES (int)(sizeof(files) / sizeof(files[0]))
+
+struct cgroup {
+  char path[CGROUP_PATH_LEN];   // from the root of the hierarchy
+  int fds[NUM_FILES];           // -1 if the file is missing, e.g. controller not enabled
+  int refs;                     // segments fed, 0 if the entry is free
+};
+
+/* the host stats line of a segment, fed by a cgroup */
+struct sink {
+  struct segment_stats *stats;
+  int group;
+};
+
+static struct cgroup groups[CGROUP_STATS_MAX_GROUPS];
+static struct sink sinks[CGROUP_STATS_MAX_PODS];
+static int num_sinks = 0;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* cgroup v2 path of process pid, from the "0::" line of /proc/<pid>/cgroup */
+static int cgroup_of(uint32_t pid, char *path)
+{
+  char line[CGROUP_PATH_LEN + 8];
+  int found = 0;
+
+  snprintf(line, sizeof(line), "/proc/%u/cgroup", pid);
+  FILE *f = fopen(line, "r");
+  if (f == NULL)
+    return -1;
+
+  while (!found && fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "0::", 3) != 0)
+      continue;
+    line[strcspn(line, "\n")] = '\0';
+    strncpy(path, line + 3, CGROUP_PATH_LEN - 1);
+    path[CGROUP_PATH_LEN - 1] = '\0';
+    found = 1;
+  }
+  fclose(f);
+  return found ? 0 : -1;
+}
+
+/* entry of the cgroup at path, opening its files if no segment is fed by it yet; call locked */
+static int open_group(const char *path)
+{
+  int free_group = -1, opened = 0;
+
+  for (int g = 0; g < CGROUP_STATS_MAX_GROUPS; g++) {
+    if (groups[g].refs > 0 && strcmp(groups[g].path, path) == 0)
+      return g;
+    if (groups[g].refs == 0 && free_group == -1)
+      free_group = g;
+  }
+  if (free_group == -1)
+    return -1;
+
+  struct cgroup *cg = &groups[free_group];
+  strcpy(cg->path, path);
+  for (int f = 0; f < NUM_FILES; f++) {
+    char file[CGROUP_PATH_LEN + 64];
+
+    snprintf(file, sizeof(file), "%s%s/%s", CGROUP_ROOT, path, files[f]);
+    cg->fds[f] = open(file, O_RDONLY | O_CLOEXEC);
+    opened += cg->fds[f] != -1;
+  }
+  if (opened == 0)
+    return -1;
+  return free_group;
+}
+
+static void close_group(struct cgroup *cg)
+{
+  for (int f = 0; f < NUM_FILES; f++) {
+    if (cg->fds[f] != -1)
+      close(cg->fds[f]);
+  }
+}
+
+/**
+ * Sample the cgroup of process pid into stats, from the next sample on.
+ * Returns -1 if its cgroup cannot be found or read, or the tables are full.
+ */
+int cgroup_stats_attach(uint32_t pid, struct segment_stats *stats)
+{
+  char path[CGROUP_PATH_LEN];
+  int g = -1;
+
+  if (cgroup_of(pid, path))
+    return -1;
+
+  pthread_mutex_lock(&stats_mutex);
+  if (num_sinks < CGROUP_STATS_MAX_PODS)
+    g = open_group(path);
+  if (g != -1) {
+    groups[g].refs++;
+    sinks[num_sinks].stats = stats;
+    sinks[num_sinks].group = g;
+    num_sinks++;
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  if (g != -1)
+    printf("pid %u sampled from cgroup %s\n", pid, path);
+  return g == -1 ? -1 : 0;
+}
+
+/* fd of the cgroup.events file of the cgroup of pid, -1 if it cannot be found */
+int cgroup_events_open(uint32_t pid)
+{
+  char path[CGROUP_PATH_LEN];
+  char file[CGROUP_PATH_LEN + 64];
+
+  if (cgroup_of(pid, path))
+    return -1;
+  snprintf(file, sizeof(file), "%s%s/cgroup.events", CGROUP_ROOT, path);
+  return open(file, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * 0 if the cgroup of events_fd has no process left in it nor in its
+ * descendants, 1 if it has, -1 if that cannot be read (e.g. the cgroup was
+ * removed): the caller must then assume it is populated.
+ */
+int cgroup_populated(int events_fd)
+{
+  char buf[256];
+  ssize_t n = pread(events_fd, buf, sizeof(buf) - 1, 0);
+
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+
+  char *line = strstr(buf, "populated ");
+  if (line == NULL)
+    return -1;
+  return line[strlen("populated ")] != '0';
+}
+
+/* stop sampling into stats, closing the files of its cgroup if it was the last fed by it */
+void cgroup_stats_detach(struct segment_stats *stats)
+{
+  pthread_mutex_lock(&stats_mutex);
+  for (int i = 0; i < num_sinks; i++) {
+    if (sinks[i].stats != stats)
+      continue;
+
+    struct cgroup *cg = &groups[sinks[i].group];
+    if (--cg->refs == 0)
+      close_group(cg);
+    sinks[i] = sinks[--num_sinks];
+    break;
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+/* value of "key <value>" at the start of a line of buf, 0 if missing */
+static uint64_t flat_key(const char *buf, const char *key)
+{
+  size_t len = strlen(key);
+
+  for (const char *line = buf; line; line = strchr(line, '\n')) {
+    if (*line == '\n')
+      line++;
+    if (strncmp(line, key, len) == 0 && line[len] == ' ')
+      return strtoull(line + len + 1, NULL, 10);
+  }
+  return 0;
+}
+
+/* sum of all the "key=<value>" of buf, as in io.stat */
+static uint64_t sum_key(const char *buf, const char *key)
+{
+  size_t len = strlen(key);
+  uint64_t sum = 0;
+
+  for (const char *p = strstr(buf, key); p; p = strstr(p + len, key)) {
+    if (p[len] == '=')
+      sum += strtoull(p + len + 1, NULL, 10);
+  }
+  return sum;
+}
+
+/* "some avg10" of a PSI file, in hundredths of a percent */
+static uint32_t pressure(const char *buf)
+{
+  const char *p = strstr(buf, "some avg10=");
+
+  return p ? (uint32_t)(strtod(p + strlen("some avg10="), NULL) * 100.0 + 0.5) : 0;
+}
+
+static void read_group(struct cgroup *cg, struct segment_stats *out)
+{
+  static char buf[CGROUP_BUF_LEN];
+
+  memset(out, 0, sizeof(*out));
+  for (int f = 0; f < NUM_FILES; f++) {
+    ssize_t n;
+
+    if (cg->fds[f] == -1 || (n = pread(cg->fds[f], buf, sizeof(buf) - 1, 0)) < 0)
+      continue;
+    buf[n] = '\0';
+    out->valid |= 1u << f;
+
+    switch (1u << f) {
+    case SEGMENT_STATS_CPU:
+      out->cpu_usage_us = flat_key(buf, "usage_usec");
+      out->cpu_throttled_us = flat_key(buf, "throttled_usec");
+      break;
+    case SEGMENT_STATS_MEMORY:
+      out->memory_current = strtoull(buf, NULL, 10);
+      break;
+    case SEGMENT_STATS_IO:
+      out->io_bytes = sum_key(buf, "rbytes") + sum_key(buf, "wbytes");
+      break;
+    case SEGMENT_STATS_CPU_PSI:
+      out->cpu_pressure = pressure(buf);
+      break;
+    case SEGMENT_STATS_MEM_PSI:
+      out->memory_pressure = pressure(buf);
+      break;
+    case SEGMENT_STATS_IO_PSI:
+      out->io_pressure = pressure(buf);
+      break;
+    }
+  }
+}
+
+/* copy a sample into the stats line of a segment, bracketed by seq and seq_end (see segment_stats) */
+static void publish(struct segment_stats *dst, const struct segment_stats *src)
+{
+  size_t off = offsetof(struct segment_stats, valid);
+  size_t end = offsetof(struct segment_stats, seq_end);
+  uint32_t seq = dst->seq;
+
+  __atomic_store_n(&dst->seq_end, seq + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&dst->seq, seq + 1, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((char *)dst + off, (const char *)src + off, end - off);
+  __atomic_store_n(&dst->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&dst->seq_end, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sample all the attached pods: read every cgroup in use once, then copy its
+ * values into the segments it feeds.
+ */
+void cgroup_stats_sample(void)
+{
+  static struct segment_stats values[CGROUP_STATS_MAX_GROUPS];
+  struct timespec now;
+
+  pthread_mutex_lock(&stats_mutex);
+  clock_gettime(CLOCK_REALTIME, &now);
+  for (int g = 0; g < CGROUP_STATS_MAX_GROUPS; g++) {
+    if (groups[g].refs == 0)
+      continue;
+    read_group(&groups[g], &values[g]);
+    values[g].sampled_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+  }
+
+  for (int i = 0; i < num_sinks; i++)
+    publish(sinks[i].stats, &values[sinks[i].group]);
+  pthread_mutex_unlock(&stats_mutex);
+}
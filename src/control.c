@@ -0,0 +1,95 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+struct control_server {
+  int sock;
+  control_handler handler;
+};
+
+static void * serve(void *arg)
+{
+  struct control_server *srv = arg;
+  char line[CONTROL_LINE_LEN];
+
+  while (1) {
+    int client = accept(srv->sock, NULL, NULL);
+    if (client == -1) {
+      perror("Error accepting control connection");
+      continue;
+    }
+
+    /* a stream each way, an update stream cannot switch from reading to writing */
+    FILE *in = fdopen(client, "r");
+    int out_fd = dup(client);
+    FILE *out = out_fd == -1 ? NULL : fdopen(out_fd, "w");
+    if (in == NULL || out == NULL) {
+      if (in)
+        fclose(in);
+      else
+        close(client);
+      if (out_fd != -1 && out == NULL)
+        close(out_fd);
+      continue;
+    }
+    while (fgets(line, sizeof(line), in)) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0')
+        continue;
+      srv->handler(line, out);
+      fflush(out);
+    }
+    fclose(out);
+    fclose(in);
+  }
+  return NULL;
+}
+
+/**
+ * Listen for commands on the Unix socket at path, replacing a stale one.
+ * Returns -1 if the socket cannot be created.
+ */
+int control_start(const char *path, control_handler handler)
+{
+  struct sockaddr_un addr;
+  pthread_t tid;
+
+  struct control_server *srv = malloc(sizeof(*srv));
+  srv->handler = handler;
+  srv->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (srv->sock == -1) {
+    perror("Error creating control socket");
+    free(srv);
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  /* owner only from the moment it exists, a chmod afterwards leaves a window to connect */
+  mode_t old_mask = umask(0177);
+  int bound = bind(srv->sock, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+  if (bound == -1 || listen(srv->sock, 4) == -1) {
+    perror("Error listening on control socket");
+    close(srv->sock);
+    free(srv);
+    return -1;
+  }
+
+  if (pthread_create(&tid, NULL, serve, srv) != 0) {
+    close(srv->sock);
+    free(srv);
+    return -1;
+  }
+  pthread_detach(tid);
+  printf("Control socket on %s\n", path);
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include "cost-model.h"
+
+#define EWMA_ALPHA 0.125
+
+static double ewma(double avg, double sample)
+{
+  return avg + EWMA_ALPHA * (sample - avg);
+}
+
+void cost_model_init(struct read_cost *cm)
+{
+  memset(cm, 0, sizeof(*cm));
+  cm->p_change = 1.0;   // pessimistic until we observe the pod
+}
+
+/* latency of a small READ, i.e., round-trip time */
+void cost_model_head_sample(struct read_cost *cm, double t_ns)
+{
+  cm->rtt_ns = cm->has_rtt ? ewma(cm->rtt_ns, t_ns) : t_ns;
+  cm->has_rtt = 1;
+}
+
+/* latency of a batch of large READs, the part exceeding the round-trips is due to size */
+void cost_model_bulk_sample(struct read_cost *cm, double t_ns, uint32_t bytes, int wrs)
+{
+  if (!cm->has_rtt || bytes == 0)
+    return;
+
+  double per_byte = (t_ns - wrs * cm->rtt_ns) / bytes;
+  if (per_byte < 0)
+    per_byte = 0;
+
+  cm->ns_per_byte = cm->has_bw ? ewma(cm->ns_per_byte, per_byte) : per_byte;
+  cm->has_bw = 1;
+}
+
+/* what a header-first round observed (or would have observed) */
+void cost_model_round(struct read_cost *cm, int changed, uint32_t body_bytes, int body_wrs)
+{
+  cm->p_change = ewma(cm->p_change, changed ? 1.0 : 0.0);
+  if (changed) {
+    cm->body_bytes = ewma(cm->body_bytes, body_bytes);
+    cm->body_wrs = ewma(cm->body_wrs, body_wrs);
+  }
+}
+
+/**
+ * Decide whether the next round should READ the header first and the body
+ * only if needed, or the whole segment in one shot:
+ *
+ *   single-shot:  full_wrs * rtt + full * b
+ *   header-first: rtt + head * b + p_change * (body_wrs * rtt + body * b)
+ *
+ * Until both rtt and bandwidth are measured, and every COST_PROBE_ROUNDS
+ * single-shot rounds, we go header-first to (re)measure.
+ */
+int cost_model_header_first(struct read_cost *cm, uint32_t head_bytes, uint32_t full_bytes, int full_wrs)
+{
+  if (!cm->has_rtt || !cm->has_bw || ++cm->rounds_since_probe >= COST_PROBE_ROUNDS) {
+    cm->rounds_since_probe = 0;
+    return 1;
+  }
+
+  double single = full_wrs * cm->rtt_ns + full_bytes * cm->ns_per_byte;
+  double two_phase = cm->rtt_ns + head_bytes * cm->ns_per_byte +
+                     cm->p_change * (cm->body_wrs * cm->rtt_ns + cm->body_bytes * cm->ns_per_byte);
+
+  if (two_phase < single) {
+    cm->rounds_since_probe = 0;
+    return 1;
+  }
+  return 0;
+}
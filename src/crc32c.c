@@ -0,0 +1,156 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78   // reflected Castagnoli polynomial
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+static uint32_t table[256];
+
+static uint64_t load64(const uint8_t *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t crc_table(uint32_t crc, const uint8_t *p, size_t len)
+{
+  while (len--)
+    crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+  uint64_t c = crc;
+
+  for (; len >= 8; p += 8, len -= 8)
+    c = _mm_crc32_u64(c, load64(p));
+  crc = (uint32_t)c;
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+/* CRC32C_LANES buffers of len bytes, their CRCs (not inverted) in crc */
+__attribute__((target("sse4.2")))
+static void lanes_hw(const uint8_t *const *p, size_t len, uint32_t *crc)
+{
+  uint64_t a = crc[0], b = crc[1], c = crc[2];
+  size_t k;
+
+  for (k = 0; k + 8 <= len; k += 8) {
+    a = _mm_crc32_u64(a, load64(p[0] + k));
+    b = _mm_crc32_u64(b, load64(p[1] + k));
+    c = _mm_crc32_u64(c, load64(p[2] + k));
+  }
+  crc[0] = crc_hw((uint32_t)a, p[0] + k, len - k);
+  crc[1] = crc_hw((uint32_t)b, p[1] + k, len - k);
+  crc[2] = crc_hw((uint32_t)c, p[2] + k, len - k);
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+  for (; len >= 8; p += 8, len -= 8)
+    crc = __crc32cd(crc, load64(p));
+  while (len--)
+    crc = __crc32cb(crc, *p++);
+  return crc;
+}
+
+__attribute__((target("+crc")))
+static void lanes_hw(const uint8_t *const *p, size_t len, uint32_t *crc)
+{
+  uint32_t a = crc[0], b = crc[1], c = crc[2];
+  size_t k;
+
+  for (k = 0; k + 8 <= len; k += 8) {
+    a = __crc32cd(a, load64(p[0] + k));
+    b = __crc32cd(b, load64(p[1] + k));
+    c = __crc32cd(c, load64(p[2] + k));
+  }
+  crc[0] = crc_hw(a, p[0] + k, len - k);
+  crc[1] = crc_hw(b, p[1] + k, len - k);
+  crc[2] = crc_hw(c, p[2] + k, len - k);
+}
+#endif
+
+static crc_fn impl = NULL;
+static const char *impl_name = NULL;
+
+/* pick the implementation for this CPU, on first use */
+static crc_fn pick(void)
+{
+  crc_fn fn = crc_table;
+  const char *name = "table";
+
+  if (impl)
+    return impl;
+
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+    table[i] = c;
+  }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    fn = crc_hw;
+    name = "sse4.2";
+  }
+#elif defined(__aarch64__)
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    fn = crc_hw;
+    name = "armv8-crc";
+  }
+#endif
+  impl_name = name;
+  __atomic_store_n(&impl, fn, __ATOMIC_RELEASE);
+  return fn;
+}
+
+uint32_t crc32c(const void *buf, size_t len)
+{
+  return ~pick()(~0u, buf, len);
+}
+
+void crc32c_batch(const void *const *bufs, size_t len, int n, uint32_t *crcs)
+{
+  crc_fn fn = pick();
+  int i = 0;
+
+#if defined(__x86_64__) || defined(__aarch64__)
+  if (fn == crc_hw) {
+    for (; i + CRC32C_LANES <= n; i += CRC32C_LANES) {
+      uint32_t crc[CRC32C_LANES] = { ~0u, ~0u, ~0u };
+
+      lanes_hw((const uint8_t *const *)(bufs + i), len, crc);
+      for (int l = 0; l < CRC32C_LANES; l++)
+        crcs[i + l] = ~crc[l];
+    }
+  }
+#endif
+  for (; i < n; i++)
+    crcs[i] = ~fn(~0u, bufs[i], len);
+}
+
+const char * crc32c_impl(void)
+{
+  pick();
+  return impl_name;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "delta.h"
+#include "sched-profile.h"
+
+/**
+ * Throughput of the delta kernels of agent-nic: consecutive snapshots of n
+ * cumulative counters (thousands of pods times hundreds of counters), a given
+ * share of them moving every round and a few resetting, are diffed by each
+ * kernel this CPU runs. Each is checked against the scalar one, then timed;
+ * throughput is in snapshot bytes (8 per counter) per ns and per cycle.
+ * Build with optimizations for meaningful numbers, e.g.
+ * make CFLAGS="-O2 -g -Iincludes".
+ * usage: ./delta-bench [-n counters] [-r rounds] [-c changed %] [-g GHz]
+ */
+
+#define DELTA_BENCH_SNAPSHOTS 8
+
+static size_t num_counters = 256 * 1024;
+static int num_rounds = 1000;
+static int changed_pct = 30;
+static double ghz = 0;
+
+/* cycles per ns of the CPU: the TSC against the clock on x86, else the nominal frequency */
+static double cpu_ghz(void)
+{
+#if defined(__x86_64__)
+  uint64_t t0 = mono_ns(), c0 = __rdtsc();
+  usleep(50000);
+  return (double)(__rdtsc() - c0) / (double)(mono_ns() - t0);
+#else
+  unsigned long khz = 0;
+  FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+  if (f) {
+    if (fscanf(f, "%lu", &khz) != 1)
+      khz = 0;
+    fclose(f);
+  }
+  return khz / 1e6;
+#endif
+}
+
+/* next snapshot from prev: changed_pct % of the counters grow, one in 1000 of those restarts */
+static void next_snapshot(const uint64_t *prev, uint64_t *cur)
+{
+  for (size_t i = 0; i < num_counters; i++) {
+    int r = rand();
+
+    cur[i] = prev[i];
+    if (r % 100 < changed_pct)
+      cur[i] = (r / 100) % 1000 == 0 ? (uint64_t)(r % 7) : prev[i] + 1 + r % 4096;
+  }
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-n counters] [-r rounds] [-c changed %%] [-g GHz]\n", argv0);
+  fprintf(stderr, "  -n  counters per snapshot (default %zu)\n", num_counters);
+  fprintf(stderr, "  -r  rounds timed per kernel (default %d)\n", num_rounds);
+  fprintf(stderr, "  -c  share of the counters moving every round (default %d%%)\n", changed_pct);
+  fprintf(stderr, "  -g  cycles per ns, to report bytes per cycle (default measured, or nominal)\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  const struct delta_kernel *kernels;
+  uint64_t *snap[DELTA_BENCH_SNAPSHOTS];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:r:c:g:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_counters = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      num_rounds = atoi(optarg);
+      break;
+    case 'c':
+      changed_pct = atoi(optarg);
+      break;
+    case 'g':
+      ghz = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (num_counters == 0 || num_rounds <= 0 || changed_pct < 0 || changed_pct > 100)
+    usage(argv[0]);
+  if (ghz <= 0)
+    ghz = cpu_ghz();
+
+  size_t words = (num_counters + 63) / 64;
+  uint64_t *delta = malloc(num_counters * sizeof(uint64_t));
+  uint64_t *changed = malloc(words * sizeof(uint64_t));
+  uint64_t *reset = malloc(words * sizeof(uint64_t));
+  uint64_t *check = malloc(num_counters * sizeof(uint64_t));
+  uint64_t *check_changed = malloc(words * sizeof(uint64_t));
+  uint64_t *check_reset = malloc(words * sizeof(uint64_t));
+
+  srand(1);
+  for (int s = 0; s < DELTA_BENCH_SNAPSHOTS; s++) {
+    snap[s] = malloc(num_counters * sizeof(uint64_t));
+    if (s == 0) {
+      for (size_t i = 0; i < num_counters; i++)
+        snap[0][i] = (uint64_t)rand() << 16;
+    } else {
+      next_snapshot(snap[s - 1], snap[s]);
+    }
+  }
+
+  int num_kernels = delta_kernels(&kernels);
+  double scalar_ns = 0;
+
+  printf("%zu counters, %d%% moving per round, %d rounds, %.2f cycles/ns\n",
+        num_counters, changed_pct, num_rounds, ghz);
+  printf("%-8s %12s %10s %12s %8s\n", "kernel", "ns/round", "bytes/ns", "bytes/cycle", "speedup");
+
+  for (int k = 0; k < num_kernels; k++) {
+    /* same output as the scalar kernel, on every pair of snapshots */
+    for (int s = 1; s < DELTA_BENCH_SNAPSHOTS; s++) {
+      size_t n1 = kernels[0].fn(snap[s - 1], snap[s], num_counters, check, check_changed, check_reset);
+      size_t n2 = kernels[k].fn(snap[s - 1], snap[s], num_counters, delta, changed, reset);
+
+      if (n1 != n2 || memcmp(check, delta, num_counters * sizeof(uint64_t)) ||
+          memcmp(check_changed, changed, words * sizeof(uint64_t)) ||
+          memcmp(check_reset, reset, words * sizeof(uint64_t))) {
+        fprintf(stderr, "%s kernel differs from scalar\n", kernels[k].name);
+        return 1;
+      }
+    }
+
+    uint64_t start = mono_ns();
+    size_t moved = 0;
+    for (int r = 0; r < num_rounds; r++) {
+      int s = 1 + r % (DELTA_BENCH_SNAPSHOTS - 1);
+      moved += kernels[k].fn(snap[s - 1], snap[s], num_counters, delta, changed, reset);
+    }
+    double ns = (double)(mono_ns() - start) / num_rounds;
+    double bytes_ns = num_counters * sizeof(uint64_t) / ns;
+
+    if (k == 0)
+      scalar_ns = ns;
+    printf("%-8s %12.0f %10.2f %12.2f %7.2fx\n", kernels[k].name, ns, bytes_ns,
+          ghz > 0 ? bytes_ns / ghz : 0.0, scalar_ns / ns);
+    if (moved == 0)
+      printf("  (no counter moved)\n");
+  }
+  return 0;
+}
@@ -0,0 +1,169 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "delta.h"
+
+/* counters from..n-1, from a multiple of 64 */
+static size_t delta_tail(const uint64_t *prev, const uint64_t *cur, size_t from, size_t n,
+                         uint64_t *delta, uint64_t *changed, uint64_t *reset)
+{
+  size_t num_changed = 0;
+
+  for (size_t i = from; i < n; i += 64) {
+    uint64_t ch = 0, rs = 0;
+
+    for (size_t k = 0; k < 64 && i + k < n; k++) {
+      uint64_t p = prev[i + k], c = cur[i + k];
+      uint64_t r = p > c;
+
+      delta[i + k] = r ? c : c - p;
+      ch |= (uint64_t)(c != p) << k;
+      rs |= r << k;
+    }
+    changed[i / 64] = ch;
+    reset[i / 64] = rs;
+    num_changed += __builtin_popcountll(ch);
+  }
+  return num_changed;
+}
+
+static size_t delta_scalar(const uint64_t *prev, const uint64_t *cur, size_t n,
+                           uint64_t *delta, uint64_t *changed, uint64_t *reset)
+{
+  return delta_tail(prev, cur, 0, n, delta, changed, reset);
+}
+
+#if defined(__x86_64__)
+/* 4 counters per vector; AVX2 only compares signed, flipping the sign bits compares unsigned */
+__attribute__((target("avx2,popcnt")))
+static size_t delta_avx2(const uint64_t *prev, const uint64_t *cur, size_t n,
+                         uint64_t *delta, uint64_t *changed, uint64_t *reset)
+{
+  const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  size_t i, num_changed = 0;
+
+  for (i = 0; i + 64 <= n; i += 64) {
+    uint64_t ch = 0, rs = 0;
+
+    for (int k = 0; k < 64; k += 4) {
+      __m256i p = _mm256_loadu_si256((const __m256i *)(prev + i + k));
+      __m256i c = _mm256_loadu_si256((const __m256i *)(cur + i + k));
+      __m256i r = _mm256_cmpgt_epi64(_mm256_xor_si256(p, sign), _mm256_xor_si256(c, sign));
+      __m256i e = _mm256_cmpeq_epi64(p, c);
+
+      _mm256_storeu_si256((__m256i *)(delta + i + k), _mm256_blendv_epi8(_mm256_sub_epi64(c, p), c, r));
+      rs |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(r)) << k;
+      ch |= (uint64_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(e)) & 0xf) << k;
+    }
+    changed[i / 64] = ch;
+    reset[i / 64] = rs;
+    num_changed += __builtin_popcountll(ch);
+  }
+  return num_changed + delta_tail(prev, cur, i, n, delta, changed, reset);
+}
+#endif
+
+#if defined(__aarch64__)
+/* 2 counters per vector, 4 vectors per step; lanes of the compares are all ones or zero */
+static size_t delta_neon(const uint64_t *prev, const uint64_t *cur, size_t n,
+                         uint64_t *delta, uint64_t *changed, uint64_t *reset)
+{
+  size_t i, num_changed = 0;
+
+  for (i = 0; i + 64 <= n; i += 64) {
+    uint64_t ch = 0, rs = 0;
+
+    for (int k = 0; k < 64; k += 8) {
+      for (int v = 0; v < 8; v += 2) {
+        uint64x2_t p = vld1q_u64(prev + i + k + v);
+        uint64x2_t c = vld1q_u64(cur + i + k + v);
+        uint64x2_t r = vcgtq_u64(p, c);
+        uint64x2_t e = vceqq_u64(p, c);
+
+        vst1q_u64(delta + i + k + v, vbslq_u64(r, c, vsubq_u64(c, p)));
+        rs |= ((vgetq_lane_u64(r, 0) & 1) | (vgetq_lane_u64(r, 1) & 2)) << (k + v);
+        ch |= ((~vgetq_lane_u64(e, 0) & 1) | (~vgetq_lane_u64(e, 1) & 2)) << (k + v);
+      }
+    }
+    changed[i / 64] = ch;
+    reset[i / 64] = rs;
+    num_changed += __builtin_popcountll(ch);
+  }
+  return num_changed + delta_tail(prev, cur, i, n, delta, changed, reset);
+}
+#endif
+
+static struct delta_kernel available[3];
+static int num_available = 0;
+
+/* kernels this CPU runs, scalar first and the one delta_counters uses last */
+int delta_kernels(const struct delta_kernel **kernels)
+{
+  if (num_available == 0) {
+    int n = 0;
+
+    available[n++] = (struct delta_kernel){ "scalar", delta_scalar };
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+      available[n++] = (struct delta_kernel){ "avx2", delta_avx2 };
+#elif defined(__aarch64__)
+    available[n++] = (struct delta_kernel){ "neon", delta_neon };   // mandatory in ARMv8-A
+#endif
+    __atomic_store_n(&num_available, n, __ATOMIC_RELEASE);
+  }
+  *kernels = available;
+  return num_available;
+}
+
+size_t delta_counters(const uint64_t *prev, const uint64_t *cur, size_t n,
+                      uint64_t *delta, uint64_t *changed, uint64_t *reset)
+{
+  const struct delta_kernel *k;
+  int num = delta_kernels(&k);
+
+  return k[num - 1].fn(prev, cur, n, delta, changed, reset);
+}
+
+const char * delta_kernel_name(void)
+{
+  const struct delta_kernel *k;
+  int num = delta_kernels(&k);
+
+  return k[num - 1].name;
+}
+
+/**
+ * Map the counter slots of the directory in base, a copy of the segment up to
+ * the directory at least.
+ */
+void delta_map_build(const struct segment_layout *layout, const void *base, struct delta_map *map)
+{
+  const struct segment_dir *dir = segment_get_dir(layout, base);
+
+  memset(map, 0, sizeof(*map));
+  map->layout_hash = layout->hash;
+
+  for (uint32_t k = 0; dir && k < dir->num_slots && k < layout->max_slots; k++) {
+    const struct segment_slot *slot = &dir->slots[k];
+    struct delta_range *r = &map->ranges[map->num_ranges];
+
+    /* the directory is the pod's to write, bound the slot without wrapping */
+    if (!(slot->flags & SEGMENT_SLOT_COUNTERS) || slot->len > layout->data_len ||
+        slot->off > layout->data_len - slot->len || map->num_ranges == DELTA_MAX_RANGES)
+      continue;
+    r->off = layout->data_off + slot->off;
+    r->count = slot->len / sizeof(uint64_t);
+    r->first = map->num_counters;
+    r->mask_off = map->mask_words;
+    r->tier = slot->tier;
+    map->num_counters += r->count;
+    map->mask_words += (r->count + 63) / 64;
+    map->num_ranges++;
+  }
+}
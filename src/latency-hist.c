@@ -0,0 +1,68 @@
+#include "latency-hist.h"
+
+static int bucket_of(uint64_t ns)
+{
+  if (ns < LAT_HIST_SUB)
+    return (int)ns;
+
+  int e = 63 - __builtin_clzll(ns);   // ns in [2^e, 2^(e+1))
+  int b = (e - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB + (int)((ns >> (e - LAT_HIST_SUB_BITS)) & (LAT_HIST_SUB - 1));
+  return b < LAT_HIST_BUCKETS ? b : LAT_HIST_BUCKETS - 1;
+}
+
+/* smallest value of bucket b */
+static uint64_t bucket_low(int b)
+{
+  if (b < LAT_HIST_SUB)
+    return (uint64_t)b;
+
+  int e = b / LAT_HIST_SUB + LAT_HIST_SUB_BITS - 1;
+  return (uint64_t)(LAT_HIST_SUB + b % LAT_HIST_SUB) << (e - LAT_HIST_SUB_BITS);
+}
+
+void lat_hist_record(struct latency_hist *h, uint64_t ns)
+{
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* value below which a fraction q of the durations fall, the middle of its bucket */
+uint64_t lat_hist_percentile(const struct latency_hist *h, double q)
+{
+  uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  uint64_t rank = (uint64_t)(q * count), seen = 0;
+
+  for (int b = 0; b < LAT_HIST_BUCKETS; b++) {
+    seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    if (seen > rank)
+      return b < LAT_HIST_SUB ? bucket_low(b) : (bucket_low(b) + bucket_low(b + 1)) / 2;
+  }
+  return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+/* one line: count, mean and percentiles in us */
+void lat_hist_print(const struct latency_hist *h, const char *name, FILE *out)
+{
+  uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+  fprintf(out, "%-10s %10lu  mean %9.2f  p50 %9.2f  p90 %9.2f  p99 %9.2f  p99.9 %9.2f  max %9.2f us\n",
+          name, count, count ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e3 / count : 0.0,
+          lat_hist_percentile(h, 0.5) / 1e3, lat_hist_percentile(h, 0.9) / 1e3,
+          lat_hist_percentile(h, 0.99) / 1e3, lat_hist_percentile(h, 0.999) / 1e3,
+          __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3);
+}
+
+/* non-empty buckets as "<name> <low ns> <count>" lines, to plot or merge offline */
+void lat_hist_dump(const struct latency_hist *h, const char *name, FILE *out)
+{
+  for (int b = 0; b < LAT_HIST_BUCKETS; b++) {
+    uint64_t n = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    if (n)
+      fprintf(out, "%s %lu %lu\n", name, bucket_low(b), n);
+  }
+}
@@ -0,0 +1,83 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nic-stats.h"
+
+#define NIC_STATS_READ_TRIES 1000
+
+/**
+ * Create (or reset) the stats object called name and map it. It is left in
+ * place at exit, a viewer still shows the last state.
+ * Returns NULL if it cannot be created, agent-nic then runs without it.
+ */
+struct nic_stats * nic_stats_create(const char *name, uint64_t tick_ns)
+{
+  struct timespec now;
+  struct nic_stats *st;
+
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd == -1 || ftruncate(fd, sizeof(struct nic_stats)) == -1) {
+    perror("Error creating stats object");
+    if (fd != -1)
+      close(fd);
+    return NULL;
+  }
+  st = mmap(NULL, sizeof(struct nic_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (st == MAP_FAILED) {
+    perror("Error mapping stats object");
+    return NULL;
+  }
+
+  memset(st, 0, sizeof(*st));
+  clock_gettime(CLOCK_REALTIME, &now);
+  st->version = NIC_STATS_VERSION;
+  st->max_pods = NIC_STATS_MAX_PODS;
+  st->num_stages = NIC_STATS_STAGES;
+  st->start_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+  st->global.tick_ns = tick_ns;
+  __atomic_store_n(&st->magic, NIC_STATS_MAGIC, __ATOMIC_RELEASE);
+  return st;
+}
+
+/* map the stats object called name read-only, NULL if missing or of another version */
+const struct nic_stats * nic_stats_attach(const char *name)
+{
+  struct nic_stats *st;
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1)
+    return NULL;
+  st = mmap(NULL, sizeof(struct nic_stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (st == MAP_FAILED)
+    return NULL;
+  if (__atomic_load_n(&st->magic, __ATOMIC_ACQUIRE) != NIC_STATS_MAGIC || st->version != NIC_STATS_VERSION) {
+    munmap(st, sizeof(struct nic_stats));
+    return NULL;
+  }
+  return st;
+}
+
+/**
+ * Copy the len bytes of a section at src, bracketed by seq, to dst.
+ * Returns -1 if the writer kept it busy, dst is then torn.
+ */
+int nic_stats_read(const uint32_t *seq, void *dst, const void *src, size_t len)
+{
+  for (int t = 0; t < NIC_STATS_READ_TRIES; t++) {
+    uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+
+    if (before & 1)
+      continue;
+    memcpy(dst, src, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+      return 0;
+  }
+  return -1;
+}
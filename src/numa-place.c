@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "numa-place.h"
+
+#define MPOL_PREFERRED 1   // from linux/mempolicy.h, not installed everywhere
+#define NUMA_QUERY_PAGES 512
+
+static int cores[NUMA_MAX_CORES];
+static int num_cores = 0;
+static int next_core = 0;
+
+int numa_parse_policy(const char *name)
+{
+  if (strcmp(name, "none") == 0)
+    return NUMA_POLICY_NONE;
+  if (strcmp(name, "nic") == 0)
+    return NUMA_POLICY_NIC;
+  if (strcmp(name, "pod") == 0)
+    return NUMA_POLICY_POD;
+  return -1;
+}
+
+static int read_node(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  int node = -1;
+
+  if (f == NULL)
+    return -1;
+  if (fscanf(f, "%d", &node) != 1 || node >= NUMA_MAX_NODES)
+    node = -1;
+  fclose(f);
+  return node;
+}
+
+/* node the RNIC called ibdev is attached to */
+int numa_device_node(const char *ibdev)
+{
+  char path[256];
+
+  snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node", ibdev);
+  return read_node(path);
+}
+
+/* node of cpu, from the node<N> link in its sysfs directory */
+int numa_cpu_node(int cpu)
+{
+  char path[64];
+  struct dirent *e;
+  int node = -1;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+  while (node == -1 && (e = readdir(dir)) != NULL) {
+    if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9')
+      node = atoi(e->d_name + 4);
+  }
+  closedir(dir);
+  return node < NUMA_MAX_NODES ? node : -1;
+}
+
+/* node of the CPU process pid last ran on, field 39 of /proc/<pid>/stat */
+int numa_pid_node(uint32_t pid)
+{
+  char path[64], buf[1024];
+  int cpu = -1;
+
+  snprintf(path, sizeof(path), "/proc/%u/stat", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+
+  /* the command name may hold spaces, fields are counted from its closing parenthesis (field 2) */
+  char *p = strrchr(buf, ')');
+  for (int field = 2; p && field < 39; field++)
+    p = strchr(p + 1, ' ');
+  if (p)
+    cpu = atoi(p + 1);
+  return cpu >= 0 ? numa_cpu_node(cpu) : -1;
+}
+
+/**
+ * Place the pages of [addr, addr + len) on node from now on. For shared
+ * memory the policy belongs to the object, the pod faulting pages in through
+ * its own mapping gets them there too. The policy is preferred rather than
+ * strict: a full node spills over instead of failing the pod.
+ * Call before the pages are first touched, they are not migrated.
+ */
+int numa_bind(void *addr, size_t len, int node)
+{
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+
+  if (node < 0)
+    return 0;
+  mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+  if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, 0) == -1) {
+    perror("Error binding segments to NUMA node");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Add to pages[node] the pages of [addr, addr + len) resident on each node.
+ * Only pages mapped by the agent are found, which registered ones all are.
+ * Returns the number of pages found.
+ */
+int numa_count_pages(void *addr, size_t len, uint64_t *pages)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t num_pages = len / page_size;
+  void *batch[NUMA_QUERY_PAGES];
+  int status[NUMA_QUERY_PAGES];
+  int found = 0;
+
+  for (size_t i = 0; i < num_pages; i += NUMA_QUERY_PAGES) {
+    size_t n = num_pages - i < NUMA_QUERY_PAGES ? num_pages - i : NUMA_QUERY_PAGES;
+
+    for (size_t j = 0; j < n; j++)
+      batch[j] = (char *)addr + (i + j) * page_size;
+    /* no target nodes: only query where the pages are */
+    if (syscall(SYS_move_pages, 0, n, batch, NULL, status, 0) == -1)
+      return found;
+    for (size_t j = 0; j < n; j++) {
+      if (status[j] >= 0 && status[j] < NUMA_MAX_NODES) {
+        pages[status[j]]++;
+        found++;
+      }
+    }
+  }
+  return found;
+}
+
+/* parse a list of cores like "2,4-7", the next pollers are pinned on them */
+int numa_set_cores(const char *list)
+{
+  char *end;
+  int n = 0;
+
+  while (*list) {
+    long first = strtol(list, &end, 10), last = first;
+
+    if (end == list || first < 0)
+      return -1;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    if (last < first || last >= CPU_SETSIZE)
+      return -1;
+    for (long c = first; c <= last && n < NUMA_MAX_CORES; c++)
+      cores[n++] = (int)c;
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return -1;
+    list = end;
+  }
+  num_cores = n;
+  return 0;
+}
+
+/**
+ * Pin thread on the next configured core, round-robin.
+ * Returns the core, -1 if no cores are configured or pinning failed.
+ */
+int numa_pin_thread(pthread_t thread)
+{
+  cpu_set_t set;
+
+  if (num_cores == 0)
+    return -1;
+  int core = cores[__atomic_fetch_add(&next_core, 1, __ATOMIC_RELAXED) % num_cores];
+
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  if (pthread_setaffinity_np(thread, sizeof(set), &set)) {
+    fprintf(stderr, "Error pinning poller on core %d\n", core);
+    return -1;
+  }
+  return core;
+}
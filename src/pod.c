@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -15,6 +16,10 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <sys/un.h>
+
+#include "segment.h"
+#include "registration.h"
 
 #define Q_NAME    "shm"
 #define MAX_SIZE  1024
@@ -22,14 +27,51 @@
 #define SRV_FLAG  "-producer"
 #define MAX_LEN   256
 
-int produce_metrics(char* shm_name)
+static struct timespec registered;   // when we asked the agent for a segment
+
+/**
+ * Produce metrics in the segment of container part in shared memory fd,
+ * the segments of all the containers of the pod are back to back.
+ */
+int produce_metrics(int shm_fd, uint32_t part, const char *service)
 {
-    /* open the shared memory object */
-    int shm_fd = shm_open(shm_name, O_RDWR, 0666);
+    struct stat st;
+    if (fstat(shm_fd, &st) == -1) {
+        perror("Error reading shared memory object size");
+        exit(1);
+    }
     /* memory map the shared memory object */
-    void *ptr = mmap(0, MAX_SIZE, PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    void *ptr = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (ptr == MAP_FAILED) {
+        perror("Error mapping shared memory object");
+        exit(1);
+    }
+    uint32_t part_size = ((struct segment_header *)ptr)->size;
+    if (part_size == 0 || (uint64_t)(part + 1) * part_size > (uint64_t)st.st_size) {
+        fprintf(stderr, "No segment for container %u\n", part);
+        exit(1);
+    }
+
+    /* the agent has laid out the segment, metrics go in its data area */
+    struct segment seg;
+    if (segment_attach(&seg, (char *)ptr + (size_t)part * part_size)) {
+        fprintf(stderr, "Invalid segment header\n");
+        exit(1);
+    }
 
-    int i = 0, msg = 0;
+    /* name our metrics, so that agent-nic can be told to read only some of them,
+       tier 0 ones are read every round, slower moving ones at coarser resolution */
+    segment_set_service(&seg, service);
+    int counter_slot = segment_add_slot(&seg, "counter", 16, 0);
+    int requests_slot = segment_add_counters(&seg, "requests", 1, 0);
+    int errors_slot = segment_add_counters(&seg, "errors", 1, 1);
+    int queue_slot = segment_add_slot(&seg, "queue_depth", sizeof(uint64_t), 0);
+    int mem_slot = segment_add_slot(&seg, "mem_usage", sizeof(uint64_t), 1);
+    if (counter_slot != -1 && (requests_slot == -1 || errors_slot == -1 || queue_slot == -1 || mem_slot == -1))
+        fprintf(stderr, "Segment full, some metrics are not exported\n");
+    uint64_t requests = 0, errors = 0, queue_depth, mem_usage;
+
+    int i = 0, msg = 0, first_read_seen = 0;
     char buffer[MAX_SIZE];
     while (i < 500) 
     {
@@ -40,11 +82,34 @@ int produce_metrics(char* shm_name)
         printf("counter: %s\n", buffer);
         fflush(stdout);
         
-        /* write to the shared memory object */
-        int rc = sprintf(ptr, "%s", buffer);
-        if (rc < 0) {
-            perror("Error writing to shared memory segment");
-            exit(1);
+        /* write to the shared memory object (at the start of the data area without directory) */
+        if (counter_slot == -1) {
+            if (segment_write(&seg, 0, buffer, strlen(buffer) + 1))
+                perror("Error writing the counter");
+        } else {
+            requests += msg;
+            errors += (msg % 16 == 0);
+            queue_depth = msg % 32;
+            mem_usage = (uint64_t)(1 << 20) + msg * 4096;
+            /* slots we could not get are skipped, see above */
+            segment_write_slot(&seg, counter_slot, buffer, strlen(buffer) + 1);
+            if (requests_slot != -1)
+                segment_write_slot(&seg, requests_slot, &requests, sizeof(requests));
+            if (errors_slot != -1)
+                segment_write_slot(&seg, errors_slot, &errors, sizeof(errors));
+            if (queue_slot != -1)
+                segment_write_slot(&seg, queue_slot, &queue_depth, sizeof(queue_depth));
+            if (mem_slot != -1)
+                segment_write_slot(&seg, mem_slot, &mem_usage, sizeof(mem_usage));
+        }
+        segment_publish(&seg);
+
+        /* time to first sample: we published right away, the NIC tells us when it started reading */
+        uint64_t first_read = segment_first_read(&seg);
+        if (first_read && !first_read_seen) {
+            uint64_t t0 = (uint64_t)registered.tv_sec * 1000000000ULL + registered.tv_nsec;
+            printf("first READ by agent-nic %.3f ms after registration\n", ((double)first_read - t0) / 1.0e6);
+            first_read_seen = 1;
         }
 
         i=i+1;
@@ -52,11 +117,21 @@ int produce_metrics(char* shm_name)
     }
     memset(buffer, 0, MAX_SIZE);
     sprintf(buffer, M_EXIT);
-    sprintf(ptr, "%s", buffer);
+    if (counter_slot == -1) {
+        if (segment_write(&seg, 0, buffer, strlen(buffer) + 1))
+            perror("Error writing the counter");
+    } else
+        segment_write_slot(&seg, counter_slot, buffer, strlen(buffer) + 1);
+    segment_publish(&seg);
 
     return 0;
 }
 
+/**
+ * Register over TCP: the agent creates the segment as a named shm object and
+ * sends its name back. We open it and acknowledge, the agent then unlinks it,
+ * the segment lives on as long as one of us has it. Returns the fd.
+ */
 int get_shm_fd(const char* host, char *shm_name) {
     
     // Create a socket
@@ -109,19 +184,265 @@ int get_shm_fd(const char* host, char *shm_name) {
 
     recv(clientSocket, shm_name, MAX_LEN, 0);
     fprintf(stdout, "MicroView control plane assigned memory region: %s\n", shm_name);
+
+    /* open the shared memory object, then tell the agent it can unlink it */
+    int shm_fd = shm_open(shm_name, O_RDWR, 0666);
+    if (shm_fd == -1) {
+        perror("Error opening shared memory object");
+        exit(1);
+    }
+    char ack = 1;
+    send(clientSocket, &ack, sizeof(ack), 0);
     // Close the socket
     close(clientSocket);
     
-    return 0;
+    return shm_fd;
+}
+
+
+/**
+ * Receive len bytes at buf on sock, along with a file descriptor (SCM_RIGHTS).
+ * Returns the fd, -1 if none was sent.
+ */
+static int recv_fd(int sock, void *buf, size_t len)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    if (recvmsg(sock, &msg, MSG_WAITALL) != (ssize_t)len) {
+        perror("Error receiving segment");
+        exit(EXIT_FAILURE);
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/* send len bytes at buf on sock, along with file descriptor fd */
+static void send_fd(int sock, const void *buf, size_t len, int fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(sock, &msg, 0) == -1)
+        perror("Error passing segment");
+}
+
+
+/* prove to the agent on sock that we are container i of the pod, see registration_credential */
+static void send_credential(int sock, uint32_t i)
+{
+    struct registration_credential c = { .container = i };
+    struct iovec iov = { .iov_base = &c, .iov_len = sizeof(c) };
+    union {
+        char buf[CMSG_SPACE(sizeof(struct ucred))];
+        struct cmsghdr align;
+    } ctrl;
+    struct ucred cred = { .pid = getpid(), .uid = getuid(), .gid = getgid() };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_CREDENTIALS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(cred));
+    memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+    if (sendmsg(sock, &msg, 0) != sizeof(c))
+        perror("Error sending credential");
 }
 
+/* connect to the Unix socket of the agent at path */
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un addr;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("Error creating socket");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Error connecting to agent");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
 
+/**
+ * Register on the Unix socket of the agent connected on sock, for us and the
+ * other containers of the pod (num of them, we are the first): each sidecar,
+ * started with the socket and the end socks[i] of a socket pair, proves who
+ * it is in turn when we tell it to. The agent replies with the segments of
+ * all of them, already laid out, as a single file descriptor.
+ * Returns the fd of the segments.
+ */
+int register_unix(int sock, const int *socks, uint32_t num)
+{
+    struct registration_request req;
+    struct registration_reply reply;
+
+    memset(&req, 0, sizeof(req));
+    req.num_containers = num;
+    if (send(sock, &req, sizeof(req), 0) != sizeof(req)) {
+        perror("Error sending registration");
+        exit(EXIT_FAILURE);
+    }
+
+    /* one at a time, so that their messages do not interleave on the socket */
+    for (uint32_t i = 1; i < num; i++) {
+        char go = 1;
+        if (send(socks[i], &go, sizeof(go), 0) != sizeof(go) ||
+            recv(socks[i], &go, sizeof(go), MSG_WAITALL) != sizeof(go)) {
+            fprintf(stderr, "Sidecar %u did not register\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int fd = recv_fd(sock, &reply, sizeof(reply));
+    close(sock);
+
+    if (reply.status != 0) {
+        fprintf(stderr, "Agent could not register us: %s\n", strerror(reply.status));
+        exit(EXIT_FAILURE);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "Agent sent no segment\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("New POD, pid: %d (%u on the host), %u segments of %u bytes\n",
+           (uint32_t)getpid(), reply.pid, reply.num_parts, reply.size);
+    srand(reply.pid);
+    return fd;
+}
+
+/**
+ * Start the sidecars of the pod, containers 1..num-1, each with the end of
+ * a socket pair to prove its pid to the agent on sock when we register (see
+ * register_unix), then to get its segment from us.
+ */
+static void start_sidecars(uint32_t num, int sock, int *socks, const char *service)
+{
+    for (uint32_t i = 1; i < num; i++) {
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            perror("Error creating socket pair");
+            exit(EXIT_FAILURE);
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("Error starting sidecar");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            uint32_t part;
+            char go;
+
+            close(sv[0]);
+            if (recv(sv[1], &go, sizeof(go), MSG_WAITALL) != sizeof(go))
+                exit(EXIT_FAILURE);
+            send_credential(sock, i);
+            close(sock);
+            send(sv[1], &go, sizeof(go), 0);
+
+            int fd = recv_fd(sv[1], &part, sizeof(part));
+            if (fd == -1) {
+                fprintf(stderr, "Sidecar %u got no segment\n", i);
+                exit(EXIT_FAILURE);
+            }
+            close(sv[1]);
+            srand(getpid());
+            produce_metrics(fd, part, service);
+            exit(0);
+        }
+        close(sv[1]);
+        socks[i] = sv[0];
+    }
+}
+
+
+/**
+ * usage: ./pod [-c containers] <agent address | agent unix socket path> [service name]
+ */
 int main(int argc, char *argv[])
 {
-    // open TCP connection and ask for identifier
-    char shm_name[MAX_LEN];
-    memset(shm_name, 0, MAX_LEN);
-    get_shm_fd(argv[1], shm_name);
+    uint32_t num_containers = 1;
+    int shm_fd, opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        if (opt == 'c' && atoi(optarg) >= 1 && atoi(optarg) <= REGISTRATION_MAX_CONTAINERS) {
+            num_containers = (uint32_t)atoi(optarg);
+        } else {
+            fprintf(stderr, "-c takes 1 to %d containers\n", REGISTRATION_MAX_CONTAINERS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind < 1) {
+        fprintf(stderr, "usage: %s [-c containers] <agent address | agent socket path> [service name]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+    const char *service = argc > 2 ? argv[2] : "pod";
+
+    clock_gettime(CLOCK_REALTIME, &registered);
+    if (argv[1][0] == '/') {
+        // register on the unix socket, we get the segment itself, along with those of our sidecars
+        int socks[REGISTRATION_MAX_CONTAINERS];
+        int sock = connect_unix(argv[1]);
+
+        start_sidecars(num_containers, sock, socks, service);
+        shm_fd = register_unix(sock, socks, num_containers);
+        for (uint32_t i = 1; i < num_containers; i++) {
+            send_fd(socks[i], &i, sizeof(i), shm_fd);
+            close(socks[i]);
+        }
+    } else {
+        if (num_containers > 1) {
+            fprintf(stderr, "Sidecars register on the agent unix socket only\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open TCP connection and ask for identifier
+        char shm_name[MAX_LEN];
+        memset(shm_name, 0, MAX_LEN);
+        shm_fd = get_shm_fd(argv[1], shm_name);
+    }
     // start producing metrics writing on the queue
-    produce_metrics(shm_name);
+    produce_metrics(shm_fd, 0, service);
 }
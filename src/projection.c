@@ -0,0 +1,154 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "projection.h"
+
+static struct projection_rule rules[PROJECTION_MAX_RULES];
+static int num_rules = 0;
+static unsigned version = 0;
+static pthread_mutex_t rules_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * (Re)load projection rules from path, replacing the current ones.
+ * Connections pick up the new rules at their next round, see projection_version.
+ * Returns -1 if the file cannot be opened, the current rules are kept.
+ */
+int projection_load(const char *path)
+{
+  static struct projection_rule loaded[PROJECTION_MAX_RULES];
+  int n = 0;
+  char line[1024];
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror("Error opening projection file");
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f) && n < PROJECTION_MAX_RULES) {
+    char *save = NULL;
+    char *key = strtok_r(line, " \t\n", &save);
+    char *list = strtok_r(NULL, " \t\n", &save);
+
+    if (key == NULL || key[0] == '#' || list == NULL)
+      continue;
+
+    struct projection_rule *r = &loaded[n++];
+    memset(r, 0, sizeof(*r));
+    strncpy(r->key, key, SEGMENT_SERVICE_LEN - 1);
+
+    for (char *m = strtok_r(list, ",", &save); m && r->num_metrics < PROJECTION_MAX_METRICS;
+         m = strtok_r(NULL, ",", &save))
+      strncpy(r->metrics[r->num_metrics++], m, SEGMENT_NAME_LEN - 1);
+  }
+  fclose(f);
+
+  pthread_mutex_lock(&rules_mutex);
+  memcpy(rules, loaded, n * sizeof(struct projection_rule));
+  num_rules = n;
+  version++;
+  pthread_mutex_unlock(&rules_mutex);
+
+  printf("Loaded %d projection rules from %s\n", n, path);
+  return 0;
+}
+
+/* drop all the rules, every pod is read in full again */
+void projection_clear(void)
+{
+  pthread_mutex_lock(&rules_mutex);
+  num_rules = 0;
+  version++;
+  pthread_mutex_unlock(&rules_mutex);
+}
+
+unsigned projection_version(void)
+{
+  return __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+}
+
+static const struct projection_rule * lookup(uint32_t pid, const char *service)
+{
+  const struct projection_rule *by_service = NULL, *wildcard = NULL;
+
+  for (int i = 0; i < num_rules; i++) {
+    const char *key = rules[i].key;
+
+    if (isdigit((unsigned char)key[0])) {
+      if ((uint32_t)strtoul(key, NULL, 10) == pid)
+        return &rules[i];
+    } else if (strcmp(key, "*") == 0) {
+      wildcard = &rules[i];
+    } else if (service && strncmp(key, service, SEGMENT_SERVICE_LEN) == 0) {
+      by_service = &rules[i];
+    }
+  }
+  return by_service ? by_service : wildcard;
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+  const struct read_range *ra = a, *rb = b;
+  return (ra->off > rb->off) - (ra->off < rb->off);
+}
+
+static int selected_by(const struct projection_rule *rule, const struct segment_slot *slot)
+{
+  for (int m = 0; m < rule->num_metrics; m++) {
+    if (strncmp(slot->name, rule->metrics[m], SEGMENT_NAME_LEN) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Compile the projection of a pod into the ranges of its segment to READ at
+ * resolution tier max_tier, given a local copy of its header and directory.
+ * Adjacent slots are coalesced according to the gap of the plan.
+ * Returns 1 if the pod must be read through the plan, 0 if it must be read
+ * in full (no rule applies and no slot is left out by its tier).
+ */
+int projection_compile(const struct segment_layout *layout, const void *base, int max_tier,
+                       struct read_plan *plan)
+{
+  const struct segment_header *hdr = (const struct segment_header *)base;
+  const struct segment_dir *dir = segment_get_dir(layout, base);
+  struct read_range *selected;
+  int n = 0, restricted = 0;
+
+  read_plan_reset(plan);
+  selected = malloc((layout->max_slots + 1) * sizeof(struct read_range));
+
+  pthread_mutex_lock(&rules_mutex);
+  const struct projection_rule *rule = lookup(hdr->pid, dir ? dir->service : NULL);
+  if (rule)
+    restricted = 1;
+
+  for (uint32_t k = 0; dir && k < dir->num_slots && k < layout->max_slots; k++) {
+    const struct segment_slot *slot = &dir->slots[k];
+
+    if (rule && !selected_by(rule, slot))
+      continue;
+    if (slot->tier > max_tier) {
+      restricted = 1;
+      continue;
+    }
+    /* written by the pod, bound the slot without wrapping */
+    if (slot->len <= layout->data_len && slot->off <= layout->data_len - slot->len) {
+      selected[n].off = layout->data_off + slot->off;
+      selected[n].len = slot->len;
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&rules_mutex);
+
+  qsort(selected, n, sizeof(struct read_range), cmp_range);
+  for (int k = 0; k < n; k++)
+    read_plan_add(plan, selected[k].off, selected[k].len);
+  free(selected);
+
+  return restricted;
+}
@@ -1,26 +1,53 @@
 #include "rdma-agent.h"
+#include "numa-place.h"
 
 static int on_completion(struct ibv_wc *);
 static void * poll_cq(void *);
 static void build_context(struct ibv_context *verbs, int id);
 static void build_qp_attr(struct ibv_qp_init_attr *qp_attr, int id);
-static void register_memory(struct connection *conn, void* shm_ptr);
+static void register_memory(struct connection *conn, struct pod_region *region);
 static void destroy_connection(void *context);
 
-/* different connections use different contexts */
-static pthread_mutex_t nc_mutex = PTHREAD_MUTEX_INITIALIZER;
-extern int num_connections;
+/* different connections use different contexts, see connection_id_get */
 extern struct context *s_ctx[RDMA_MAX_CONNECTIONS];
 
 extern int block_size;
 
+/**
+ * Tear down the session of id before it was established, whatever step of
+ * the handshake it is at: no DISCONNECTED follows. The pod region passed as
+ * context stays with the caller.
+ */
+void abort_session(struct rdma_cm_id *id)
+{
+  if (id->qp)   // built once the address resolved, see build_connection
+    destroy_connection(id->context);
+  else
+    rdma_destroy_id(id);
+}
+
+/**
+ * The session of id failed before it was established: address or route
+ * resolution, or the agent-nic refused or never answered. We tear it down
+ * here, and the pod of the session only (the event loop serves all of
+ * them). Returns -1 for the caller to retry the pod.
+ */
+static int on_failure(struct rdma_cm_id *id, const char *what)
+{
+  fprintf(stderr, "RDMA session failed: %s\n", what);
+  abort_session(id);
+  return -1;
+}
+
 int on_addr_resolved(struct rdma_cm_id *id)
 {
   printf("address resolved.\n");
 
-  build_connection(id);
+  if (build_connection(id) == NULL)
+    return on_failure(id, "connection limit reached");
   
-  TEST_NZ(rdma_resolve_route(id, TIMEOUT_IN_MS));
+  if (rdma_resolve_route(id, TIMEOUT_IN_MS))
+    return on_failure(id, "rdma_resolve_route");
 
   return 0;
 }
@@ -39,7 +66,7 @@ int on_disconnect(struct rdma_cm_id *id)
   printf("disconnected.\n");
 
   destroy_connection(id->context);
-  /* exit event loop, we're the client here, the server will not disconnect instead */
+  /* the connection is gone, we're the client here, the server will not disconnect instead */
   return 1; 
 }
 
@@ -53,7 +80,11 @@ int on_event(struct rdma_cm_event *event)
     r = on_addr_resolved(event->id);
     break;
   case RDMA_CM_EVENT_ADDR_ERROR:
-    die("Address resolution (rdma_resolve_addr) failed.");
+  case RDMA_CM_EVENT_ROUTE_ERROR:
+  case RDMA_CM_EVENT_CONNECT_ERROR:
+  case RDMA_CM_EVENT_UNREACHABLE:
+  case RDMA_CM_EVENT_REJECTED:
+    r = on_failure(event->id, rdma_event_str(event->event));
     break;
   case RDMA_CM_EVENT_ROUTE_RESOLVED:
     r = on_route_resolved(event->id);
@@ -65,8 +96,7 @@ int on_event(struct rdma_cm_event *event)
     r = on_disconnect(event->id);
     break;
   default:
-    fprintf(stderr, "on_event: %d\n", event->event);
-    die("on_event: unknown event.");
+    fprintf(stderr, "on_event: ignoring %s\n", rdma_event_str(event->event));
     break;
   }
   
@@ -80,7 +110,8 @@ int on_route_resolved(struct rdma_cm_id *id)
   printf("route resolved.\n");
   build_params(&cm_params);
   
-  TEST_NZ(rdma_connect(id, &cm_params));
+  if (rdma_connect(id, &cm_params))
+    return on_failure(id, "rdma_connect");
   
   return 0;
 }
@@ -93,9 +124,9 @@ struct connection* build_connection(struct rdma_cm_id *id)
   struct connection *conn;
   struct ibv_qp_init_attr qp_attr;
 
-  pthread_mutex_lock(&nc_mutex);
-  int conn_id = num_connections++;  // make copy of connection id
-  pthread_mutex_unlock(&nc_mutex);
+  int conn_id = connection_id_get();
+  if (conn_id == -1)
+    return NULL;
 
   build_context(id->verbs, conn_id);
   build_qp_attr(&qp_attr, conn_id);
@@ -104,7 +135,7 @@ struct connection* build_connection(struct rdma_cm_id *id)
   TEST_NZ(rdma_create_qp(id, s_ctx[conn_id]->pd, &qp_attr));
 
   // we use the context to pass memory region to map
-  void *local_mr = id->context;
+  struct pod_region *local_mr = id->context;
   
   id->context = conn = (struct connection *)malloc(sizeof(struct connection));
 
@@ -126,28 +157,27 @@ struct connection* build_connection(struct rdma_cm_id *id)
 
 void build_context(struct ibv_context *verbs, int conn_id)
 {
-  if (s_ctx[conn_id]) {
-    if (s_ctx[conn_id]->ctx != verbs)
-      die("context already in use!");
-
-    // TODO understand the logic here
-    printf("[WARNING]: context already in use\n");
-    return;
-  }
-
+  /* each connection has its own CQ and poller on the device chosen for it,
+     see connect_pod in agent.c; both go with the connection, its id is then
+     reused, see destroy_connection */
   s_ctx[conn_id] = (struct context *)malloc(sizeof(struct context));
 
   s_ctx[conn_id]->ctx = verbs;  // verbs are associated with rdma_cm_id
+  s_ctx[conn_id]->wr_hwm = 0;
+  s_ctx[conn_id]->cq_hwm = 0;
 
-  TEST_Z(s_ctx[conn_id]->pd = ibv_alloc_pd(s_ctx[conn_id]->ctx));
+  s_ctx[conn_id]->pd = device_pd(verbs);
   TEST_Z(s_ctx[conn_id]->comp_channel = ibv_create_comp_channel(s_ctx[conn_id]->ctx));
-  TEST_Z(s_ctx[conn_id]->cq = ibv_create_cq(s_ctx[conn_id]->ctx, 10, NULL, s_ctx[conn_id]->comp_channel, 0)); /* cqe=10 is arbitrary */
+  /* the host only exchanges control messages, READs are served by the RNIC */
+  struct queue_depths qd;
+  queue_depths(0, 0, 1, &qd);
+  TEST_Z(s_ctx[conn_id]->cq = ibv_create_cq(s_ctx[conn_id]->ctx, qd.cqe, NULL, s_ctx[conn_id]->comp_channel, 0));
   TEST_NZ(ibv_req_notify_cq(s_ctx[conn_id]->cq, 0));
 
   int *i = malloc(sizeof(int)); // thread identifier
   *i = conn_id;
   TEST_NZ(pthread_create(&s_ctx[conn_id]->cq_poller_thread, NULL, poll_cq, (int*)i));
-  pthread_detach(s_ctx[conn_id]->cq_poller_thread); // it will terminate by its own
+  numa_pin_thread(s_ctx[conn_id]->cq_poller_thread);
 
 }
 
@@ -159,8 +189,10 @@ void build_qp_attr(struct ibv_qp_init_attr *qp_attr, int conn_id)
   qp_attr->recv_cq = s_ctx[conn_id]->cq;
   qp_attr->qp_type = IBV_QPT_RC;
 
-  qp_attr->cap.max_send_wr = 10;
-  qp_attr->cap.max_recv_wr = 10;
+  struct queue_depths qd;
+  queue_depths(0, 0, 1, &qd);
+  qp_attr->cap.max_send_wr = qd.send_wr;
+  qp_attr->cap.max_recv_wr = qd.recv_wr;
   qp_attr->cap.max_send_sge = 1;
   qp_attr->cap.max_recv_sge = 1;
 }
@@ -200,6 +232,8 @@ int on_completion(struct ibv_wc *wc)
 
   struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
 
+  if (wc->status == IBV_WC_WR_FLUSH_ERR)
+    return 1;   // torn down, see destroy_connection
   if (wc->status != IBV_WC_SUCCESS) {
     //die("on_completion: status is not IBV_WC_SUCCESS.");
     fprintf(stderr, "on_completion: status is not IBV_WC_SUCCESS.\n");
@@ -236,9 +270,9 @@ int on_completion(struct ibv_wc *wc)
 /**
  * Map shared memory region to RDMA memory region.
  * It assign the pointer in the rdma connection data structure to the shared memory region
- * pointer.
+ * pointer. The segments of all the containers of the pod are a single memory region.
  */
-void register_memory(struct connection *conn, void* mr)
+void register_memory(struct connection *conn, struct pod_region *region)
 {
   /* the agent side uses shared memory region to be mapped as 
      RDMA memory region
@@ -246,7 +280,9 @@ void register_memory(struct connection *conn, void* mr)
   conn->send_msg = malloc(sizeof(struct message));
   conn->recv_msg = malloc(sizeof(struct message));
  
-  conn->rdma_remote_region = mr;
+  conn->rdma_remote_region = region->base;
+  conn->num_parts = region->num_parts;
+  struct ibv_pd *pd = s_ctx[conn->logical_id]->pd;
   
   TEST_Z(conn->send_mr = ibv_reg_mr(
     s_ctx[conn->logical_id]->pd, 
@@ -260,27 +296,42 @@ void register_memory(struct connection *conn, void* mr)
     sizeof(struct message), 
     IBV_ACCESS_LOCAL_WRITE));
 
-  TEST_Z(conn->rdma_remote_mr = ibv_reg_mr(
-    s_ctx[conn->logical_id]->pd, 
-    conn->rdma_remote_region, 
-    block_size,
-    IBV_ACCESS_REMOTE_READ));
+  /* remote write is needed by agent-nic to acknowledge generations in the
+     segment control line (see segment.h). The region keeps its MR across
+     sessions through the same device, e.g. reconnections and recycling */
+  if (region->mr && region->mr->pd != pd) {
+    ibv_dereg_mr(region->mr);
+    region->mr = NULL;
+  }
+  if (region->mr == NULL) {
+    TEST_Z(region->mr = ibv_reg_mr(
+      pd, 
+      conn->rdma_remote_region, 
+      region->size,
+      IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE));
+  }
+  conn->rdma_remote_mr = region->mr;
 }
 
 
 void destroy_connection(void *context)
 {
   struct connection *conn = (struct connection *)context;
+  int i = conn->logical_id;
 
+  /* a receive is always posted, flushing it ends the poller */
+  flush_qp(conn);
+  pthread_join(s_ctx[i]->cq_poller_thread, NULL);
   rdma_destroy_qp(conn->id);
 
   ibv_dereg_mr(conn->send_mr);
   ibv_dereg_mr(conn->recv_mr);
-  ibv_dereg_mr(conn->rdma_remote_mr);
+  /* the remote MR belongs to the pod region */
 
   free(conn->send_msg);
   free(conn->recv_msg);
 
+  destroy_context(i);
   rdma_destroy_id(conn->id);
 
   free(conn);
@@ -5,9 +5,17 @@ static void send_message(struct connection *conn);
 /* global variable visibile outside of the module */
 struct context *s_ctx[RDMA_MAX_CONNECTIONS];
 uint32_t block_size;
-int num_connections = 0;
+int num_connections = 0;   // ids in use
 int num_mr;
 
+/* connection ids in use, an id is reused once its connection is destroyed */
+static int id_used[RDMA_MAX_CONNECTIONS];
+static pthread_mutex_t ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct device devices[RDMA_MAX_DEVICES];
+static int num_devices = 0;
+static pthread_mutex_t devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 void die(const char *reason)
 {
   perror(reason);
@@ -31,11 +39,150 @@ void * get_local_message_region(void *context)
     return ((struct connection *)context)->rdma_remote_region;
 }
 
-char * get_peer_message_region(struct connection *conn)
+char * get_peer_message_region(struct connection *conn, int part)
 {
   // TODO in this case we assume we read always from the same remote memory region
   // (should get many rkeys for reading from different regions)
-  return conn->rdma_local_region[0];  
+  // metrics of container part start after its segment header, once we learned the layout
+  // (all the parts share it)
+  return conn->rdma_local_region[0] + (size_t)part * block_size +
+         (conn->first_read_ns ? conn->layout.data_off : 0);
+}
+
+/**
+ * Protection domain of the device of verbs, allocated by the first connection
+ * through the device.
+ */
+struct ibv_pd * device_pd(struct ibv_context *verbs)
+{
+  struct ibv_pd *pd = NULL;
+
+  pthread_mutex_lock(&devices_mutex);
+  for (int i = 0; i < num_devices && !pd; i++) {
+    if (devices[i].verbs == verbs)
+      pd = devices[i].pd;
+  }
+  if (pd == NULL) {
+    if (num_devices == RDMA_MAX_DEVICES)
+      die("Device limit reached\n");
+    TEST_Z(pd = ibv_alloc_pd(verbs));
+    devices[num_devices].verbs = verbs;
+    devices[num_devices].pd = pd;
+    num_devices++;
+    printf("using RDMA device %s\n", ibv_get_device_name(verbs->device));
+  }
+  pthread_mutex_unlock(&devices_mutex);
+
+  return pd;
+}
+
+/**
+ * Lowest connection id free, for the context of a new connection and its
+ * entries in the per connection tables. Returns -1 if all
+ * RDMA_MAX_CONNECTIONS are in use.
+ */
+int connection_id_get(void)
+{
+  int id = -1;
+
+  pthread_mutex_lock(&ids_mutex);
+  for (int i = 0; i < RDMA_MAX_CONNECTIONS && id == -1; i++) {
+    if (!id_used[i])
+      id = i;
+  }
+  if (id != -1) {
+    id_used[id] = 1;
+    num_connections++;
+  }
+  pthread_mutex_unlock(&ids_mutex);
+  return id;
+}
+
+void connection_id_put(int id)
+{
+  pthread_mutex_lock(&ids_mutex);
+  id_used[id] = 0;
+  num_connections--;
+  pthread_mutex_unlock(&ids_mutex);
+}
+
+/* move the QP of conn to the error state: its WRs complete flushed, which wakes the poller */
+void flush_qp(struct connection *conn)
+{
+  struct ibv_qp_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_ERR;
+  if (ibv_modify_qp(conn->qp, &attr, IBV_QP_STATE))
+    perror("ibv_modify_qp");
+}
+
+/**
+ * Tear down the context of connection id, once its poller was joined and its
+ * QP destroyed: destroy the CQ and its channel, and free the id.
+ */
+void destroy_context(int id)
+{
+  struct context *ctx = s_ctx[id];
+
+  TEST_NZ(ibv_destroy_cq(ctx->cq));
+  TEST_NZ(ibv_destroy_comp_channel(ctx->comp_channel));
+  free(ctx);
+  s_ctx[id] = NULL;
+  connection_id_put(id);
+}
+
+void queue_depths(int pipeline, int wrs_per_round, int conns_per_cq, struct queue_depths *qd)
+{
+  qd->send_wr = pipeline * wrs_per_round + RDMA_CONTROL_MSGS;
+  qd->recv_wr = RDMA_CONTROL_MSGS;
+  qd->cqe = conns_per_cq * (qd->send_wr + qd->recv_wr);
+}
+
+/**
+ * About to have entries completions outstanding on the CQ of ctx: record the
+ * most reserved and, if it gets close to the size of the CQ, grow the CQ to
+ * twice as much before it can overflow. How full the CQ actually gets is
+ * measured by the poller (cq_hwm, cq_recent); once neither stayed above a
+ * quarter of the CQ for CQ_SHRINK_POSTS posts, the CQ shrinks back, to no
+ * less than it was created with.
+ * Returns how many completions may be outstanding: entries, or fewer if the
+ * device would not grow the CQ, the caller then posts in batches.
+ */
+int cq_reserve(struct context *ctx, int entries)
+{
+  if (entries > ctx->wr_hwm)
+    ctx->wr_hwm = entries;
+  if (entries > ctx->wr_recent)
+    ctx->wr_recent = entries;
+
+  if (++ctx->cq_posts == CQ_SHRINK_POSTS) {
+    int old_cqe = ctx->cq->cqe;
+    int cqe = 2 * ctx->wr_recent > ctx->cqe_min ? 2 * ctx->wr_recent : ctx->cqe_min;
+
+    if (cqe < old_cqe && ctx->wr_recent < CQ_LOW_WATERMARK(old_cqe) &&
+        ctx->cq_recent < CQ_LOW_WATERMARK(old_cqe) && ibv_resize_cq(ctx->cq, cqe) == 0)
+      printf("shrunk CQ from %d to %d entries, at most %d outstanding lately\n", old_cqe, ctx->cq->cqe, ctx->wr_recent);
+    ctx->cq_posts = 0;
+    ctx->wr_recent = 0;
+    ctx->cq_recent = 0;
+  }
+
+  if (entries <= CQ_HIGH_WATERMARK(ctx->cq->cqe))
+    return entries;
+
+  int old_cqe = ctx->cq->cqe;
+  if (ctx->cqe_max == 0 || 2 * entries < ctx->cqe_max) {
+    int err = ibv_resize_cq(ctx->cq, 2 * entries);
+    if (err == 0) {
+      printf("resized CQ from %d to %d entries, %d outstanding\n", old_cqe, ctx->cq->cqe, entries);
+      return entries;
+    }
+    ctx->cqe_max = 2 * entries;
+    fprintf(stderr, "could not resize CQ from %d to %d entries (%s), posting in batches\n",
+            old_cqe, 2 * entries, strerror(err));
+  }
+  return CQ_HIGH_WATERMARK(old_cqe);
 }
 
 void on_connect(void *context)
@@ -90,6 +237,7 @@ void send_mr(void *context)
 
   conn->send_msg->type = MSG_MR;
   memcpy(&conn->send_msg->data.mr, conn->rdma_remote_mr, sizeof(struct ibv_mr));
+  conn->send_msg->num_parts = conn->num_parts;
   printf("Sending rkey. \n");
   send_message(conn);
 }
@@ -0,0 +1,210 @@
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rdma-ports.h"
+#include "numa-place.h"
+
+static struct rdma_port ports[RDMA_MAX_PORTS];
+static int num_ports = 0;
+static pthread_mutex_t ports_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* network interface of a port: its RoCE netdev, else the first netdev of the device (IPoIB) */
+static int port_ifname(struct ibv_context *verbs, uint8_t port_num, char *ifname)
+{
+  char path[256];
+  FILE *f;
+  int ok = 0;
+
+  snprintf(path, sizeof(path), "/sys/class/infiniband/%s/ports/%u/gid_attrs/ndevs/0",
+           ibv_get_device_name(verbs->device), port_num);
+  f = fopen(path, "r");
+  if (f) {
+    ok = fscanf(f, "%15s", ifname) == 1;
+    fclose(f);
+    return ok ? 0 : -1;
+  }
+
+  snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/net", ibv_get_device_name(verbs->device));
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+  for (struct dirent *e = readdir(dir); e && !ok; e = readdir(dir)) {
+    if (e->d_name[0] != '.') {
+      strncpy(ifname, e->d_name, IF_NAMESIZE - 1);
+      ifname[IF_NAMESIZE - 1] = '\0';
+      ok = 1;
+    }
+  }
+  closedir(dir);
+  return ok ? 0 : -1;
+}
+
+static void port_addrs(struct rdma_port *p, struct ifaddrs *ifa)
+{
+  for (; ifa; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL || strcmp(ifa->ifa_name, p->ifname) != 0)
+      continue;
+    if (ifa->ifa_addr->sa_family == AF_INET && !p->has_addr4) {
+      memcpy(&p->addr4, ifa->ifa_addr, sizeof(p->addr4));
+      p->has_addr4 = 1;
+    } else if (ifa->ifa_addr->sa_family == AF_INET6 && !p->has_addr6) {
+      memcpy(&p->addr6, ifa->ifa_addr, sizeof(p->addr6));
+      p->has_addr6 = 1;
+    }
+  }
+}
+
+static int port_active(struct rdma_port *p)
+{
+  struct ibv_port_attr attr;
+
+  if (ibv_query_port(p->verbs, p->port_num, &attr))
+    return 0;
+  return attr.state == IBV_PORT_ACTIVE;
+}
+
+/**
+ * Enumerate the ports of all the RNICs of the host.
+ * Returns the number of ports, connections are routed by rdma_cm if 0.
+ */
+int rdma_ports_init(void)
+{
+  struct ibv_context **devs;
+  struct ifaddrs *ifa = NULL;
+  int num_devs = 0;
+
+  devs = rdma_get_devices(&num_devs);
+  if (devs == NULL)
+    return 0;
+  if (getifaddrs(&ifa))
+    perror("Error getting interface addresses");
+
+  pthread_mutex_lock(&ports_mutex);
+  for (int d = 0; d < num_devs; d++) {
+    struct ibv_device_attr dev_attr;
+
+    if (ibv_query_device(devs[d], &dev_attr))
+      continue;
+
+    for (uint8_t n = 1; n <= dev_attr.phys_port_cnt && num_ports < RDMA_MAX_PORTS; n++) {
+      struct rdma_port *p = &ports[num_ports];
+
+      memset(p, 0, sizeof(*p));
+      p->verbs = devs[d];
+      p->port_num = n;
+      if (port_ifname(devs[d], n, p->ifname) == 0)
+        port_addrs(p, ifa);
+      p->active = port_active(p);
+      p->node = numa_device_node(ibv_get_device_name(devs[d]->device));
+
+      printf("RDMA port %s/%u (%s): %s%s, NUMA node %d\n", ibv_get_device_name(devs[d]->device), n,
+             p->ifname[0] ? p->ifname : "no netdev", p->active ? "active" : "down",
+             p->has_addr4 || p->has_addr6 ? "" : ", no address", p->node);
+      num_ports++;
+    }
+  }
+  pthread_mutex_unlock(&ports_mutex);
+
+  if (ifa)
+    freeifaddrs(ifa);
+  /* contexts stay open, rdma_cm uses the same ones */
+  return num_ports;
+}
+
+/**
+ * Least loaded active port with an address of family, which gets one more pod.
+ * Ports of the RNICs on NUMA node come first, where the segments of the pod
+ * are, unless node is -1 or none of them is usable.
+ * Returns -1 if there is none.
+ */
+int rdma_ports_pick(int family, int node)
+{
+  int best = -1;
+
+  pthread_mutex_lock(&ports_mutex);
+  for (int i = 0; i < num_ports; i++) {
+    struct rdma_port *p = &ports[i];
+    int has_addr = family == AF_INET6 ? p->has_addr6 : p->has_addr4;
+    int local = node == -1 || p->node == node;
+    int best_local = best != -1 && (node == -1 || ports[best].node == node);
+
+    if (!p->active || !has_addr || (best_local && !local))
+      continue;
+    if (best == -1 || (local && !best_local) || p->load < ports[best].load)
+      best = i;
+  }
+  if (best != -1)
+    ports[best].load++;
+  pthread_mutex_unlock(&ports_mutex);
+
+  return best;
+}
+
+/* NUMA node of the least loaded active port, where the segments of a new pod go, -1 if unknown */
+int rdma_ports_node(void)
+{
+  int best = -1;
+
+  pthread_mutex_lock(&ports_mutex);
+  for (int i = 0; i < num_ports; i++) {
+    if (ports[i].active && (best == -1 || ports[i].load < ports[best].load))
+      best = i;
+  }
+  pthread_mutex_unlock(&ports_mutex);
+
+  return best == -1 ? -1 : ports[best].node;
+}
+
+int rdma_port_node(int p)
+{
+  return p < 0 ? -1 : ports[p].node;
+}
+
+void rdma_ports_release(int p)
+{
+  if (p < 0)
+    return;
+  pthread_mutex_lock(&ports_mutex);
+  ports[p].load--;
+  pthread_mutex_unlock(&ports_mutex);
+}
+
+/* source address to bind connections through port p to, NULL to let rdma_cm route */
+struct sockaddr * rdma_port_addr(int p, int family)
+{
+  if (p < 0)
+    return NULL;
+  return family == AF_INET6 ? (struct sockaddr *)&ports[p].addr6 : (struct sockaddr *)&ports[p].addr4;
+}
+
+/**
+ * Query the state of every port, setting down[i] if port i went down since
+ * the last refresh. Returns how many did.
+ */
+int rdma_ports_refresh(int *down)
+{
+  int n = 0;
+
+  pthread_mutex_lock(&ports_mutex);
+  for (int i = 0; i < num_ports; i++) {
+    int active = port_active(&ports[i]);
+
+    down[i] = ports[i].active && !active;
+    n += down[i];
+    if (active != ports[i].active)
+      printf("RDMA port %s/%u is %s\n", ibv_get_device_name(ports[i].verbs->device),
+             ports[i].port_num, active ? "up" : "down");
+    ports[i].active = active;
+  }
+  pthread_mutex_unlock(&ports_mutex);
+
+  return n;
+}
+
+const char * rdma_port_name(int p)
+{
+  return p < 0 ? "default" : ports[p].ifname;
+}
@@ -0,0 +1,110 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "read-batch.h"
+
+#define EWMA_ALPHA 0.125
+
+static struct read_batch_class classes[READ_BATCH_CLASSES];
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int size_class(uint32_t bytes)
+{
+  int c = 0;
+
+  while (bytes > 1 && c < READ_BATCH_CLASSES - 1) {
+    bytes >>= 1;
+    c++;
+  }
+  return c;
+}
+
+/**
+ * Split factor for the READs of a round of bytes, among those up to
+ * max_split that the round can post: each candidate is measured once, then we
+ * stick with the fastest one except every READ_BATCH_PROBE_ROUNDS rounds, when
+ * we try the others in turn to follow changes in NIC load. Callers post the
+ * factor returned, so that every factor explored gets its sample.
+ */
+int read_batch_split(uint32_t bytes, int max_split)
+{
+  struct read_batch_class *bc = &classes[size_class(bytes)];
+  int feasible = 1, s = -1;
+
+  while (feasible < READ_BATCH_SPLITS && (1 << feasible) <= max_split)
+    feasible++;
+
+  pthread_mutex_lock(&batch_mutex);
+  for (int k = 0; k < feasible && s == -1; k++) {
+    if (bc->samples[k] == 0)
+      s = k;
+  }
+
+  if (s == -1) {
+    /* the best of the class may not fit this round, then the best that does */
+    s = bc->best;
+    if (s >= feasible) {
+      s = 0;
+      for (int k = 1; k < feasible; k++) {
+        if (bc->rate[k] > bc->rate[s])
+          s = k;
+      }
+    }
+    if (++bc->rounds_since_probe >= READ_BATCH_PROBE_ROUNDS && feasible > 1) {
+      bc->rounds_since_probe = 0;
+      bc->next_probe = (bc->next_probe + 1) % feasible;
+      if (bc->next_probe == s)
+        bc->next_probe = (bc->next_probe + 1) % feasible;
+      s = bc->next_probe;
+    }
+  }
+  pthread_mutex_unlock(&batch_mutex);
+
+  return 1 << s;
+}
+
+/* a round of bytes, split by split, completed in t_ns */
+void read_batch_sample(uint32_t bytes, int split, double t_ns)
+{
+  struct read_batch_class *bc = &classes[size_class(bytes)];
+  int s = 0;
+
+  if (t_ns <= 0)
+    return;
+  while ((1 << s) < split && s < READ_BATCH_SPLITS - 1)
+    s++;
+
+  pthread_mutex_lock(&batch_mutex);
+  double rate = bytes / t_ns;
+  bc->rate[s] = bc->samples[s] ? bc->rate[s] + EWMA_ALPHA * (rate - bc->rate[s]) : rate;
+  bc->samples[s]++;
+
+  int best = bc->best;
+  for (int k = 0; k < READ_BATCH_SPLITS; k++) {
+    if (bc->samples[k] && bc->rate[k] > bc->rate[best])
+      best = k;
+  }
+  if (bc->samples[best] && best != bc->best) {
+    printf("READ batching: rounds of 2^%d bytes now split by %d, %.1f MB/s\n",
+          size_class(bytes), 1 << best, bc->rate[best] * 1.0e3);
+    bc->best = best;
+  }
+  pthread_mutex_unlock(&batch_mutex);
+}
+
+/* print the throughput of every split factor of the size classes seen so far */
+void read_batch_report(void)
+{
+  pthread_mutex_lock(&batch_mutex);
+  for (int c = 0; c < READ_BATCH_CLASSES; c++) {
+    struct read_batch_class *bc = &classes[c];
+
+    if (bc->samples[bc->best] == 0)
+      continue;
+    printf("READ batching: rounds of 2^%d bytes, split by %d:", c, 1 << bc->best);
+    for (int k = 0; k < READ_BATCH_SPLITS; k++)
+      printf(" x%d %.1f MB/s (%d)", 1 << k, bc->rate[k] * 1.0e3, bc->samples[k]);
+    printf("\n");
+  }
+  pthread_mutex_unlock(&batch_mutex);
+}
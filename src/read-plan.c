@@ -0,0 +1,117 @@
+#include <string.h>
+
+#include "read-plan.h"
+
+/* merge range i with range i+1, covering the gap between them */
+static void merge_next(struct read_plan *plan, int i)
+{
+  struct read_range *a = &plan->ranges[i];
+  struct read_range *b = &plan->ranges[i + 1];
+
+  plan->bytes += b->off - (a->off + a->len);
+  a->len = b->off + b->len - a->off;
+
+  memmove(b, b + 1, (plan->num_ranges - i - 2) * sizeof(struct read_range));
+  plan->num_ranges--;
+}
+
+void read_plan_init(struct read_plan *plan, uint32_t gap)
+{
+  plan->gap = gap;
+  read_plan_reset(plan);
+}
+
+/* empty the plan, keeping its gap */
+void read_plan_reset(struct read_plan *plan)
+{
+  plan->num_ranges = 0;
+  plan->bytes = 0;
+}
+
+/**
+ * Append a range to the plan. Ranges must be added in increasing offset order,
+ * a range within gap bytes of (or overlapping) the last one is merged into it.
+ * When the plan is full, the pair of ranges separated by the smallest gap is
+ * merged to make room, i.e., we read a few more bytes rather than post more WRs.
+ */
+void read_plan_add(struct read_plan *plan, uint32_t off, uint32_t len)
+{
+  if (len == 0)
+    return;
+
+  if (plan->num_ranges > 0) {
+    struct read_range *last = &plan->ranges[plan->num_ranges - 1];
+
+    if (off <= last->off + last->len + plan->gap) {
+      uint32_t end = off + len > last->off + last->len ? off + len : last->off + last->len;
+      plan->bytes += end - (last->off + last->len);
+      last->len = end - last->off;
+      return;
+    }
+  }
+
+  if (plan->num_ranges == READ_PLAN_MAX_RANGES) {
+    struct read_range *last = &plan->ranges[plan->num_ranges - 1];
+    int best = -1;
+    uint32_t best_gap = off - (last->off + last->len);
+
+    for (int i = 0; i < plan->num_ranges - 1; i++) {
+      uint32_t gap = plan->ranges[i + 1].off - (plan->ranges[i].off + plan->ranges[i].len);
+      if (gap < best_gap) {
+        best_gap = gap;
+        best = i;
+      }
+    }
+
+    if (best == -1) {
+      /* cheapest to stretch the last range up to the new one */
+      plan->bytes += off + len - (last->off + last->len);
+      last->len = off + len - last->off;
+      return;
+    }
+    merge_next(plan, best);
+  }
+
+  plan->ranges[plan->num_ranges].off = off;
+  plan->ranges[plan->num_ranges].len = len;
+  plan->num_ranges++;
+  plan->bytes += len;
+}
+
+/* true if the len bytes at off lie within a single range of the plan */
+int read_plan_covers(const struct read_plan *plan, uint32_t off, uint32_t len)
+{
+  for (int i = 0; i < plan->num_ranges && plan->ranges[i].off <= off; i++) {
+    if (off + len <= plan->ranges[i].off + plan->ranges[i].len)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Bytes covered by both a and b, coalesced according to the gap of out.
+ * out must be a different plan from a and b.
+ */
+void read_plan_intersect(const struct read_plan *a, const struct read_plan *b, struct read_plan *out)
+{
+  int i = 0, j = 0;
+
+  read_plan_reset(out);
+
+  while (i < a->num_ranges && j < b->num_ranges) {
+    const struct read_range *ra = &a->ranges[i];
+    const struct read_range *rb = &b->ranges[j];
+    uint32_t start = ra->off > rb->off ? ra->off : rb->off;
+    uint32_t end_a = ra->off + ra->len;
+    uint32_t end_b = rb->off + rb->len;
+    uint32_t end = end_a < end_b ? end_a : end_b;
+
+    if (start < end)
+      read_plan_add(out, start, end - start);
+
+    if (end_a < end_b)
+      i++;
+    else
+      j++;
+  }
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "round-ring.h"
+#include "sched-profile.h"
+
+/* rounds published by the pollers, consumed in order by the consumer thread; a NULL slot closes its ring */
+static struct {
+  struct round_ring *ring;
+  struct round_slot *slot;
+} queue[ROUND_QUEUE_LEN];
+static unsigned queue_head = 0, queue_len = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static struct {
+  round_consumer fn;
+  void *arg;
+} consumers[ROUND_MAX_CONSUMERS];
+static int num_consumers = 0;
+static uint64_t consumed = 0;
+static uint64_t max_lag_ns = 0;
+
+/**
+ * Allocate the slots of a ring, page aligned and zeroed. A slot that never
+ * landed a whole copy has full_generation 0.
+ * Returns -1 if the memory cannot be allocated.
+ */
+int round_ring_init(struct round_ring *ring, int pod, int num_slots, size_t slot_size)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  void *mem;
+
+  if (num_slots < 2 || num_slots > ROUND_RING_MAX)
+    return -1;
+  slot_size = (slot_size + page - 1) / page * page;
+  if (posix_memalign(&mem, page, num_slots * slot_size) != 0)
+    return -1;
+  memset(mem, 0, num_slots * slot_size);
+
+  memset(ring, 0, sizeof(*ring));
+  ring->pod = pod;
+  ring->num_slots = num_slots;
+  ring->slot_size = slot_size;
+  ring->mem = mem;
+  for (int s = 0; s < num_slots; s++) {
+    ring->slots[s].base = ring->mem + (size_t)s * slot_size;
+    ring->slots[s].ring = ring;
+  }
+  pthread_mutex_init(&ring->mutex, NULL);
+  pthread_cond_init(&ring->released, NULL);
+  return 0;
+}
+
+/**
+ * Free the slots once the consumers released them all, see round_ring_close;
+ * the caller dropped its own references.
+ */
+void round_ring_free(struct round_ring *ring)
+{
+  pthread_mutex_lock(&ring->mutex);
+  for (int s = 0; s < ring->num_slots; s++) {
+    while (ring->slots[s].refs > 0)
+      pthread_cond_wait(&ring->released, &ring->mutex);
+  }
+  pthread_mutex_unlock(&ring->mutex);
+
+  free(ring->mem);
+  ring->mem = NULL;
+  pthread_mutex_destroy(&ring->mutex);
+  pthread_cond_destroy(&ring->released);
+}
+
+/**
+ * Take the least recently used free slot to land the READs of a round, with
+ * a reference for the caller. Returns NULL, counting an overrun, if every
+ * slot is still in use.
+ */
+struct round_slot * round_ring_acquire(struct round_ring *ring, uint64_t round)
+{
+  struct round_slot *slot = NULL;
+
+  pthread_mutex_lock(&ring->mutex);
+  for (int s = 0; s < ring->num_slots; s++) {
+    struct round_slot *c = &ring->slots[s];
+    if (c->refs == 0 && (slot == NULL || c->last_use < slot->last_use))
+      slot = c;
+  }
+  if (slot) {
+    slot->refs = 1;
+    slot->last_use = round;
+  } else {
+    ring->overruns++;
+  }
+  pthread_mutex_unlock(&ring->mutex);
+  return slot;
+}
+
+/**
+ * Oldest full_generation of the slots other than except that hold a whole
+ * copy of the current epoch, UINT64_MAX if none: the dirty chunks since then
+ * bring any of them up to date.
+ */
+uint64_t round_ring_oldest(struct round_ring *ring, const struct round_slot *except)
+{
+  uint64_t oldest = UINT64_MAX;
+
+  pthread_mutex_lock(&ring->mutex);
+  for (int s = 0; s < ring->num_slots; s++) {
+    const struct round_slot *c = &ring->slots[s];
+    if (c != except && c->epoch == ring->epoch && c->full_generation && c->full_generation < oldest)
+      oldest = c->full_generation;
+  }
+  pthread_mutex_unlock(&ring->mutex);
+  return oldest;
+}
+
+void round_slot_hold(struct round_slot *slot)
+{
+  pthread_mutex_lock(&slot->ring->mutex);
+  slot->refs++;
+  pthread_mutex_unlock(&slot->ring->mutex);
+}
+
+void round_slot_release(struct round_slot *slot)
+{
+  struct round_ring *ring = slot->ring;
+
+  pthread_mutex_lock(&ring->mutex);
+  if (--slot->refs == 0)
+    pthread_cond_broadcast(&ring->released);
+  pthread_mutex_unlock(&ring->mutex);
+}
+
+/**
+ * Hand the round landed in slot to the consumers, with a reference of its
+ * own: the caller keeps its reference. If the queue is full the round is not
+ * consumed and counted as an overrun.
+ */
+void round_ring_publish(struct round_slot *slot)
+{
+  int queued = 0;
+
+  slot->published_ns = mono_ns();
+  round_slot_hold(slot);
+
+  pthread_mutex_lock(&queue_mutex);
+  if (queue_len < ROUND_QUEUE_LEN) {
+    unsigned q = (queue_head + queue_len++) % ROUND_QUEUE_LEN;
+    queue[q].ring = slot->ring;
+    queue[q].slot = slot;
+    queued = 1;
+    pthread_cond_signal(&queue_cond);
+  }
+  pthread_mutex_unlock(&queue_mutex);
+
+  if (queued) {
+    __atomic_add_fetch(&slot->ring->published, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&slot->ring->overruns, 1, __ATOMIC_RELAXED);
+    round_slot_release(slot);
+  }
+}
+
+/**
+ * No more rounds will be published on ring: once the rounds queued before are
+ * consumed, the consumers release the slots they hold. Waits for room in the
+ * queue if needed.
+ */
+void round_ring_close(struct round_ring *ring)
+{
+  pthread_mutex_lock(&queue_mutex);
+  while (queue_len == ROUND_QUEUE_LEN) {
+    pthread_mutex_unlock(&queue_mutex);
+    usleep(1000);
+    pthread_mutex_lock(&queue_mutex);
+  }
+  unsigned q = (queue_head + queue_len++) % ROUND_QUEUE_LEN;
+  queue[q].ring = ring;
+  queue[q].slot = NULL;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+/* register a consumer of the rounds, before the consumer thread starts; -1 if too many */
+int round_consumer_add(round_consumer fn, void *arg)
+{
+  if (num_consumers == ROUND_MAX_CONSUMERS)
+    return -1;
+  consumers[num_consumers].fn = fn;
+  consumers[num_consumers].arg = arg;
+  num_consumers++;
+  return 0;
+}
+
+static void * consume(void *unused)
+{
+  while (1) {
+    struct round_ring *ring;
+    struct round_slot *slot;
+
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_len == 0)
+      pthread_cond_wait(&queue_cond, &queue_mutex);
+    ring = queue[queue_head].ring;
+    slot = queue[queue_head].slot;
+    queue_head = (queue_head + 1) % ROUND_QUEUE_LEN;
+    queue_len--;
+    pthread_mutex_unlock(&queue_mutex);
+
+    if (slot == NULL) {
+      for (int c = 0; c < num_consumers; c++)
+        consumers[c].fn(ring, NULL, consumers[c].arg);
+      continue;
+    }
+
+    uint64_t lag = mono_ns() - slot->published_ns;
+    for (int c = 0; c < num_consumers; c++)
+      consumers[c].fn(ring, slot, consumers[c].arg);
+    round_slot_release(slot);
+
+    __atomic_add_fetch(&consumed, 1, __ATOMIC_RELAXED);
+    if (lag > __atomic_load_n(&max_lag_ns, __ATOMIC_RELAXED))
+      __atomic_store_n(&max_lag_ns, lag, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* start the consumer thread, returns -1 if it cannot be created */
+int round_consumers_start(void)
+{
+  pthread_t tid;
+
+  if (pthread_create(&tid, NULL, consume, NULL) != 0)
+    return -1;
+  pthread_detach(tid);
+  return 0;
+}
+
+/* rounds consumed so far, and the longest they waited in the queue */
+void round_consumer_stats(uint64_t *rounds, uint64_t *max_lag)
+{
+  *rounds = __atomic_load_n(&consumed, __ATOMIC_RELAXED);
+  *max_lag = __atomic_load_n(&max_lag_ns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sched-profile.h"
+
+/**
+ * Pin thread on core unless -1, and run it under SCHED_FIFO at priority
+ * unless 0. Returns -1 if any failed, e.g. without CAP_SYS_NICE, the thread
+ * then keeps running as before.
+ */
+int sched_apply(pthread_t thread, int core, int priority)
+{
+  int ret = 0;
+
+  if (core >= 0) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set)) {
+      fprintf(stderr, "Error pinning thread on core %d\n", core);
+      ret = -1;
+    } else if (!sched_core_isolated(core)) {
+      fprintf(stderr, "Core %d is not isolated, other tasks may run on it\n", core);
+    }
+  }
+
+  if (priority > 0) {
+    struct sched_param param = { .sched_priority = priority };
+
+    if (pthread_setschedparam(thread, SCHED_FIFO, &param)) {
+      fprintf(stderr, "Error setting SCHED_FIFO priority %d (needs CAP_SYS_NICE)\n", priority);
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+/* 1 if core is in the isolated list of the kernel, e.g. "2-3,6" */
+int sched_core_isolated(int core)
+{
+  char buf[1024];
+  int found = 0;
+
+  FILE *f = fopen(SCHED_ISOLATED_FILE, "r");
+  if (f == NULL)
+    return 0;
+  if (fgets(buf, sizeof(buf), f) == NULL)
+    buf[0] = '\0';
+  fclose(f);
+
+  for (char *p = buf; *p && *p != '\n' && !found; ) {
+    char *end;
+    long first = strtol(p, &end, 10), last = first;
+
+    if (end == p)
+      break;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    found = core >= first && core <= last;
+    p = *end == ',' ? end + 1 : end;
+  }
+  return found;
+}
+
+/* CLOCK_MONOTONIC in ns, the clock of the ticks and of every latency measured on the read path */
+uint64_t mono_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Wait until deadline next (CLOCK_MONOTONIC): sleep until *lead_ns before
+ * it, then spin. The lead tracks twice the average oversleep, capped to
+ * spin_ns, so the spin usually covers the wakeup latency without burning the
+ * core; with spin_ns 0 we sleep until the deadline.
+ * Returns when we woke up, CLOCK_MONOTONIC ns.
+ */
+uint64_t sched_wait_tick(const struct timespec *next, uint64_t spin_ns, uint64_t *lead_ns)
+{
+  uint64_t due = (uint64_t)next->tv_sec * 1000000000ULL + next->tv_nsec;
+  uint64_t lead = *lead_ns < spin_ns ? *lead_ns : spin_ns;
+  struct timespec early = {
+    .tv_sec = (time_t)((due - lead) / 1000000000ULL),
+    .tv_nsec = (long)((due - lead) % 1000000000ULL)
+  };
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &early, NULL) == EINTR)
+    ;
+  uint64_t now = mono_ns();
+  if (spin_ns) {
+    uint64_t over = now - (due - lead);
+    *lead_ns += ((int64_t)(2 * over) - (int64_t)*lead_ns) / 8;
+    while (now < due)
+      now = mono_ns();
+  }
+  return now;
+}
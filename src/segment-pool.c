@@ -0,0 +1,64 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "segment-pool.h"
+
+static struct pod_region pool[SEGMENT_POOL_MAX];
+static int pool_len = 0;
+static int pool_cap = SEGMENT_POOL_DEFAULT;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* keep at most capacity regions, 0 to disable recycling */
+void segment_pool_init(int capacity)
+{
+  pool_cap = capacity < 0 ? 0 : (capacity > SEGMENT_POOL_MAX ? SEGMENT_POOL_MAX : capacity);
+}
+
+/**
+ * Recycle the region of a pod gone, its session closed.
+ * Returns -1 if the region cannot be recycled or the pool is full, the
+ * caller releases it.
+ */
+int segment_pool_put(const struct pod_region *region)
+{
+  int ok = 0;
+
+  if (!region->memfd || region->fd == -1)
+    return -1;
+
+  pthread_mutex_lock(&pool_mutex);
+  if (pool_len < pool_cap) {
+    memset(region->base, 0, region->size);
+    pool[pool_len++] = *region;
+    ok = 1;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  return ok ? 0 : -1;
+}
+
+/**
+ * Take a zeroed region of size bytes from the pool, with its fd, mapping and
+ * MR (which may be NULL if it was never registered), preferably placed on
+ * NUMA node.
+ * Returns -1 if there is none.
+ */
+int segment_pool_get(size_t size, int node, struct pod_region *region)
+{
+  int found = -1;
+
+  pthread_mutex_lock(&pool_mutex);
+  for (int i = pool_len - 1; i >= 0; i--) {
+    if (pool[i].size != size)
+      continue;
+    if (found == -1 || pool[i].node == node)
+      found = i;
+    if (pool[i].node == node)
+      break;
+  }
+  if (found != -1) {
+    *region = pool[found];
+    pool[found] = pool[--pool_len];
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  return found == -1 ? -1 : 0;
+}
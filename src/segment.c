@@ -0,0 +1,437 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "segment.h"
+#include "crc32c.h"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/* FNV-1a */
+static uint32_t hash_u32(uint32_t h, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) {
+    h ^= (v >> (8 * i)) & 0xff;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t hash_bytes(uint32_t h, const void *buf, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++) {
+    h ^= ((const uint8_t *)buf)[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t layout_hash(const struct segment_layout *layout)
+{
+  uint32_t h = 2166136261u;
+
+  h = hash_u32(h, SEGMENT_VERSION);
+  h = hash_u32(h, layout->size);
+  h = hash_u32(h, layout->chunk_size);
+  h = hash_u32(h, layout->flags);
+  h = hash_u32(h, layout->max_slots);
+  return h;
+}
+
+/* the pod rehashes the layout whenever it changes the directory */
+static void update_layout_hash(struct segment *seg)
+{
+  uint32_t h = layout_hash(&seg->layout);
+
+  h = hash_bytes(h, seg->dir, sizeof(struct segment_dir) + seg->dir->num_slots * sizeof(struct segment_slot));
+  __atomic_store_n(&seg->hdr->layout_hash, h, __ATOMIC_RELEASE);
+}
+
+/**
+ * Compute where each region of a segment lives. The dirty bitmap is sized
+ * for the data area that follows it and rounded to 64-bit words, the data
+ * area starts on a cache line boundary. The CRC table takes the last cache
+ * lines of the segment, sized like the bitmap.
+ * Returns -1 if the parameters are invalid or the segment is too small.
+ */
+int segment_compute_layout(uint32_t size, uint32_t chunk_size, uint16_t flags, uint16_t max_slots,
+                           struct segment_layout *layout)
+{
+  memset(layout, 0, sizeof(*layout));
+
+  layout->size = size;
+  layout->flags = flags;
+  layout->max_slots = max_slots;
+  layout->stats_off = SEGMENT_HEADER_SIZE;
+  layout->control_off = layout->stats_off + SEGMENT_STATS_SIZE;
+  layout->bitmap_off = layout->control_off + SEGMENT_CONTROL_SIZE;
+  layout->data_off = layout->bitmap_off;
+
+  if ((flags & SEGMENT_F_CRC) && !(flags & SEGMENT_F_DIRTY))
+    return -1;
+
+  if (flags & SEGMENT_F_DIRTY) {
+    if (chunk_size < SEGMENT_MIN_CHUNK || chunk_size > SEGMENT_MAX_CHUNK ||
+        (chunk_size & (chunk_size - 1)))
+      return -1;
+    if (size <= layout->bitmap_off)
+      return -1;
+
+    /* bitmap sized on the space left, slightly over-provisioned as it also covers itself */
+    uint32_t max_chunks = (size - layout->bitmap_off + chunk_size - 1) / chunk_size;
+    layout->chunk_size = chunk_size;
+    layout->bitmap_len = ALIGN_UP((max_chunks + 7) / 8, sizeof(uint64_t));
+  }
+
+  layout->dir_off = layout->bitmap_off + layout->bitmap_len;
+  if (max_slots)
+    layout->dir_len = sizeof(struct segment_dir) + max_slots * sizeof(struct segment_slot);
+  layout->data_off = ALIGN_UP(layout->dir_off + layout->dir_len, 64);
+
+  if (size <= layout->data_off)
+    return -1;
+
+  layout->data_len = size - layout->data_off;
+  if (flags & SEGMENT_F_CRC) {
+    layout->crc_len = ALIGN_UP((layout->data_len + chunk_size - 1) / chunk_size * sizeof(uint32_t), 64);
+    layout->crc_off = (size - layout->crc_len) / 64 * 64;
+    if (layout->crc_off <= layout->data_off)
+      return -1;
+    layout->data_len = layout->crc_off - layout->data_off;
+  }
+  if (flags & SEGMENT_F_DIRTY)
+    layout->num_chunks = (layout->data_len + chunk_size - 1) / chunk_size;
+
+  layout->hash = layout_hash(layout);
+  return 0;
+}
+
+int segment_read_layout(const void *base, struct segment_layout *layout)
+{
+  const struct segment_header *hdr = (const struct segment_header *)base;
+
+  if (hdr->magic != SEGMENT_MAGIC || hdr->version != SEGMENT_VERSION)
+    return -1;
+
+  if (segment_compute_layout(hdr->size, hdr->chunk_size, hdr->flags, hdr->max_slots, layout))
+    return -1;
+
+  layout->hash = hdr->layout_hash;
+  return 0;
+}
+
+/* directory in a (local copy of a) segment, NULL if the segment has none */
+const struct segment_dir * segment_get_dir(const struct segment_layout *layout, const void *base)
+{
+  if (layout->dir_len == 0)
+    return NULL;
+
+  return (const struct segment_dir *)((const char *)base + layout->dir_off);
+}
+
+/* host stats line of a segment, right after the header in every layout */
+struct segment_stats * segment_get_stats(void *base)
+{
+  return (struct segment_stats *)((char *)base + SEGMENT_HEADER_SIZE);
+}
+
+/**
+ * Initialize a freshly created segment, with the SEGMENT_F_* features of
+ * flags: dirty tracking needs a chunk_size, max_slots of 0 leaves the segment
+ * without directory.
+ */
+int segment_init(void *base, uint32_t size, uint32_t chunk_size, uint16_t flags, uint16_t max_slots, uint32_t pid)
+{
+  struct segment_layout layout;
+  struct segment_header *hdr = (struct segment_header *)base;
+
+  if (segment_compute_layout(size, chunk_size, flags, max_slots, &layout))
+    return -1;
+
+  memset(base, 0, layout.data_off);
+  /* the data area is zeroed (fresh or recycled memory), vouch for it until the pod attaches:
+     generation 0 can be read and verified like any other */
+  if (flags & SEGMENT_F_CRC) {
+    uint32_t *crc = (uint32_t *)((char *)base + layout.crc_off);
+    char *zero = calloc(1, chunk_size);
+    if (zero == NULL)
+      return -1;
+    uint32_t full = crc32c(zero, chunk_size);
+    for (uint32_t c = 0; c < layout.num_chunks; c++) {
+      uint32_t len = segment_chunk_len(&layout, c);
+      crc[c] = len == chunk_size ? full : crc32c(zero, len);
+    }
+    free(zero);
+  }
+  hdr->size = size;
+  hdr->chunk_size = chunk_size;
+  hdr->flags = flags;
+  hdr->max_slots = max_slots;
+  hdr->pid = pid;
+  hdr->layout_hash = layout.hash;
+  hdr->version = SEGMENT_VERSION;
+  __atomic_store_n(&hdr->magic, SEGMENT_MAGIC, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int segment_attach(struct segment *seg, void *base)
+{
+  memset(seg, 0, sizeof(*seg));
+
+  if (segment_read_layout(base, &seg->layout))
+    return -1;
+
+  seg->base = (char *)base;
+  seg->hdr = (struct segment_header *)base;
+  seg->ctl = (struct segment_control *)(seg->base + seg->layout.control_off);
+  seg->bitmap = (uint64_t *)(seg->base + seg->layout.bitmap_off);
+  seg->dir = (struct segment_dir *)segment_get_dir(&seg->layout, base);
+  seg->data = seg->base + seg->layout.data_off;
+
+  if (seg->layout.num_chunks)
+    seg->chunk_gen = calloc(seg->layout.num_chunks, sizeof(uint64_t));
+  seg->used_len = seg->hdr->used_len;
+
+  /* the table vouches for the data area as segment_init or the last publish left it,
+     only segment_publish rewrites CRCs, of the chunks it publishes */
+  if (seg->layout.flags & SEGMENT_F_CRC)
+    seg->crc = (uint32_t *)(seg->base + seg->layout.crc_off);
+
+  return 0;
+}
+
+void segment_set_service(struct segment *seg, const char *service)
+{
+  if (!seg->dir)
+    return;
+
+  strncpy(seg->dir->service, service, SEGMENT_SERVICE_LEN - 1);
+  update_layout_hash(seg);
+}
+
+/**
+ * Allocate a named slot of len bytes in the data area, 8-byte aligned, read
+ * at the resolution of the given tier.
+ * Returns the slot index, or -1 if the directory or the data area is full.
+ */
+int segment_add_slot(struct segment *seg, const char *name, uint32_t len, uint8_t tier)
+{
+  struct segment_dir *dir = seg->dir;
+
+  if (!dir || dir->num_slots == seg->layout.max_slots ||
+      dir->next_off > seg->layout.data_len || len > seg->layout.data_len - dir->next_off)
+    return -1;
+
+  struct segment_slot *slot = &dir->slots[dir->num_slots];
+  memset(slot, 0, sizeof(*slot));
+  strncpy(slot->name, name, SEGMENT_NAME_LEN - 1);
+  slot->off = dir->next_off;
+  slot->len = len;
+  slot->tier = tier < SEGMENT_MAX_TIERS ? tier : SEGMENT_MAX_TIERS - 1;
+
+  dir->next_off = ALIGN_UP(dir->next_off + len, 8);
+  dir->num_slots++;
+  update_layout_hash(seg);
+
+  return dir->num_slots - 1;
+}
+
+/**
+ * Allocate a slot of count cumulative counters (uint64_t, only ever growing
+ * but for resets to 0), which agent-nic turns into per-round deltas.
+ * Returns the slot index, or -1 if the directory or the data area is full.
+ */
+int segment_add_counters(struct segment *seg, const char *name, uint32_t count, uint8_t tier)
+{
+  int slot = segment_add_slot(seg, name, count * sizeof(uint64_t), tier);
+
+  if (slot != -1) {
+    seg->dir->slots[slot].flags = SEGMENT_SLOT_COUNTERS;
+    update_layout_hash(seg);
+  }
+  return slot;
+}
+
+/**
+ * Write len bytes at offset off of the data area. Dirty bits are set before
+ * the copy, so agent-nic never observes new data without its bit set.
+ * Returns -1 (EINVAL) and writes nothing if the range is not in the data area.
+ */
+int segment_write(struct segment *seg, uint32_t off, const void *src, uint32_t len)
+{
+  if ((uint64_t)off + len > seg->layout.data_len) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (len == 0)
+    return 0;
+
+  if (seg->chunk_gen) {
+    uint64_t next_gen = seg->hdr->generation + 1;
+    uint32_t first = off / seg->layout.chunk_size;
+    uint32_t last = (off + len - 1) / seg->layout.chunk_size;
+
+    for (uint32_t c = first; c <= last; c++) {
+      seg->chunk_gen[c] = next_gen;
+      __atomic_fetch_or(&seg->bitmap[c / 64], 1ULL << (c % 64), __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+  memcpy(seg->data + off, src, len);
+
+  if (off + len > seg->used_len)
+    seg->used_len = off + len;
+  return 0;
+}
+
+/* write up to the length of the slot; returns -1 (EINVAL) if there is no such slot */
+int segment_write_slot(struct segment *seg, int slot, const void *src, uint32_t len)
+{
+  if (!seg->dir || slot < 0 || (uint32_t)slot >= seg->dir->num_slots) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct segment_slot *s = &seg->dir->slots[slot];
+  return segment_write(seg, s->off, src, len < s->len ? len : s->len);
+}
+
+/**
+ * Publish the writes done so far as a new generation. Chunks whose last write
+ * belongs to a generation already acknowledged by agent-nic are cleared from
+ * the bitmap (generation handshake): agent-nic reads the data of dirty chunks
+ * after reading the generation, hence an acknowledged write has been read.
+ * With CRCs, those of the chunks written for this generation are updated.
+ */
+void segment_publish(struct segment *seg)
+{
+  if (seg->chunk_gen) {
+    uint64_t ack = __atomic_load_n(&seg->ctl->ack_generation, __ATOMIC_ACQUIRE);
+    uint64_t next_gen = seg->hdr->generation + 1;
+    uint32_t num_words = (seg->layout.num_chunks + 63) / 64;
+
+    for (uint32_t w = 0; w < num_words; w++) {
+      uint64_t bits = seg->bitmap[w];
+      uint64_t clear = 0;
+
+      while (bits) {
+        int b = __builtin_ctzll(bits);
+        uint32_t c = w * 64 + b;
+        if (seg->chunk_gen[c] <= ack)
+          clear |= 1ULL << b;
+        else if (seg->crc && seg->chunk_gen[c] == next_gen)
+          seg->crc[c] = crc32c(seg->data + (size_t)c * seg->layout.chunk_size, segment_chunk_len(&seg->layout, c));
+        bits &= bits - 1;
+      }
+      if (clear)
+        __atomic_fetch_and(&seg->bitmap[w], ~clear, __ATOMIC_RELAXED);
+    }
+  }
+
+  seg->hdr->used_len = seg->used_len;
+  __atomic_store_n(&seg->hdr->generation, seg->hdr->generation + 1, __ATOMIC_RELEASE);
+  segment_heartbeat(seg);
+}
+
+/* when agent-nic first read the segment (ns since the epoch, on its clock), 0 if not yet */
+uint64_t segment_first_read(const struct segment *seg)
+{
+  return __atomic_load_n(&seg->ctl->first_read_ns, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Tell agent-nic the pod is alive. Call it from the pod main loop (publishing
+ * does), not from a separate thread, so that a hung pod stops beating too.
+ */
+void segment_heartbeat(struct segment *seg)
+{
+  __atomic_store_n(&seg->hdr->heartbeat, seg->hdr->heartbeat + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Build the plan covering the dirty chunks of a segment, given a local copy
+ * of its header and bitmap at the same offsets as in the remote segment.
+ */
+void segment_dirty_plan(const struct segment_layout *layout, const void *base, struct read_plan *plan)
+{
+  const uint64_t *bitmap = (const uint64_t *)((const char *)base + layout->bitmap_off);
+  uint32_t num_words = (layout->num_chunks + 63) / 64;
+
+  read_plan_reset(plan);
+
+  for (uint32_t w = 0; w < num_words; w++) {
+    uint64_t bits = bitmap[w];
+
+    while (bits) {
+      uint32_t c = w * 64 + __builtin_ctzll(bits);
+      uint32_t off = c * layout->chunk_size;
+      uint32_t len = layout->chunk_size;
+
+      bits &= bits - 1;
+      if (c >= layout->num_chunks)
+        break;
+      if (off + len > layout->data_len)
+        len = layout->data_len - off;
+      read_plan_add(plan, layout->data_off + off, len);
+    }
+  }
+}
+
+/* bytes of chunk, the last one of the data area may be short */
+uint32_t segment_chunk_len(const struct segment_layout *layout, uint32_t chunk)
+{
+  uint32_t off = chunk * layout->chunk_size;
+
+  return off + layout->chunk_size > layout->data_len ? layout->data_len - off : layout->chunk_size;
+}
+
+/* chunks of the data area that the len bytes at off of the segment cover whole, from *first on */
+uint32_t segment_covered_chunks(const struct segment_layout *layout, uint32_t off, uint32_t len, uint32_t *first)
+{
+  uint32_t start = off > layout->data_off ? off - layout->data_off : 0;
+  uint32_t end = off + len < layout->data_off + layout->data_len ? off + len - layout->data_off : layout->data_len;
+  uint32_t last;
+
+  if (off + len <= layout->data_off || start >= layout->data_len)
+    return 0;
+  *first = (start + layout->chunk_size - 1) / layout->chunk_size;
+  last = end == layout->data_len ? layout->num_chunks : end / layout->chunk_size;
+  return last > *first ? last - *first : 0;
+}
+
+/**
+ * Add to plan the CRCs of the chunks its ranges cover whole, a single range
+ * from the first to the last of them (the CRC table follows the data area,
+ * the plan stays sorted).
+ */
+void segment_crc_plan(const struct segment_layout *layout, struct read_plan *plan)
+{
+  uint32_t lo = UINT32_MAX, hi = 0;
+
+  for (int k = 0; k < plan->num_ranges; k++) {
+    uint32_t first, n = segment_covered_chunks(layout, plan->ranges[k].off, plan->ranges[k].len, &first);
+    if (n == 0)
+      continue;
+    if (first < lo)
+      lo = first;
+    if (first + n > hi)
+      hi = first + n;
+  }
+  if (hi > lo)
+    read_plan_add(plan, layout->crc_off + lo * sizeof(uint32_t), (hi - lo) * sizeof(uint32_t));
+}
+
+/**
+ * Build the plan covering the used part of the data area, given a local copy
+ * of the segment header.
+ */
+void segment_used_plan(const struct segment_layout *layout, const void *base, struct read_plan *plan)
+{
+  const struct segment_header *hdr = (const struct segment_header *)base;
+  uint32_t used = hdr->used_len < layout->data_len ? hdr->used_len : layout->data_len;
+
+  read_plan_reset(plan);
+  read_plan_add(plan, layout->data_off, used);
+}
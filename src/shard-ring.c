@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard-ring.h"
+
+/* finalizer of splitmix64, spreads close inputs (pids, vnode numbers) over the ring */
+static uint64_t mix(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t hash_instance(const struct shard_instance *in, int vnode)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;   // FNV-1a of "addr:port"
+  const char *parts[] = {in->addr, ":", in->port};
+
+  for (int p = 0; p < 3; p++) {
+    for (const char *c = parts[p]; *c; c++) {
+      h ^= (unsigned char)*c;
+      h *= 0x100000001b3ULL;
+    }
+  }
+  return mix(h + (uint64_t)vnode);
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+  const struct shard_point *pa = a, *pb = b;
+  return (pa->hash > pb->hash) - (pa->hash < pb->hash);
+}
+
+void shard_ring_init(struct shard_ring *ring)
+{
+  ring->num_instances = 0;
+  ring->num_points = 0;
+}
+
+/**
+ * Add an instance and its points to the ring, duplicates are ignored.
+ * Returns -1 if the ring is full.
+ */
+int shard_ring_add(struct shard_ring *ring, const char *addr, const char *port)
+{
+  struct shard_instance *in;
+
+  if (ring->num_instances == SHARD_MAX_INSTANCES)
+    return -1;
+
+  in = &ring->instances[ring->num_instances];
+  memset(in, 0, sizeof(*in));
+  strncpy(in->addr, addr, SHARD_ADDR_LEN - 1);
+  strncpy(in->port, port, SHARD_PORT_LEN - 1);
+
+  for (int i = 0; i < ring->num_instances; i++) {
+    if (shard_instance_equal(&ring->instances[i], in))
+      return 0;
+  }
+
+  for (int v = 0; v < SHARD_VNODES; v++) {
+    ring->points[ring->num_points].hash = hash_instance(in, v);
+    ring->points[ring->num_points].instance = ring->num_instances;
+    ring->num_points++;
+  }
+  ring->num_instances++;
+
+  qsort(ring->points, ring->num_points, sizeof(struct shard_point), cmp_point);
+  return 0;
+}
+
+/**
+ * Build the ring from a file with an agent-nic instance per line:
+ *
+ *   <address> <port>
+ *
+ * Returns -1 if the file cannot be opened or lists no instance.
+ */
+int shard_ring_load(struct shard_ring *ring, const char *path)
+{
+  char line[256];
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror("Error opening shards file");
+    return -1;
+  }
+
+  shard_ring_init(ring);
+  while (fgets(line, sizeof(line), f)) {
+    char *save = NULL;
+    char *addr = strtok_r(line, " \t\n", &save);
+    char *port = strtok_r(NULL, " \t\n", &save);
+
+    if (addr == NULL || addr[0] == '#' || port == NULL)
+      continue;
+    if (shard_ring_add(ring, addr, port)) {
+      fprintf(stderr, "Too many agent-nic instances, at most %d\n", SHARD_MAX_INSTANCES);
+      break;
+    }
+  }
+  fclose(f);
+
+  return ring->num_instances > 0 ? 0 : -1;
+}
+
+/* instance owning pod pid, NULL if the ring is empty */
+const struct shard_instance * shard_ring_lookup(const struct shard_ring *ring, uint32_t pid)
+{
+  uint64_t h = mix(pid);
+  int lo = 0, hi = ring->num_points;
+
+  if (ring->num_points == 0)
+    return NULL;
+
+  /* first point at or after h, wrapping around */
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ring->points[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == ring->num_points)
+    lo = 0;
+  return &ring->instances[ring->points[lo].instance];
+}
+
+int shard_instance_equal(const struct shard_instance *a, const struct shard_instance *b)
+{
+  return strcmp(a->addr, b->addr) == 0 && strcmp(a->port, b->port) == 0;
+}
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sched-profile.h"
+
+/**
+ * Interference benchmark of the tick thread of agent-nic: a thread wakes up
+ * at absolute deadlines like tick does, under a scheduling profile, and
+ * records how late each wakeup is, first on an idle host, then with
+ * background load on every core. Jitter percentiles of both runs tell what
+ * the profile buys, e.g. an isolated core with SCHED_FIFO against the
+ * default policy.
+ * usage: ./tick-bench [-i interval us] [-n ticks] [-t core] [-F priority] [-J spin us] [-l load threads]
+ */
+
+#define TICK_BENCH_MAX_LOAD 256
+
+static uint64_t interval_ns = 1000000;
+static int num_ticks = 10000;
+static struct sched_profile profile = { .tick_core = -1 };
+static uint64_t spin_ns = 0;
+static volatile int stop_load = 0;
+
+static uint64_t ts_ns(const struct timespec *t)
+{
+  return (uint64_t)t->tv_sec * 1000000000ULL + t->tv_nsec;
+}
+
+/* wake up num_ticks times, recording the lateness of each wakeup in ns */
+static void * ticker(void *arg)
+{
+  uint64_t *late = arg;
+  uint64_t lead_ns = 0;
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (int i = 0; i < num_ticks; i++) {
+    next.tv_nsec += interval_ns % 1000000000;
+    next.tv_sec += interval_ns / 1000000000 + next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    late[i] = sched_wait_tick(&next, spin_ns, &lead_ns) - ts_ns(&next);
+  }
+  return NULL;
+}
+
+/* background load: spin and touch memory, as other tasks on the ARM cores would */
+static void * load(void *arg)
+{
+  static __thread char buf[1 << 20];
+  unsigned long x = (unsigned long)arg;
+
+  while (!stop_load) {
+    for (size_t i = 0; i < sizeof(buf); i += 64)
+      buf[i] = (char)(x += i);
+  }
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, uint64_t *late)
+{
+  pthread_t t;
+
+  if (pthread_create(&t, NULL, ticker, late)) {
+    perror("Error creating tick thread");
+    exit(EXIT_FAILURE);
+  }
+  sched_apply(t, profile.tick_core, profile.fifo_priority);
+  pthread_join(t, NULL);
+
+  qsort(late, num_ticks, sizeof(*late), cmp_u64);
+  printf("%-12s p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n", name,
+         late[num_ticks / 2] / 1e3, late[(size_t)(num_ticks * 0.99)] / 1e3,
+         late[(size_t)(num_ticks * 0.999)] / 1e3, late[num_ticks - 1] / 1e3);
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-i interval us] [-n ticks] [-t core] [-F priority] [-J spin us] [-l load threads]\n", argv0);
+  fprintf(stderr, "  -i  tick interval in us (default 1000)\n");
+  fprintf(stderr, "  -n  ticks per run (default 10000)\n");
+  fprintf(stderr, "  -t  pin the tick thread on this core, as agent-nic -t\n");
+  fprintf(stderr, "  -F  run the tick thread under SCHED_FIFO at this priority, as agent-nic -F\n");
+  fprintf(stderr, "  -J  wake up early and spin until the tick, at most this long, as agent-nic -J\n");
+  fprintf(stderr, "  -l  background load threads, unpinned (default one per online core)\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int num_load = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t loaders[TICK_BENCH_MAX_LOAD];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:n:t:F:J:l:h")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval_ns = strtoull(optarg, NULL, 10) * 1000;
+      break;
+    case 'n':
+      num_ticks = atoi(optarg);
+      break;
+    case 't':
+      profile.tick_core = atoi(optarg);
+      break;
+    case 'F':
+      profile.fifo_priority = atoi(optarg);
+      break;
+    case 'J':
+      spin_ns = strtoull(optarg, NULL, 10) * 1000;
+      break;
+    case 'l':
+      num_load = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (interval_ns == 0 || num_ticks < 1000 || num_load < 0 || num_load > TICK_BENCH_MAX_LOAD)
+    usage(argv[0]);
+
+  uint64_t *late = malloc(num_ticks * sizeof(*late));
+  if (late == NULL) {
+    perror("Error allocating samples");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%d ticks every %lu us, tick core %d%s, %s, spin %lu us\n", num_ticks, interval_ns / 1000, profile.tick_core,
+         profile.tick_core >= 0 && sched_core_isolated(profile.tick_core) ? " (isolated)" : "",
+         profile.fifo_priority ? "SCHED_FIFO" : "default policy", spin_ns / 1000);
+  run("idle", late);
+
+  for (int i = 0; i < num_load; i++) {
+    if (pthread_create(&loaders[i], NULL, load, (void *)(uintptr_t)i)) {
+      num_load = i;
+      break;
+    }
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "load x%d", num_load);
+  run(name, late);
+
+  stop_load = 1;
+  for (int i = 0; i < num_load; i++)
+    pthread_join(loaders[i], NULL);
+  free(late);
+  return 0;
+}
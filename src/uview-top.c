@@ -0,0 +1,134 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nic-stats.h"
+
+/**
+ * top-style viewer of the live state of an agent-nic instance: maps its stats
+ * object read-only and prints the connections and their rates every
+ * interval. agent-nic never notices, it does not wait for us.
+ * usage: ./uview-top [-i ms] [-n refreshes] <agent-nic port | stats name>
+ */
+
+static const char *stage_names[NIC_STATS_STAGES] = { "tick", "wakeup", "post", "first-cqe", "last-cqe", "decode", "export" };
+
+static struct nic_stats_pod prev[NIC_STATS_MAX_PODS];   // our last sample of each connection
+static double prev_s[NIC_STATS_MAX_PODS];               // when, 0 if the slot was not connected then
+
+static double now_s(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* refresh, last is when the previous one was, 0 for the first */
+static void show(const struct nic_stats *st, double last, int clear)
+{
+  struct nic_stats_global g;
+  double now = now_s();
+  double up = now - st->start_ns / 1e9;
+
+  if (nic_stats_read(&st->global.seq, &g, &st->global, sizeof(g)))
+    memset(&g, 0, sizeof(g));
+
+  if (clear)
+    printf("\033[H\033[2J");
+  printf("agent-nic up %.0f s, round %lu every %.1f us, tick late %.1f us (max %.1f us), %u connections\n\n",
+         up, g.round, g.tick_ns / 1e3, g.tick_late_ns / 1e3, g.tick_late_max_ns / 1e3,
+         __atomic_load_n(&st->connections, __ATOMIC_RELAXED));
+  printf("%5s %8s %5s %9s %9s %9s %8s %6s %3s %5s %9s %6s %6s", "pod", "pid", "parts", "rounds/s", "MB/s", "READs/s",
+         "skipped", "errors", "lvl", "stall", "cq", "age ms", "ivl ms");
+  for (int s = 0; s < NIC_STATS_STAGES; s++)
+    printf(" %9s", stage_names[s]);
+  printf("  (us)\n");
+
+  for (int i = 0; i < NIC_STATS_MAX_PODS; i++) {
+    const struct nic_stats_pod *src = &st->pods[i];
+    uint32_t state = __atomic_load_n(&src->state, __ATOMIC_RELAXED);
+    struct nic_stats_pod cur, *p = &cur, *q = &prev[i];
+    char cq[24];
+
+    if (state != NIC_POD_CONNECTED) {
+      prev_s[i] = 0;
+      continue;
+    }
+    if (nic_stats_read(&src->seq, p, src, sizeof(*p)))
+      continue;
+    /* rates since our last sample of the connection. One new to us (the slot was
+       free, closed or had another pod, or this is our first refresh) started from
+       zero after the previous refresh, or after agent-nic started */
+    if (prev_s[i] == 0 || q->pid != p->pid || p->rounds < q->rounds) {
+      memset(q, 0, sizeof(*q));
+      prev_s[i] = last ? last : st->start_ns / 1e9;
+    }
+    double dt = now - prev_s[i] > 0 ? now - prev_s[i] : 1;
+    snprintf(cq, sizeof(cq), "%u/%u", p->cq_hwm, p->cq_size);
+    printf("%5d %8u %5u %9.1f %9.2f %9.1f %8lu %6lu %3u %5s %9s %6.1f %6.1f", i, p->pid, p->num_parts,
+           (p->rounds - q->rounds) / dt, (p->bytes - q->bytes) / dt / 1e6, (p->reads - q->reads) / dt,
+           p->skipped, p->errors, p->level, p->stalled ? "yes" : "no", cq,
+           p->read_ns ? (now_s() - p->read_ns / 1e9) * 1e3 : 0.0, p->read_interval_ns / 1e6);
+    for (int s = 0; s < NIC_STATS_STAGES; s++)
+      printf(" %9.1f", p->stage_ns[s] / 1e3);
+    printf("\n");
+    *q = cur;
+    prev_s[i] = now;
+  }
+  fflush(stdout);
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-i ms] [-n refreshes] <agent-nic port | stats name>\n", argv0);
+  fprintf(stderr, "  -i  refresh interval (default 1000 ms)\n");
+  fprintf(stderr, "  -n  exit after this many refreshes, printed one after the other (default 0, forever)\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int interval_ms = 1000, count = 0, opt;
+  char name[256];
+
+  while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval_ms = atoi(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1 || interval_ms <= 0)
+    usage(argv[0]);
+
+  /* a port stands for the default name agent-nic uses */
+  if (isdigit((unsigned char)argv[optind][0]))
+    snprintf(name, sizeof(name), "/agent-nic-%s.stats", argv[optind]);
+  else
+    snprintf(name, sizeof(name), "%s", argv[optind]);
+
+  const struct nic_stats *st = nic_stats_attach(name);
+  if (st == NULL) {
+    fprintf(stderr, "No agent-nic stats in %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  double last = 0;
+  for (int n = 0; count == 0 || n < count; n++) {
+    double now = now_s();
+    show(st, last, count == 0);
+    last = now;
+    if (count == 0 || n + 1 < count)
+      usleep(interval_ms * 1000);
+  }
+  return 0;
+}